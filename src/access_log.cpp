@@ -0,0 +1,295 @@
+#include "access_log.h"
+
+#include "http_utils.h"
+#include "str_utils.h"
+
+#include <algorithm>
+#include <charconv>
+#include <utility>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include <netinet/in.h>
+
+#include <sys/uio.h>
+
+namespace {
+constexpr std::size_t kMaxLinesPerWrite{64};
+// Files rotated within the same second get a sequence number, giving up beyond it rather than looping
+constexpr unsigned kMaxRotationsPerSecond{1000};
+
+void AppendNumber(std::string& line, std::uint64_t number) {
+    std::array<char, 24> buf;
+    const auto [ptr, ec]{std::to_chars(buf.data(), buf.data() + buf.size(), number)};
+    line.append(buf.data(), ptr);
+}
+
+void AppendTimestamp(std::string& line, std::chrono::system_clock::time_point timestamp) {
+    const auto since_epoch{timestamp.time_since_epoch()};
+    const std::time_t seconds{std::chrono::duration_cast<std::chrono::seconds>(since_epoch).count()};
+    const auto millis{std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count() % 1000};
+    std::tm tm;
+    gmtime_r(&seconds, &tm);
+    std::array<char, 32> buf;
+    const size_t size{std::strftime(buf.data(), buf.size(), "%Y-%m-%dT%H:%M:%S", &tm)};
+    line.append(buf.data(), size);
+    line += '.';
+    line += static_cast<char>('0' + millis / 100);
+    line += static_cast<char>('0' + millis / 10 % 10);
+    line += static_cast<char>('0' + millis % 10);
+    line += 'Z';
+}
+
+void AppendPeer(std::string& line, const sockaddr_storage& peer) {
+    std::array<char, INET6_ADDRSTRLEN> buf;
+    if (peer.ss_family == AF_INET) {
+        const auto& addr{reinterpret_cast<const sockaddr_in&>(peer)};
+        line += inet_ntop(AF_INET, &addr.sin_addr, buf.data(), buf.size());
+        line += ':';
+        AppendNumber(line, ntohs(addr.sin_port));
+    } else if (peer.ss_family == AF_INET6) {
+        const auto& addr{reinterpret_cast<const sockaddr_in6&>(peer)};
+        line += '[';
+        line += inet_ntop(AF_INET6, &addr.sin6_addr, buf.data(), buf.size());
+        line += "]:";
+        AppendNumber(line, ntohs(addr.sin6_port));
+    } else if (peer.ss_family == AF_UNIX) {
+        // Clients of Unix sockets are unnamed
+        line += "unix";
+    } else {
+        line += '-';
+    }
+}
+
+void AppendQuoted(std::string& line, std::string_view str) {
+    static constexpr std::string_view kHexDigits{"0123456789abcdef"};
+    line += '"';
+    for (const char ch : str) {
+        const auto byte{static_cast<unsigned char>(ch)};
+        if (ch == '"' || ch == '\\') {
+            line += '\\';
+            line += ch;
+        } else if (byte < 0x20 || byte >= 0x7f) {
+            line += "\\x";
+            line += kHexDigits[byte >> 4];
+            line += kHexDigits[byte & 0xf];
+        } else {
+            line += ch;
+        }
+    }
+    line += '"';
+}
+
+// Each phase is timed from the previous one the request went through, e.g. a 404 has no handler phases
+void AppendTimings(std::string& line, const RequestTimings& timings) {
+    static constexpr std::array<std::string_view, kRequestPhaseCount> kPhaseKeys{
+        "", " wait_us=", " headers_us=", " body_us=", " dispatch_us=", " handler_us=", " write_us="};
+    auto previous{RequestPhase::kAccepted};
+    for (std::size_t phase_index{1}; phase_index < kRequestPhaseCount; ++phase_index) {
+        const auto phase{static_cast<RequestPhase>(phase_index)};
+        if (const std::optional<std::chrono::nanoseconds> duration{timings.Between(previous, phase)}) {
+            line += kPhaseKeys[phase_index];
+            AppendNumber(line, static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::microseconds>(*duration).count()));
+            previous = phase;
+        }
+    }
+}
+
+std::string FormatRecord(const AccessLogRecord& record) {
+    std::string line;
+    line += "ts=";
+    AppendTimestamp(line, record.timestamp);
+    line += " peer=";
+    AppendPeer(line, record.peer);
+    line += " method=";
+    line += record.method ? ToString(*record.method) : "-";
+    line += " path=";
+    AppendQuoted(line, std::string_view{record.path.data(), record.path_size});
+    line += " status=";
+    AppendNumber(line, record.status);
+    line += " bytes=";
+    AppendNumber(line, record.bytes);
+    line += " duration_us=";
+    AppendNumber(line, static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(record.duration).count()));
+    if (record.timings) {
+        AppendTimings(line, *record.timings);
+    }
+    line += '\n';
+    return line;
+}
+}
+
+void AccessLogRecord::SetPath(std::string_view request_path) noexcept {
+    path_size = static_cast<std::uint16_t>(std::min(request_path.size(), path.size()));
+    std::memcpy(path.data(), request_path.data(), path_size);
+}
+
+void AccessLog::Writer::Write(const AccessLogRecord& record) noexcept {
+    if (!producer_->ring.TryPush(record)) {
+        producer_->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+AccessLog::AccessLog(AccessLogConfig config)
+    : config_{std::move(config)}
+{
+    OpenFile();
+    // Signals are for the event loop. The writer thread inherits the mask of its creator, so it is started
+    // with all of them blocked: a signal the creator did not block yet would otherwise kill the process
+    // when it is delivered to this thread.
+    sigset_t all_signals;
+    sigset_t previous_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &previous_mask);
+    try {
+        writer_thread_ = std::thread{&AccessLog::RunWriterThread, this};
+    } catch (...) {
+        pthread_sigmask(SIG_SETMASK, &previous_mask, nullptr);
+        throw;
+    }
+    pthread_sigmask(SIG_SETMASK, &previous_mask, nullptr);
+}
+
+AccessLog::~AccessLog() {
+    stopping_.store(true, std::memory_order_release);
+    writer_thread_.join();
+}
+
+AccessLog::Writer AccessLog::CreateWriter() {
+    std::lock_guard lock{producers_mutex_};
+    return Writer{*producers_.emplace_back(std::make_unique<Producer>())};
+}
+
+void AccessLog::RunWriterThread() {
+    while (!stopping_.load(std::memory_order_acquire)) {
+        if (Drain() == 0) {
+            std::this_thread::sleep_for(config_.flush_interval);
+        }
+    }
+    // Whatever was logged before shutdown
+    while (Drain() != 0) {
+    }
+}
+
+std::size_t AccessLog::Drain() {
+    std::vector<std::string> lines;
+    std::size_t written{0};
+    std::uint64_t dropped{0};
+    {
+        std::lock_guard lock{producers_mutex_};
+        AccessLogRecord record;
+        for (const std::unique_ptr<Producer>& producer : producers_) {
+            while (producer->ring.TryPop(record)) {
+                lines.push_back(FormatRecord(record));
+                if (lines.size() == kMaxLinesPerWrite) {
+                    WriteLines(lines);
+                    written += lines.size();
+                    lines.clear();
+                }
+            }
+            dropped += producer->dropped.load(std::memory_order_relaxed);
+        }
+    }
+
+    if (dropped != reported_dropped_) {
+        std::string line{"dropped="};
+        AppendNumber(line, dropped - reported_dropped_);
+        line += '\n';
+        lines.push_back(std::move(line));
+        reported_dropped_ = dropped;
+    }
+    WriteLines(lines);
+    return written + lines.size();
+}
+
+void AccessLog::WriteLines(const std::vector<std::string>& lines) {
+    if (lines.empty()) {
+        return;
+    }
+    RotateFileIfNeeded();
+
+    std::vector<iovec> iov;
+    iov.reserve(lines.size());
+    for (const std::string& line : lines) {
+        iov.push_back(iovec{.iov_base = const_cast<char*>(line.data()), .iov_len = line.size()});
+    }
+
+    std::size_t iov_index{0};
+    while (iov_index < iov.size()) {
+        const ssize_t bytes_written{writev(file_.Get(), iov.data() + iov_index, static_cast<int>(iov.size() - iov_index))};
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Nowhere to report it, the records are lost
+            return;
+        }
+        file_bytes_ += static_cast<std::size_t>(bytes_written);
+
+        // Skip what was written, a partial write leaves the current iovec half done
+        auto remaining{static_cast<std::size_t>(bytes_written)};
+        while (iov_index < iov.size() && remaining >= iov[iov_index].iov_len) {
+            remaining -= iov[iov_index].iov_len;
+            ++iov_index;
+        }
+        if (iov_index < iov.size()) {
+            iov[iov_index].iov_base = static_cast<char*>(iov[iov_index].iov_base) + remaining;
+            iov[iov_index].iov_len -= remaining;
+        }
+    }
+}
+
+void AccessLog::OpenFile() {
+    FileDescriptor file{open(config_.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)};
+    if (file.IsEmpty()) {
+        throw AccessLogException{StrError("Failed to open access log " + config_.path.string())};
+    }
+    file_ = std::move(file);
+    std::error_code ec;
+    const auto file_size{std::filesystem::file_size(config_.path, ec)};
+    file_bytes_ = ec ? 0 : static_cast<std::size_t>(file_size);
+    file_opened_at_ = std::chrono::steady_clock::now();
+}
+
+void AccessLog::RotateFileIfNeeded() {
+    if (file_bytes_ < config_.max_file_bytes
+        && std::chrono::steady_clock::now() - file_opened_at_ < config_.rotate_interval) {
+        return;
+    }
+
+    const std::time_t now{std::time(nullptr)};
+    std::tm tm;
+    gmtime_r(&now, &tm);
+    std::array<char, 32> suffix;
+    const size_t suffix_size{std::strftime(suffix.data(), suffix.size(), ".%Y%m%d-%H%M%S", &tm)};
+
+    // Never replaces a file rotated earlier within the same second
+    for (unsigned sequence{0}; sequence < kMaxRotationsPerSecond; ++sequence) {
+        std::filesystem::path rotated_path{config_.path};
+        rotated_path += std::string_view{suffix.data(), suffix_size};
+        if (sequence != 0) {
+            rotated_path += '.' + std::to_string(sequence);
+        }
+        if (renameat2(AT_FDCWD, config_.path.c_str(), AT_FDCWD, rotated_path.c_str(), RENAME_NOREPLACE) == 0
+                || errno != EEXIST) {
+            break;
+        }
+    }
+    try {
+        OpenFile();
+    } catch (const AccessLogException&) {
+        // Keep appending to the old descriptor rather than losing records
+        file_opened_at_ = std::chrono::steady_clock::now();
+        file_bytes_ = 0;
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef HTTP_SERVER_ACCESS_LOG_H
+#define HTTP_SERVER_ACCESS_LOG_H
+
+#include "file_descriptor.h"
+#include "http.h"
+#include "request_timings.h"
+#include "spsc_ring.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/socket.h>
+
+struct AccessLogException : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+struct AccessLogConfig {
+    std::filesystem::path path;
+    // The file is rotated once it grows past this size or gets older than the interval
+    std::size_t max_file_bytes{64 * 1024 * 1024};
+    std::chrono::seconds rotate_interval{std::chrono::hours{24}};
+    // How long the writer thread sleeps when there is nothing to write
+    std::chrono::milliseconds flush_interval{100};
+};
+
+// Fixed size so that records can be passed between threads without allocating
+struct AccessLogRecord {
+    static constexpr std::size_t kMaxPathSize{256};
+
+    std::chrono::system_clock::time_point timestamp;
+    std::chrono::nanoseconds duration{0};
+    std::uint64_t bytes{0};
+    sockaddr_storage peer{};
+    unsigned status{0};
+    // Unknown when the request could not be parsed
+    std::optional<HttpMethod> method;
+    std::uint16_t path_size{0};
+    std::array<char, kMaxPathSize> path;
+    // Breakdown of the duration into request phases, written when set
+    std::optional<RequestTimings> timings;
+
+    // Longer paths are truncated
+    void SetPath(std::string_view request_path) noexcept;
+};
+
+// Access log which keeps file I/O off the event loop. Every producing thread gets its own Writer
+// backed by a lock-free ring, a background thread formats the records and writes them in batches.
+class AccessLog {
+    static constexpr std::size_t kRingCapacity{4096};
+    using Ring = SpscRing<AccessLogRecord, kRingCapacity>;
+
+    struct Producer {
+        Ring ring;
+        std::atomic<std::uint64_t> dropped{0};
+    };
+
+public:
+    class Writer {
+        Producer* producer_;
+
+    public:
+        explicit Writer(Producer& producer) noexcept
+            : producer_{&producer}
+        {
+        }
+
+        // Never blocks, the record is dropped and counted when the writer thread falls behind
+        void Write(const AccessLogRecord& record) noexcept;
+    };
+
+private:
+    AccessLogConfig config_;
+    FileDescriptor file_;
+    std::size_t file_bytes_{0};
+    std::chrono::steady_clock::time_point file_opened_at_;
+    std::uint64_t reported_dropped_{0};
+
+    std::mutex producers_mutex_;
+    std::vector<std::unique_ptr<Producer>> producers_;
+
+    std::atomic<bool> stopping_{false};
+    std::thread writer_thread_;
+
+public:
+    explicit AccessLog(AccessLogConfig config);
+    ~AccessLog();
+
+    AccessLog(const AccessLog&) = delete;
+    AccessLog& operator=(const AccessLog&) = delete;
+
+    // One per producing thread, valid for the lifetime of the access log
+    Writer CreateWriter();
+
+private:
+    void RunWriterThread();
+    // Returns the number of records written
+    std::size_t Drain();
+    void WriteLines(const std::vector<std::string>& lines);
+    void OpenFile();
+    void RotateFileIfNeeded();
+};
+
+#endif //HTTP_SERVER_ACCESS_LOG_H
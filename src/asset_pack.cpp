@@ -0,0 +1,113 @@
+#include "asset_pack.h"
+
+#include "str_utils.h"
+
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+constexpr bool IsAligned(std::uint64_t offset) noexcept {
+    return offset % alignof(std::uint64_t) == 0;
+}
+}
+
+std::string_view ToString(AssetEncoding encoding) noexcept {
+    switch (encoding) {
+    case AssetEncoding::kIdentity:
+        return "";
+    case AssetEncoding::kGzip:
+        return "gzip";
+    case AssetEncoding::kBrotli:
+        return "br";
+    }
+    return "";
+}
+
+AssetPack::AssetPack(const std::filesystem::path& path)
+    : file_{std::make_shared<FileDescriptor>(open(path.c_str(), O_RDONLY | O_CLOEXEC))}
+{
+    if (file_->IsEmpty()) {
+        throw AssetPackException{StrError("Failed to open asset pack " + path.string())};
+    }
+    struct stat file_stat;
+    if (fstat(file_->Get(), &file_stat) == -1) {
+        throw AssetPackException{StrError("Failed to stat asset pack " + path.string())};
+    }
+    size_ = static_cast<std::size_t>(file_stat.st_size);
+    if (size_ < sizeof(AssetPackHeader)) {
+        throw AssetPackException{"Asset pack " + path.string() + " is truncated"};
+    }
+    void* data{mmap(nullptr, size_, PROT_READ, MAP_SHARED, file_->Get(), 0)};
+    if (data == MAP_FAILED) {
+        throw AssetPackException{StrError("Failed to map asset pack " + path.string())};
+    }
+    data_ = static_cast<const char*>(data);
+    // Lookups jump around the index, reading ahead of them would only load pages nobody asked for
+    madvise(data, size_, MADV_RANDOM);
+
+    header_ = reinterpret_cast<const AssetPackHeader*>(data_);
+    const AssetPackRange displacements{
+        header_->displacements_offset, std::uint64_t{header_->bucket_count} * sizeof(std::int32_t)};
+    const AssetPackRange entries{header_->entries_offset, std::uint64_t{header_->entry_count} * sizeof(AssetPackEntry)};
+    if (header_->magic != AssetPackHeader::kMagic || header_->version != AssetPackHeader::kVersion
+            || header_->bucket_count == 0 || !IsValid(displacements) || !IsValid(entries)
+            || !IsAligned(displacements.offset) || !IsAligned(entries.offset)) {
+        munmap(data, size_);
+        throw AssetPackException{"Asset pack " + path.string() + " is corrupt or of another version"};
+    }
+    displacements_ = reinterpret_cast<const std::int32_t*>(data_ + displacements.offset);
+    entries_ = reinterpret_cast<const AssetPackEntry*>(data_ + entries.offset);
+}
+
+AssetPack::~AssetPack() {
+    munmap(const_cast<char*>(data_), size_);
+}
+
+std::uint64_t AssetPack::Hash(std::string_view path, std::uint32_t seed) noexcept {
+    // FNV-1a finished with the MurmurHash3 mixer, so that slots taken modulo any count are spread evenly
+    std::uint64_t hash{0xcbf29ce484222325ULL ^ (std::uint64_t{seed} * 0x9e3779b97f4a7c15ULL)};
+    for (const char c : path) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+std::optional<AssetPack::Asset> AssetPack::Find(std::string_view path) const noexcept {
+    if (header_->entry_count == 0) {
+        return std::nullopt;
+    }
+    const std::int32_t displacement{displacements_[Hash(path, 0) % header_->bucket_count]};
+    const std::uint64_t slot{displacement < 0 ? static_cast<std::uint64_t>(-(displacement + 1))
+                                              : Hash(path, static_cast<std::uint32_t>(displacement))
+                                                    % header_->entry_count};
+    if (slot >= header_->entry_count) {
+        return std::nullopt;
+    }
+    // Every path has a slot, only the entry tells whether it is the one stored there.
+    // Ranges are checked here rather than up front, which would read the whole index.
+    const AssetPackEntry& entry{entries_[slot]};
+    if (!IsValid(entry.path) || GetBytes(entry.path) != path
+            || !IsValid(entry.content_type) || !IsValid(entry.etag)) {
+        return std::nullopt;
+    }
+    Asset asset{.content_type = GetBytes(entry.content_type), .etag = GetBytes(entry.etag)};
+    for (std::size_t i{0}; i < kAssetEncodingCount; ++i) {
+        if ((entry.bodies[i].offset != 0 || i == static_cast<std::size_t>(AssetEncoding::kIdentity))
+                && IsValid(entry.bodies[i])) {
+            asset.bodies[i] = entry.bodies[i];
+        }
+    }
+    // Without its identity bytes the entry is broken
+    if (!asset.bodies[static_cast<std::size_t>(AssetEncoding::kIdentity)]) {
+        return std::nullopt;
+    }
+    return asset;
+}
@@ -0,0 +1,111 @@
+#ifndef HTTP_SERVER_ASSET_PACK_H
+#define HTTP_SERVER_ASSET_PACK_H
+
+#include "file_descriptor.h"
+
+#include <array>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+
+#include <cstddef>
+#include <cstdint>
+
+// A pack is a single file holding a tree of static assets, written by the asset-pack tool:
+//
+//   header | asset bytes... | strings | displacements | entries
+//
+// Entries are placed at the slot a minimal perfect hash of their path gives: the path hashed with seed 0
+// picks a bucket, the bucket's displacement either is the seed which spreads its paths over free slots or,
+// when negative, directly encodes the slot of its only path. A lookup therefore hashes the path at most
+// twice and compares it with a single entry. Integers are stored in host byte order.
+
+struct AssetPackException : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+enum class AssetEncoding : std::size_t {
+    kIdentity,
+    kGzip,
+    kBrotli,
+};
+
+inline constexpr std::size_t kAssetEncodingCount{static_cast<std::size_t>(AssetEncoding::kBrotli) + 1};
+
+// Value of the Content-Encoding header, empty for identity
+std::string_view ToString(AssetEncoding encoding) noexcept;
+
+// Bytes of the pack
+struct AssetPackRange {
+    std::uint64_t offset{0};
+    std::uint64_t size{0};
+};
+
+struct AssetPackHeader {
+    static constexpr std::array<char, 8> kMagic{'H', 'T', 'T', 'P', 'P', 'A', 'C', 'K'};
+    static constexpr std::uint32_t kVersion{1};
+
+    std::array<char, 8> magic{kMagic};
+    std::uint32_t version{kVersion};
+    std::uint32_t entry_count{0};
+    // Equals entry_count, except for an empty pack which has one
+    std::uint32_t bucket_count{1};
+    std::uint32_t reserved{0};
+    std::uint64_t displacements_offset{0};
+    std::uint64_t entries_offset{0};
+};
+
+struct AssetPackEntry {
+    // Relative to the packed directory with '/' separators, e.g. "css/site.css"
+    AssetPackRange path;
+    AssetPackRange content_type;
+    // Hex digest of the identity bytes
+    AssetPackRange etag;
+    // Precompressed variants have a zero offset when the pack has none
+    std::array<AssetPackRange, kAssetEncodingCount> bodies;
+};
+
+// Pack mapped into memory. Pages are read in as lookups touch them, so opening it costs the same for any
+// number of assets.
+class AssetPack {
+    std::shared_ptr<FileDescriptor> file_;
+    const char* data_{nullptr};
+    std::size_t size_{0};
+    const AssetPackHeader* header_{nullptr};
+    const std::int32_t* displacements_{nullptr};
+    const AssetPackEntry* entries_{nullptr};
+
+public:
+    struct Asset {
+        std::string_view content_type;
+        std::string_view etag;
+        std::array<std::optional<AssetPackRange>, kAssetEncodingCount> bodies;
+    };
+
+    explicit AssetPack(const std::filesystem::path& path);
+    ~AssetPack();
+
+    AssetPack(const AssetPack&) = delete;
+    AssetPack& operator=(const AssetPack&) = delete;
+
+    // Hash the perfect hash function is built from, shared with the writer
+    static std::uint64_t Hash(std::string_view path, std::uint32_t seed) noexcept;
+
+    std::optional<Asset> Find(std::string_view path) const noexcept;
+
+    std::string_view GetBytes(AssetPackRange range) const noexcept {
+        return std::string_view{data_ + range.offset, static_cast<std::size_t>(range.size)};
+    }
+
+    // The pack file, e.g. for responses sent straight from the page cache
+    const std::shared_ptr<FileDescriptor>& GetFile() const noexcept { return file_; }
+
+private:
+    bool IsValid(AssetPackRange range) const noexcept {
+        return range.offset <= size_ && range.size <= size_ - range.offset;
+    }
+};
+
+#endif //HTTP_SERVER_ASSET_PACK_H
@@ -0,0 +1,19 @@
+#include "asset_pack_writer.h"
+
+#include <filesystem>
+#include <iostream>
+
+int main(int argc, char **argv) {
+    if (argc != 3 || !std::filesystem::is_directory(argv[1])) {
+        std::cout << "Usage: asset-pack <directory> <pack-path>\n";
+        return 1;
+    }
+    try {
+        const std::size_t file_count{WriteAssetPack(argv[1], argv[2])};
+        std::cout << "Packed " << file_count << " files into " << argv[2] << '\n';
+    } catch (const std::exception& e) {
+        std::cerr << e.what();
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,288 @@
+#include "asset_pack_writer.h"
+
+#include "asset_pack.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+
+namespace {
+constexpr std::size_t kCopyBufSize{64 * 1024};
+// Seeds tried for one bucket before the build gives up, far beyond what the buckets of a real tree need
+constexpr std::int32_t kMaxSeed{1 << 24};
+
+struct PackedFile {
+    std::string path;
+    std::filesystem::path source;
+    AssetPackEntry entry;
+};
+
+std::string_view GetContentType(const std::filesystem::path& path) {
+    static const std::unordered_map<std::string_view, std::string_view> kContentTypes{
+        {".html", "text/html; charset=utf-8"},
+        {".htm", "text/html; charset=utf-8"},
+        {".css", "text/css; charset=utf-8"},
+        {".js", "text/javascript; charset=utf-8"},
+        {".mjs", "text/javascript; charset=utf-8"},
+        {".json", "application/json"},
+        {".map", "application/json"},
+        {".txt", "text/plain; charset=utf-8"},
+        {".xml", "application/xml"},
+        {".svg", "image/svg+xml"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".webp", "image/webp"},
+        {".avif", "image/avif"},
+        {".ico", "image/x-icon"},
+        {".wasm", "application/wasm"},
+        {".pdf", "application/pdf"},
+        {".woff", "font/woff"},
+        {".woff2", "font/woff2"},
+        {".gz", "application/gzip"},
+        {".br", "application/octet-stream"},
+    };
+    const std::string extension{path.extension().string()};
+    auto content_type_it{kContentTypes.find(extension)};
+    return content_type_it != kContentTypes.end() ? content_type_it->second : "application/octet-stream";
+}
+
+std::vector<PackedFile> CollectFiles(const std::filesystem::path& directory) {
+    std::vector<PackedFile> files;
+    std::error_code ec;
+    std::filesystem::recursive_directory_iterator it{
+        directory, std::filesystem::directory_options::skip_permission_denied, ec};
+    for (; !ec && it != std::filesystem::recursive_directory_iterator{}; it.increment(ec)) {
+        if (it->is_regular_file(ec)) {
+            files.push_back(PackedFile{
+                .path = it->path().lexically_relative(directory).generic_string(), .source = it->path()});
+        }
+    }
+    if (ec) {
+        throw AssetPackException{"Failed to list " + directory.string() + ": " + ec.message()};
+    }
+    // The same tree always gives the same pack
+    std::ranges::sort(files, {}, &PackedFile::path);
+    return files;
+}
+
+class PackOutput {
+    std::ofstream out_;
+    std::uint64_t offset_{0};
+
+public:
+    explicit PackOutput(const std::filesystem::path& path)
+        : out_{path, std::ios_base::binary | std::ios_base::trunc}
+    {
+    }
+
+    bool IsGood() const { return static_cast<bool>(out_); }
+    std::uint64_t GetOffset() const noexcept { return offset_; }
+
+    AssetPackRange Write(std::string_view bytes) {
+        const AssetPackRange range{.offset = offset_, .size = bytes.size()};
+        out_.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        offset_ += bytes.size();
+        return range;
+    }
+
+    void Align() {
+        static constexpr std::array<char, alignof(std::uint64_t)> kPadding{};
+        Write(std::string_view{kPadding.data(), (kPadding.size() - offset_ % kPadding.size()) % kPadding.size()});
+    }
+
+    void Rewrite(std::uint64_t offset, std::string_view bytes) {
+        out_.seekp(static_cast<std::streamoff>(offset));
+        out_.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        out_.seekp(static_cast<std::streamoff>(offset_));
+    }
+
+    void Close() { out_.close(); }
+};
+
+template <typename T>
+std::string_view AsBytes(const T& value) noexcept {
+    return std::string_view{reinterpret_cast<const char*>(&value), sizeof(value)};
+}
+
+// Copies the file into the pack, the ETag is an FNV-1a digest of its bytes
+void PackFile(PackedFile& file, PackOutput& output) {
+    std::ifstream in{file.source, std::ios_base::binary};
+    if (!in) {
+        throw AssetPackException{"Failed to open " + file.source.string()};
+    }
+    file.entry.bodies[static_cast<std::size_t>(AssetEncoding::kIdentity)].offset = output.GetOffset();
+    std::uint64_t digest{0xcbf29ce484222325ULL};
+    std::array<char, kCopyBufSize> buf;
+    while (in) {
+        in.read(buf.data(), buf.size());
+        const std::string_view bytes{buf.data(), static_cast<std::size_t>(in.gcount())};
+        for (const char c : bytes) {
+            digest ^= static_cast<unsigned char>(c);
+            digest *= 0x100000001b3ULL;
+        }
+        file.entry.bodies[static_cast<std::size_t>(AssetEncoding::kIdentity)].size += output.Write(bytes).size;
+    }
+    if (in.bad()) {
+        throw AssetPackException{"Failed to read " + file.source.string()};
+    }
+    std::array<char, 17> etag;
+    std::snprintf(etag.data(), etag.size(), "%016llx", static_cast<unsigned long long>(digest));
+    file.entry.etag = output.Write(std::string_view{etag.data(), etag.size() - 1});
+}
+
+// Slot of every file such that the displacement of its bucket leads there, see asset_pack.h
+std::vector<std::int32_t> PlaceFiles(std::vector<PackedFile>& files) {
+    const std::size_t slot_count{files.size()};
+    std::vector<std::vector<std::size_t>> buckets(std::max<std::size_t>(slot_count, 1));
+    for (std::size_t i{0}; i < files.size(); ++i) {
+        buckets[AssetPack::Hash(files[i].path, 0) % buckets.size()].push_back(i);
+    }
+    // Large buckets are hardest to place, so they go while most slots are free
+    std::vector<std::size_t> bucket_order(buckets.size());
+    std::iota(bucket_order.begin(), bucket_order.end(), 0);
+    std::ranges::stable_sort(bucket_order, std::ranges::greater{},
+        [&buckets](std::size_t bucket) { return buckets[bucket].size(); });
+
+    std::vector<std::int32_t> displacements(buckets.size(), 0);
+    std::vector<bool> taken(slot_count, false);
+    std::vector<std::size_t> slots;
+    std::size_t next_free_slot{0};
+    for (const std::size_t bucket : bucket_order) {
+        const std::vector<std::size_t>& bucket_files{buckets[bucket]};
+        if (bucket_files.empty()) {
+            break;
+        }
+        // A single file takes any free slot directly
+        if (bucket_files.size() == 1) {
+            while (taken[next_free_slot]) {
+                ++next_free_slot;
+            }
+            taken[next_free_slot] = true;
+            displacements[bucket] = -static_cast<std::int32_t>(next_free_slot) - 1;
+            slots.assign(1, next_free_slot);
+        } else {
+            for (std::int32_t seed{1};; ++seed) {
+                if (seed == kMaxSeed) {
+                    throw AssetPackException{"Failed to build the index of the asset pack"};
+                }
+                slots.clear();
+                for (const std::size_t file : bucket_files) {
+                    const std::size_t slot{AssetPack::Hash(files[file].path, static_cast<std::uint32_t>(seed))
+                                           % slot_count};
+                    if (taken[slot] || std::ranges::find(slots, slot) != slots.end()) {
+                        break;
+                    }
+                    slots.push_back(slot);
+                }
+                if (slots.size() == bucket_files.size()) {
+                    displacements[bucket] = seed;
+                    break;
+                }
+            }
+            for (const std::size_t slot : slots) {
+                taken[slot] = true;
+            }
+        }
+    }
+
+    // Entries are stored in slot order
+    std::vector<PackedFile> placed(slot_count);
+    for (std::size_t bucket{0}; bucket < buckets.size(); ++bucket) {
+        for (const std::size_t file : buckets[bucket]) {
+            const std::int32_t displacement{displacements[bucket]};
+            const std::size_t slot{displacement < 0
+                ? static_cast<std::size_t>(-(displacement + 1))
+                : AssetPack::Hash(files[file].path, static_cast<std::uint32_t>(displacement)) % slot_count};
+            placed[slot] = std::move(files[file]);
+        }
+    }
+    files = std::move(placed);
+    return displacements;
+}
+}
+
+std::size_t WriteAssetPack(const std::filesystem::path& directory, const std::filesystem::path& pack_path) {
+    std::vector<PackedFile> files{CollectFiles(directory)};
+    if (files.size() > static_cast<std::size_t>(std::numeric_limits<std::int32_t>::max())) {
+        throw AssetPackException{"Too many files to pack in " + directory.string()};
+    }
+
+    std::filesystem::path temp_path{pack_path};
+    temp_path += ".tmp";
+    PackOutput output{temp_path};
+    if (!output.IsGood()) {
+        throw AssetPackException{"Failed to create " + temp_path.string()};
+    }
+    AssetPackHeader header{
+        .entry_count = static_cast<std::uint32_t>(files.size()),
+        .bucket_count = static_cast<std::uint32_t>(std::max<std::size_t>(files.size(), 1))
+    };
+    output.Write(AsBytes(header));
+
+    std::unordered_map<std::string_view, std::size_t> file_indices;
+    for (std::size_t i{0}; i < files.size(); ++i) {
+        PackFile(files[i], output);
+        file_indices.emplace(files[i].path, i);
+    }
+    std::unordered_map<std::string_view, AssetPackRange> content_types;
+    for (PackedFile& file : files) {
+        file.entry.path = output.Write(file.path);
+        const std::string_view content_type{GetContentType(file.source)};
+        auto content_type_it{content_types.find(content_type)};
+        if (content_type_it == content_types.end()) {
+            content_type_it = content_types.emplace(content_type, output.Write(content_type)).first;
+        }
+        file.entry.content_type = content_type_it->second;
+
+        // Variants are only worth sending when they are smaller
+        const AssetPackRange& identity{file.entry.bodies[static_cast<std::size_t>(AssetEncoding::kIdentity)]};
+        for (const AssetEncoding encoding : {AssetEncoding::kGzip, AssetEncoding::kBrotli}) {
+            const std::string suffix{encoding == AssetEncoding::kGzip ? ".gz" : ".br"};
+            auto variant_it{file_indices.find(file.path + suffix)};
+            if (variant_it == file_indices.end()) {
+                continue;
+            }
+            const AssetPackRange& variant{
+                files[variant_it->second].entry.bodies[static_cast<std::size_t>(AssetEncoding::kIdentity)]};
+            if (variant.size < identity.size) {
+                file.entry.bodies[static_cast<std::size_t>(encoding)] = variant;
+            }
+        }
+    }
+
+    std::vector<std::int32_t> displacements{PlaceFiles(files)};
+    output.Align();
+    header.displacements_offset = output.GetOffset();
+    output.Write(std::string_view{reinterpret_cast<const char*>(displacements.data()),
+                                  displacements.size() * sizeof(std::int32_t)});
+    output.Align();
+    header.entries_offset = output.GetOffset();
+    for (const PackedFile& file : files) {
+        output.Write(AsBytes(file.entry));
+    }
+    output.Rewrite(0, AsBytes(header));
+    output.Close();
+    if (!output.IsGood()) {
+        throw AssetPackException{"Failed to write " + temp_path.string()};
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp_path, pack_path, ec);
+    if (ec) {
+        throw AssetPackException{"Failed to replace " + pack_path.string() + ": " + ec.message()};
+    }
+    return files.size();
+}
@@ -0,0 +1,14 @@
+#ifndef HTTP_SERVER_ASSET_PACK_WRITER_H
+#define HTTP_SERVER_ASSET_PACK_WRITER_H
+
+#include <filesystem>
+
+#include <cstddef>
+
+// Packs the regular files below the directory. A file next to which "<file>.gz" or "<file>.br" exists gets
+// that one's bytes as its precompressed variant, both are still served as themselves too. The pack is
+// written aside and renamed into place, a server which has the previous one mapped keeps serving it.
+// Returns the number of packed files, throws AssetPackException on failure.
+std::size_t WriteAssetPack(const std::filesystem::path& directory, const std::filesystem::path& pack_path);
+
+#endif //HTTP_SERVER_ASSET_PACK_WRITER_H
@@ -0,0 +1,6 @@
+#include "async_http_handler_base.h"
+
+HttpResponse AsyncHttpHandlerBase::HandleRequest(HttpRequest&& request) {
+    // Asynchronous handlers are dispatched through HandleRequestAsync only
+    return HttpResponse{.response_status = HttpResponseStatus::k500InternalServerError};
+}
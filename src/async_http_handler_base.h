@@ -0,0 +1,22 @@
+#ifndef HTTP_SERVER_ASYNC_HTTP_HANDLER_BASE_H
+#define HTTP_SERVER_ASYNC_HTTP_HANDLER_BASE_H
+
+#include "event_loop.h"
+#include "http.h"
+#include "http_handler_base.h"
+#include "http_response_stream.h"
+
+#include <memory>
+
+// Handler which answers from the event loop at a later point instead of returning the response
+class AsyncHttpHandlerBase : public HttpHandlerBase {
+public:
+    // Called once the server's event loop exists, before any request is dispatched
+    virtual void Attach(EventLoop& event_loop) = 0;
+    virtual void HandleRequestAsync(HttpRequest request, std::shared_ptr<HttpResponseStream> response_stream) = 0;
+
+    AsyncHttpHandlerBase* AsAsync() noexcept final { return this; }
+    HttpResponse HandleRequest(HttpRequest&& request) final;
+};
+
+#endif //HTTP_SERVER_ASYNC_HTTP_HANDLER_BASE_H
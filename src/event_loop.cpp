@@ -0,0 +1 @@
+#include "event_loop.h"
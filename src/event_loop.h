@@ -0,0 +1,24 @@
+#ifndef HTTP_SERVER_EVENT_LOOP_H
+#define HTTP_SERVER_EVENT_LOOP_H
+
+#include <cstdint>
+
+class EventLoopListener {
+public:
+    virtual ~EventLoopListener() = default;
+
+    // events is the epoll event mask reported for fd
+    virtual void OnEvents(int fd, std::uint32_t events) = 0;
+};
+
+// Lets handlers register their own File Descriptors in the server's event loop
+class EventLoop {
+public:
+    virtual ~EventLoop() = default;
+
+    virtual void Register(int fd, std::uint32_t events, EventLoopListener& listener) = 0;
+    virtual void Modify(int fd, std::uint32_t events) = 0;
+    virtual void Unregister(int fd) = 0;
+};
+
+#endif //HTTP_SERVER_EVENT_LOOP_H
@@ -0,0 +1,130 @@
+#include "file_upload.h"
+
+#include <algorithm>
+#include <array>
+#include <utility>
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+// Default pipe capacity, so that splicing into the pipe never blocks
+constexpr std::size_t kMaxSpliceBytes{64 * 1024};
+constexpr std::size_t kCopyBufSize{16 * 1024};
+}
+
+FileUpload::FileUpload(FileDescriptor file, std::size_t size)
+    : file_{std::move(file)}
+    , size_{size}
+    , remaining_{size}
+{
+    // Best effort: file systems without fallocate just grow the file, a real lack of space fails a later write
+    if (size != 0) {
+        fallocate(file_.Get(), 0, 0, static_cast<off_t>(size));
+    }
+
+    std::array<int, 2> pipe_fds;
+    if (pipe2(pipe_fds.data(), O_NONBLOCK | O_CLOEXEC) == 0) {
+        pipe_read_ = FileDescriptor{pipe_fds[0]};
+        pipe_write_ = FileDescriptor{pipe_fds[1]};
+    }
+}
+
+bool FileUpload::Write(std::string_view data) {
+    data = data.substr(0, remaining_);
+    while (!data.empty()) {
+        const ssize_t bytes_written{write(file_.Get(), data.data(), data.size())};
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(bytes_written));
+        remaining_ -= static_cast<std::size_t>(bytes_written);
+    }
+    return true;
+}
+
+FileUploadStatus FileUpload::Transfer(int socket_fd, std::size_t& budget) {
+    // Without a pipe, or once the kernel refused to splice, bytes go through user space
+    return pipe_read_.IsEmpty() ? Copy(socket_fd, budget) : Splice(socket_fd, budget);
+}
+
+void FileUpload::Truncate() {
+    ftruncate(file_.Get(), static_cast<off_t>(size_ - remaining_));
+}
+
+FileUploadStatus FileUpload::Splice(int socket_fd, std::size_t& budget) {
+    while (remaining_ > 0) {
+        if (budget == 0) {
+            return FileUploadStatus::kBudgetSpent;
+        }
+        const std::size_t to_splice{std::min({remaining_, budget, kMaxSpliceBytes})};
+        const ssize_t bytes_spliced{
+            splice(socket_fd, nullptr, pipe_write_.Get(), nullptr, to_splice, SPLICE_F_MOVE | SPLICE_F_NONBLOCK)};
+        if (bytes_spliced == 0) {
+            return FileUploadStatus::kClosed;
+        } else if (bytes_spliced == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return FileUploadStatus::kWouldBlock;
+            } else if (errno == EINTR) {
+                continue;
+            } else if ((errno == EINVAL || errno == ENOSYS) && in_pipe_ == 0) {
+                // The socket or the file does not support splice
+                pipe_read_.Close();
+                pipe_write_.Close();
+                return Copy(socket_fd, budget);
+            }
+            return FileUploadStatus::kError;
+        }
+        in_pipe_ += static_cast<std::size_t>(bytes_spliced);
+        budget -= std::min(budget, static_cast<std::size_t>(bytes_spliced));
+        if (!DrainPipe()) {
+            return FileUploadStatus::kError;
+        }
+    }
+    return FileUploadStatus::kFinished;
+}
+
+bool FileUpload::DrainPipe() {
+    while (in_pipe_ > 0) {
+        // Regular files are always ready for writing, so this only waits for the disk
+        const ssize_t bytes_spliced{splice(pipe_read_.Get(), nullptr, file_.Get(), nullptr, in_pipe_, SPLICE_F_MOVE)};
+        if (bytes_spliced == -1 && errno == EINTR) {
+            continue;
+        } else if (bytes_spliced <= 0) {
+            return false;
+        }
+        in_pipe_ -= static_cast<std::size_t>(bytes_spliced);
+        remaining_ -= static_cast<std::size_t>(bytes_spliced);
+    }
+    return true;
+}
+
+FileUploadStatus FileUpload::Copy(int socket_fd, std::size_t& budget) {
+    std::array<char, kCopyBufSize> buf;
+    while (remaining_ > 0) {
+        if (budget == 0) {
+            return FileUploadStatus::kBudgetSpent;
+        }
+        const ssize_t bytes_read{read(socket_fd, buf.data(), std::min({buf.size(), remaining_, budget}))};
+        if (bytes_read == 0) {
+            return FileUploadStatus::kClosed;
+        } else if (bytes_read == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return FileUploadStatus::kWouldBlock;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return FileUploadStatus::kError;
+        }
+        budget -= static_cast<std::size_t>(bytes_read);
+        if (!Write(std::string_view{buf.data(), static_cast<std::size_t>(bytes_read)})) {
+            return FileUploadStatus::kError;
+        }
+    }
+    return FileUploadStatus::kFinished;
+}
@@ -0,0 +1,49 @@
+#ifndef HTTP_SERVER_FILE_UPLOAD_H
+#define HTTP_SERVER_FILE_UPLOAD_H
+
+#include "file_descriptor.h"
+
+#include <string_view>
+
+#include <cstddef>
+
+enum class FileUploadStatus {
+    kFinished,
+    // The socket has no more data for now
+    kWouldBlock,
+    kBudgetSpent,
+    // The peer closed the connection before the whole body arrived
+    kClosed,
+    kError,
+};
+
+// Moves a request body of known size from a socket into a file; with splice the bytes never enter user space
+class FileUpload {
+    FileDescriptor file_;
+    FileDescriptor pipe_read_;
+    FileDescriptor pipe_write_;
+    std::size_t size_;
+    std::size_t remaining_;
+    // Bytes spliced from the socket which did not reach the file yet
+    std::size_t in_pipe_{0};
+
+public:
+    // Preallocates the body size in the file
+    FileUpload(FileDescriptor file, std::size_t size);
+
+    std::size_t GetRemaining() const noexcept { return remaining_; }
+
+    // Stores body bytes which were already read from the socket
+    bool Write(std::string_view data);
+    // Transfers at most budget bytes and subtracts the transferred amount from it
+    FileUploadStatus Transfer(int socket_fd, std::size_t& budget);
+    // Drops the preallocated space beyond the bytes stored so far, for uploads which did not finish
+    void Truncate();
+
+private:
+    FileUploadStatus Splice(int socket_fd, std::size_t& budget);
+    bool DrainPipe();
+    FileUploadStatus Copy(int socket_fd, std::size_t& budget);
+};
+
+#endif //HTTP_SERVER_FILE_UPLOAD_H
@@ -0,0 +1,127 @@
+#include "get_asset_pack_http_handler.h"
+
+#include "http_utils.h"
+#include "str_utils.h"
+
+#include <algorithm>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace {
+constexpr std::string_view kHttpFilesPath{"/files/"};
+constexpr std::string_view kAcceptEncodingHeader{"Accept-Encoding"};
+constexpr std::string_view kIfNoneMatchHeader{"If-None-Match"};
+// Larger bodies are sent from the page cache rather than copied out of the mapping
+constexpr std::size_t kMinFileRegionBytes{64 * 1024};
+
+// Calls the visitor with the name and the parameters of each element of a comma separated header value
+template <typename Visitor>
+void ForEachListElement(std::string_view list, Visitor&& visitor) {
+    while (!list.empty()) {
+        const size_t element_size{std::min(list.find(','), list.size())};
+        const std::string_view element{list.substr(0, element_size)};
+        list.remove_prefix(std::min(element_size + 1, list.size()));
+        const size_t parameters_separator{std::min(element.find(';'), element.size())};
+        visitor(Strip(element.substr(0, parameters_separator)), element.substr(parameters_separator));
+    }
+}
+
+bool IsAccepted(std::string_view accept_encoding, std::string_view coding) {
+    std::optional<bool> accepted;
+    std::optional<bool> any_accepted;
+    ForEachListElement(accept_encoding, [&](std::string_view name, std::string_view parameters) {
+        // Only a q-value of zero refuses the coding
+        const size_t q_position{parameters.find("q=")};
+        const std::string_view q{q_position != std::string_view::npos ? Strip(parameters.substr(q_position + 2))
+                                                                      : std::string_view{}};
+        const bool refused{q.starts_with('0') && q.find_first_not_of("0.") == std::string_view::npos};
+        if (EqualsIgnoreCase(name, coding)) {
+            accepted = !refused;
+        } else if (name == "*") {
+            any_accepted = !refused;
+        }
+    });
+    return accepted.value_or(any_accepted.value_or(false));
+}
+
+bool MatchesETag(std::string_view if_none_match, std::string_view etag) {
+    bool matches{false};
+    ForEachListElement(if_none_match, [&](std::string_view tag, std::string_view) {
+        // If-None-Match compares weakly
+        if (tag.starts_with("W/")) {
+            tag.remove_prefix(2);
+        }
+        matches = matches || tag == "*" || tag == etag;
+    });
+    return matches;
+}
+}
+
+GetAssetPackHttpHandler::GetAssetPackHttpHandler(const std::filesystem::path& pack_path)
+    : pack_{pack_path}
+{
+}
+
+bool GetAssetPackHttpHandler::IsMyRequest(const HttpRequest& request) const {
+    return request.method == HttpMethod::kGet
+        && request.path.starts_with(kHttpFilesPath)
+        && request.path.size() != kHttpFilesPath.size();
+}
+
+HttpResponse GetAssetPackHttpHandler::HandleRequest(HttpRequest&& request) {
+    // Only packed paths are found, so ".." cannot lead out of the tree
+    const std::optional<AssetPack::Asset> asset{
+        pack_.Find(std::string_view{request.path}.substr(kHttpFilesPath.size()))};
+    if (!asset) {
+        return HttpResponse {.response_status = HttpResponseStatus::k404NotFound};
+    }
+
+    AssetEncoding encoding{AssetEncoding::kIdentity};
+    bool has_variants{false};
+    auto accept_encoding_it{request.headers.find(std::string{kAcceptEncodingHeader})};
+    for (const AssetEncoding variant : {AssetEncoding::kBrotli, AssetEncoding::kGzip}) {
+        if (!asset->bodies[static_cast<std::size_t>(variant)]) {
+            continue;
+        }
+        has_variants = true;
+        if (encoding == AssetEncoding::kIdentity && accept_encoding_it != request.headers.end()
+                && IsAccepted(accept_encoding_it->second, ToString(variant))) {
+            encoding = variant;
+        }
+    }
+
+    // Each encoding is a representation of its own with its own tag
+    std::string etag{"\""};
+    etag += asset->etag;
+    if (encoding != AssetEncoding::kIdentity) {
+        etag += '-';
+        etag += ToString(encoding);
+    }
+    etag += '"';
+    HttpResponse response{.response_status = HttpResponseStatus::k200Ok};
+    if (has_variants) {
+        response.headers.emplace("Vary", kAcceptEncodingHeader);
+    }
+    if (auto if_none_match_it{request.headers.find(std::string{kIfNoneMatchHeader})};
+            if_none_match_it != request.headers.end() && MatchesETag(if_none_match_it->second, etag)) {
+        response.response_status = HttpResponseStatus::k304NotModified;
+        response.headers.emplace("ETag", std::move(etag));
+        return response;
+    }
+
+    response.headers.emplace(kHttpContentTypeHeader, asset->content_type);
+    response.headers.emplace("ETag", std::move(etag));
+    if (encoding != AssetEncoding::kIdentity) {
+        response.headers.emplace("Content-Encoding", ToString(encoding));
+    }
+    const AssetPackRange& body{*asset->bodies[static_cast<std::size_t>(encoding)]};
+    if (body.size >= kMinFileRegionBytes) {
+        response.body = HttpFileRegion{
+            .file = pack_.GetFile(), .offset = body.offset, .size = static_cast<std::size_t>(body.size)};
+    } else {
+        response.body = pack_.GetBytes(body);
+    }
+    return response;
+}
@@ -0,0 +1,21 @@
+#ifndef HTTP_SERVER_GET_ASSET_PACK_HTTP_HANDLER_H
+#define HTTP_SERVER_GET_ASSET_PACK_HTTP_HANDLER_H
+
+#include "asset_pack.h"
+#include "http.h"
+#include "http_handler_base.h"
+
+#include <filesystem>
+
+// Serves GET /files/ from an asset pack instead of the directory. A lookup is a single probe of the mapped
+// index, so requests reach neither the file system nor, once the pages are resident, the disk.
+class GetAssetPackHttpHandler : public HttpHandlerBase {
+    AssetPack pack_;
+public:
+    GetAssetPackHttpHandler(const std::filesystem::path& pack_path);
+
+    bool IsMyRequest(const HttpRequest& request) const override;
+    HttpResponse HandleRequest(HttpRequest&& request) override;
+};
+
+#endif //HTTP_SERVER_GET_ASSET_PACK_HTTP_HANDLER_H
@@ -12,10 +12,10 @@ bool GetEchoHttpHandler::IsMyRequest(const HttpRequest& request) const {
     return request.method == HttpMethod::kGet && request.path.starts_with(kHttpEchoPath);
 }
 
-HttpResponse GetEchoHttpHandler::HandleRequest(const HttpRequest& request) {
+HttpResponse GetEchoHttpHandler::HandleRequest(HttpRequest&& request) {
     return HttpResponse{
         .response_status = HttpResponseStatus::k200Ok,
         .headers = {{std::string{kHttpContentTypeHeader}, "text/plain"}},
-        .body = request.path.substr(kHttpEchoPath.size())
+        .body = std::string_view{request.path}.substr(kHttpEchoPath.size())
     };
 }
@@ -3,13 +3,34 @@
 #include "http_utils.h"
 
 #include <fstream>
-#include <iterator>
+#include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <utility>
 
+#include <fcntl.h>
+
+#include <sys/stat.h>
+
 namespace {
 constexpr std::string_view kHttpFilesPath{"/files/"};
+
+// Path of the requested file, nothing when the request names one outside the directory, with ".." or an
+// absolute path such as "/files//etc/passwd"
+std::optional<std::filesystem::path> GetFilePath(const std::filesystem::directory_entry& directory,
+                                                 std::string_view request_path) {
+    const std::filesystem::path file{request_path.substr(kHttpFilesPath.size())};
+    if (file.has_root_path()) {
+        return std::nullopt;
+    }
+    for (const std::filesystem::path& component : file) {
+        if (component == "..") {
+            return std::nullopt;
+        }
+    }
+    return directory.path() / file;
+}
 }
 
 GetFileHttpHandler::GetFileHttpHandler(std::filesystem::directory_entry directory)
@@ -23,23 +44,25 @@ bool GetFileHttpHandler::IsMyRequest(const HttpRequest& request) const {
         && request.path.size() != kHttpFilesPath.size();
 }
 
-HttpResponse GetFileHttpHandler::HandleRequest(const HttpRequest& request) {
+HttpResponse GetFileHttpHandler::HandleRequest(HttpRequest&& request) {
     if (!directory_.exists()) {
         return HttpResponse {.response_status = HttpResponseStatus::k404NotFound};
     }
-    const std::string_view file{std::string_view{request.path}.substr(kHttpFilesPath.size())};
-    const std::filesystem::path file_path{directory_.path() / file};
-    if (!std::filesystem::is_regular_file(file_path)) {
+    const std::optional<std::filesystem::path> file_path{GetFilePath(directory_, request.path)};
+    // Checked before opening, which would block on a FIFO
+    if (!file_path || !std::filesystem::is_regular_file(*file_path)) {
         return HttpResponse {.response_status = HttpResponseStatus::k404NotFound};
     }
-    std::ifstream fs{file_path, std::ios_base::binary};
-    if (!fs) {
+    auto fd{std::make_shared<FileDescriptor>(open(file_path->c_str(), O_RDONLY | O_CLOEXEC))};
+    struct stat file_stat;
+    if (fd->IsEmpty() || fstat(fd->Get(), &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
         return HttpResponse {.response_status = HttpResponseStatus::k404NotFound};
     }
+    // The file is sent straight from the page cache rather than read into the response
     return HttpResponse {
         .response_status = HttpResponseStatus::k200Ok,
         .headers = {{std::string{kHttpContentTypeHeader}, "application/octet-stream"}},
-        .body = std::string{std::istreambuf_iterator<char>{fs}, std::istreambuf_iterator<char>{}}
+        .body = HttpFileRegion{.file = std::move(fd), .size = static_cast<std::size_t>(file_stat.st_size)}
     };
 }
 
@@ -54,16 +77,34 @@ bool PostFileHttpHandler::IsMyRequest(const HttpRequest& request) const {
         && request.path.size() != kHttpFilesPath.size();
 }
 
-HttpResponse PostFileHttpHandler::HandleRequest(const HttpRequest& request) {
+HttpResponse PostFileHttpHandler::HandleRequest(HttpRequest&& request) {
     if (!directory_.exists()) {
         return HttpResponse {.response_status = HttpResponseStatus::k422UnprocessableContent};
     }
-    const std::string_view file{std::string_view{request.path}.substr(kHttpFilesPath.size())};
-    const std::filesystem::path file_path{directory_.path() / file};
-    std::ofstream fs{file_path, std::ios_base::binary};
+    const std::optional<std::filesystem::path> file_path{GetFilePath(directory_, request.path)};
+    if (!file_path) {
+        return HttpResponse{.response_status = HttpResponseStatus::k422UnprocessableContent};
+    }
+    std::ofstream fs{*file_path, std::ios_base::binary};
     if (!fs) {
         return HttpResponse{.response_status = HttpResponseStatus::k422UnprocessableContent};
     }
     fs.write(request.body.data(), request.body.size());
     return HttpResponse{.response_status = HttpResponseStatus::k201Created};
 }
+
+FileDescriptor PostFileHttpHandler::OpenRequestBodyFile(const HttpRequest& request) {
+    if (!directory_.exists()) {
+        // HandleRequest reports it
+        return FileDescriptor{};
+    }
+    const std::optional<std::filesystem::path> file_path{GetFilePath(directory_, request.path)};
+    if (!file_path) {
+        return FileDescriptor{};
+    }
+    return FileDescriptor{open(file_path->c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+}
+
+HttpResponse PostFileHttpHandler::HandleStoredRequest(HttpRequest&& request) {
+    return HttpResponse{.response_status = HttpResponseStatus::k201Created};
+}
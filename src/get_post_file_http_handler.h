@@ -12,7 +12,7 @@ public:
     GetFileHttpHandler(std::filesystem::directory_entry directory);
 
     bool IsMyRequest(const HttpRequest& request) const override;
-    HttpResponse HandleRequest(const HttpRequest& request) override;
+    HttpResponse HandleRequest(HttpRequest&& request) override;
 };
 
 class PostFileHttpHandler : public HttpHandlerBase {
@@ -21,7 +21,9 @@ public:
     PostFileHttpHandler(std::filesystem::directory_entry directory);
 
     bool IsMyRequest(const HttpRequest& request) const override;
-    HttpResponse HandleRequest(const HttpRequest& request) override;
+    HttpResponse HandleRequest(HttpRequest&& request) override;
+    FileDescriptor OpenRequestBodyFile(const HttpRequest& request) override;
+    HttpResponse HandleStoredRequest(HttpRequest&& request) override;
 };
 
 #endif //HTTP_SERVER_GET_POST_FILE_HTTP_HANDLER_H
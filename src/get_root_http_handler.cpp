@@ -10,6 +10,6 @@ bool GetRootHttpHandler::IsMyRequest(const HttpRequest& request) const {
     return request.method == HttpMethod::kGet && request.path == kHttpRootPath;
 }
 
-HttpResponse GetRootHttpHandler::HandleRequest(const HttpRequest& request) {
+HttpResponse GetRootHttpHandler::HandleRequest(HttpRequest&& request) {
     return HttpResponse{.response_status = HttpResponseStatus::k200Ok};
 }
@@ -7,7 +7,7 @@
 class GetRootHttpHandler : public HttpHandlerBase {
 public:
     bool IsMyRequest(const HttpRequest& request) const override;
-    HttpResponse HandleRequest(const HttpRequest& request) override;
+    HttpResponse HandleRequest(HttpRequest&& request) override;
 };
 
 #endif //HTTP_SERVER_GET_ROOT_HTTP_HANDLER_H
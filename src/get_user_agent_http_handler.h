@@ -7,7 +7,7 @@
 class GetUserAgentHttpHandler : public HttpHandlerBase {
 public:
     bool IsMyRequest(const HttpRequest& request) const override;
-    HttpResponse HandleRequest(const HttpRequest& request) override;
+    HttpResponse HandleRequest(HttpRequest&& request) override;
 };
 
 #endif //HTTP_SERVER_GET_USER_AGENT_HTTP_HANDLER_H
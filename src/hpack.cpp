@@ -0,0 +1,277 @@
+#include "hpack.h"
+
+#include "hpack_huffman.h"
+
+#include <algorithm>
+#include <array>
+
+namespace {
+constexpr std::size_t kEntryOverhead{32};
+constexpr std::size_t kMaxIntegerBits{32};
+
+// RFC 7541 Appendix A, index 1 is the first entry
+constexpr std::array<std::pair<std::string_view, std::string_view>, 61> kStaticTable{{
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""},
+}};
+
+// Values which differ in nearly every response would only churn the dynamic table
+constexpr std::array<std::string_view, 1> kNotIndexedHeaders{"content-length"};
+// Secrets stay out of the tables of intermediaries too
+constexpr std::array<std::string_view, 3> kNeverIndexedHeaders{"authorization", "cookie", "set-cookie"};
+
+std::optional<std::size_t> ReadInteger(std::string_view& data, unsigned prefix_bits) {
+    if (data.empty()) {
+        return std::nullopt;
+    }
+    const std::size_t prefix_max{(std::size_t{1} << prefix_bits) - 1};
+    std::size_t value{static_cast<unsigned char>(data.front()) & prefix_max};
+    data.remove_prefix(1);
+    if (value < prefix_max) {
+        return value;
+    }
+    for (std::size_t shift{0}; !data.empty(); shift += 7) {
+        if (shift > kMaxIntegerBits) {
+            return std::nullopt;
+        }
+        const unsigned char byte{static_cast<unsigned char>(data.front())};
+        data.remove_prefix(1);
+        value += static_cast<std::size_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
+
+void WriteInteger(std::size_t value, unsigned prefix_bits, unsigned char flags, std::string& out) {
+    const std::size_t prefix_max{(std::size_t{1} << prefix_bits) - 1};
+    if (value < prefix_max) {
+        out += static_cast<char>(flags | value);
+        return;
+    }
+    out += static_cast<char>(flags | prefix_max);
+    value -= prefix_max;
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+std::optional<std::string> ReadString(std::string_view& data) {
+    if (data.empty()) {
+        return std::nullopt;
+    }
+    const bool huffman{(static_cast<unsigned char>(data.front()) & 0x80) != 0};
+    const std::optional<std::size_t> size{ReadInteger(data, 7)};
+    if (!size || *size > data.size()) {
+        return std::nullopt;
+    }
+    std::string str;
+    if (huffman) {
+        if (!HuffmanDecode(data.substr(0, *size), str)) {
+            return std::nullopt;
+        }
+    } else {
+        str = data.substr(0, *size);
+    }
+    data.remove_prefix(*size);
+    return str;
+}
+}
+
+HpackDynamicTable::HpackDynamicTable(std::size_t max_size)
+    : max_size_{max_size}
+{
+}
+
+void HpackDynamicTable::Add(std::string name, std::string value) {
+    const std::size_t entry_size{name.size() + value.size() + kEntryOverhead};
+    if (entry_size > max_size_) {
+        // An entry larger than the table empties it and is not added
+        Evict(0);
+        return;
+    }
+    Evict(max_size_ - entry_size);
+    size_ += entry_size;
+    entries_.emplace_front(std::move(name), std::move(value));
+}
+
+void HpackDynamicTable::SetMaxSize(std::size_t max_size) {
+    max_size_ = max_size;
+    Evict(max_size_);
+}
+
+void HpackDynamicTable::Evict(std::size_t max_size) {
+    while (size_ > max_size) {
+        const auto& [name, value]{entries_.back()};
+        size_ -= name.size() + value.size() + kEntryOverhead;
+        entries_.pop_back();
+    }
+}
+
+HpackDecoder::HpackDecoder(std::size_t max_table_size, std::size_t max_header_list_size)
+    : table_{max_table_size}
+    , max_table_size_{max_table_size}
+    , max_header_list_size_{max_header_list_size}
+{
+}
+
+bool HpackDecoder::Decode(std::string_view block, HpackHeaderList& headers) {
+    // A few bytes referring to a large table entry over and over decode to far more than the block itself
+    std::size_t header_list_size{0};
+    const auto fits{[&](std::string_view name, std::string_view value) {
+        header_list_size += name.size() + value.size() + kEntryOverhead;
+        return header_list_size <= max_header_list_size_;
+    }};
+    bool field_decoded{false};
+    while (!block.empty()) {
+        const unsigned char first_byte{static_cast<unsigned char>(block.front())};
+        if ((first_byte & 0x80) != 0) {
+            // Indexed header field
+            const std::optional<std::size_t> index{ReadInteger(block, 7)};
+            const std::pair<std::string, std::string>* entry{index ? Find(*index) : nullptr};
+            if (entry == nullptr || !fits(entry->first, entry->second)) {
+                return false;
+            }
+            headers.push_back(*entry);
+            field_decoded = true;
+            continue;
+        }
+        if ((first_byte & 0xe0) == 0x20) {
+            // Dynamic table size update, only allowed at the start of a block
+            const std::optional<std::size_t> max_size{ReadInteger(block, 5)};
+            if (!max_size || *max_size > max_table_size_ || field_decoded) {
+                return false;
+            }
+            table_.SetMaxSize(*max_size);
+            continue;
+        }
+
+        // Literal header field, with incremental indexing (01), without indexing (0000) or never indexed (0001)
+        const bool add_to_table{(first_byte & 0xc0) == 0x40};
+        const std::optional<std::size_t> name_index{ReadInteger(block, add_to_table ? 6 : 4)};
+        if (!name_index) {
+            return false;
+        }
+        std::optional<std::string> name;
+        if (*name_index != 0) {
+            const std::pair<std::string, std::string>* entry{Find(*name_index)};
+            if (entry == nullptr) {
+                return false;
+            }
+            name = entry->first;
+        } else {
+            name = ReadString(block);
+        }
+        std::optional<std::string> value{ReadString(block)};
+        if (!name || !value || !fits(*name, *value)) {
+            return false;
+        }
+        if (add_to_table) {
+            table_.Add(*name, *value);
+        }
+        headers.emplace_back(std::move(*name), std::move(*value));
+        field_decoded = true;
+    }
+    return true;
+}
+
+const std::pair<std::string, std::string>* HpackDecoder::Find(std::size_t index) const {
+    // Static entries are copied out, they are not kept as std::string
+    static const std::vector<std::pair<std::string, std::string>> kStaticEntries{
+        kStaticTable.begin(), kStaticTable.end()};
+    if (index == 0) {
+        return nullptr;
+    } else if (index <= kStaticEntries.size()) {
+        return &kStaticEntries[index - 1];
+    }
+    index -= kStaticEntries.size() + 1;
+    return index < table_.GetEntryCount() ? &table_.Get(index) : nullptr;
+}
+
+HpackEncoder::HpackEncoder()
+    : table_{kHpackDefaultTableSize}
+{
+}
+
+void HpackEncoder::SetMaxTableSize(std::size_t max_table_size) {
+    max_table_size = std::min(max_table_size, kHpackDefaultTableSize);
+    if (max_table_size == table_.GetMaxSize()) {
+        return;
+    }
+    table_.SetMaxSize(max_table_size);
+    min_pending_table_size_ = std::min(min_pending_table_size_.value_or(max_table_size), max_table_size);
+}
+
+void HpackEncoder::Encode(const HpackHeaderList& headers, std::string& out) {
+    if (min_pending_table_size_) {
+        // The decoder has to see the smallest size first to evict what the encoder evicted
+        WriteInteger(*min_pending_table_size_, 5, 0x20, out);
+        if (*min_pending_table_size_ != table_.GetMaxSize()) {
+            WriteInteger(table_.GetMaxSize(), 5, 0x20, out);
+        }
+        min_pending_table_size_.reset();
+    }
+
+    for (const auto& [name, value] : headers) {
+        std::size_t name_index{0};
+        std::size_t full_index{0};
+        for (std::size_t i{0}; i < kStaticTable.size() && full_index == 0; ++i) {
+            if (kStaticTable[i].first == name) {
+                name_index = name_index == 0 ? i + 1 : name_index;
+                full_index = kStaticTable[i].second == value ? i + 1 : 0;
+            }
+        }
+        for (std::size_t i{0}; i < table_.GetEntryCount() && full_index == 0; ++i) {
+            const auto& [entry_name, entry_value]{table_.Get(i)};
+            if (entry_name == name) {
+                name_index = name_index == 0 ? kStaticTable.size() + i + 1 : name_index;
+                full_index = entry_value == value ? kStaticTable.size() + i + 1 : 0;
+            }
+        }
+        if (full_index != 0) {
+            WriteInteger(full_index, 7, 0x80, out);
+            continue;
+        }
+
+        if (std::ranges::find(kNeverIndexedHeaders, name) != kNeverIndexedHeaders.end()) {
+            WriteInteger(name_index, 4, 0x10, out);
+        } else if (std::ranges::find(kNotIndexedHeaders, name) != kNotIndexedHeaders.end()) {
+            WriteInteger(name_index, 4, 0x00, out);
+        } else {
+            WriteInteger(name_index, 6, 0x40, out);
+            table_.Add(name, value);
+        }
+        if (name_index == 0) {
+            EncodeString(name, out);
+        }
+        EncodeString(value, out);
+    }
+}
+
+void HpackEncoder::EncodeString(std::string_view str, std::string& out) {
+    const std::size_t huffman_size{HuffmanEncodedSize(str)};
+    if (huffman_size < str.size()) {
+        WriteInteger(huffman_size, 7, 0x80, out);
+        HuffmanEncode(str, out);
+    } else {
+        WriteInteger(str.size(), 7, 0x00, out);
+        out += str;
+    }
+}
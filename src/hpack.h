@@ -0,0 +1,79 @@
+#ifndef HTTP_SERVER_HPACK_H
+#define HTTP_SERVER_HPACK_H
+
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <limits>
+
+#include <cstddef>
+
+// Header compression of HTTP/2, RFC 7541
+
+using HpackHeaderList = std::vector<std::pair<std::string, std::string>>;
+
+// SETTINGS_HEADER_TABLE_SIZE until the peer announces another one
+inline constexpr std::size_t kHpackDefaultTableSize{4096};
+
+class HpackDynamicTable {
+    // Newest entry first
+    std::deque<std::pair<std::string, std::string>> entries_;
+    std::size_t size_{0};
+    std::size_t max_size_;
+
+public:
+    explicit HpackDynamicTable(std::size_t max_size);
+
+    std::size_t GetMaxSize() const noexcept { return max_size_; }
+    std::size_t GetEntryCount() const noexcept { return entries_.size(); }
+    // Zero is the newest entry
+    const std::pair<std::string, std::string>& Get(std::size_t index) const { return entries_[index]; }
+
+    void Add(std::string name, std::string value);
+    void SetMaxSize(std::size_t max_size);
+
+private:
+    void Evict(std::size_t max_size);
+};
+
+class HpackDecoder {
+    HpackDynamicTable table_;
+    // Table size announced to the peer, which bounds its size updates
+    std::size_t max_table_size_;
+    // SETTINGS_MAX_HEADER_LIST_SIZE announced to the peer: name, value and 32 bytes summed over the fields of a block
+    std::size_t max_header_list_size_;
+
+public:
+    explicit HpackDecoder(std::size_t max_table_size = kHpackDefaultTableSize,
+                          std::size_t max_header_list_size = std::numeric_limits<std::size_t>::max());
+
+    // Appends the fields of a complete header block; a failure is a connection error.
+    // Blocks which decode to more than the header list size fail before the fields are copied.
+    bool Decode(std::string_view block, HpackHeaderList& headers);
+
+private:
+    const std::pair<std::string, std::string>* Find(std::size_t index) const;
+};
+
+class HpackEncoder {
+    HpackDynamicTable table_;
+    // Table size changes not yet signalled to the peer: the smallest one and the final one
+    std::optional<std::size_t> min_pending_table_size_;
+
+public:
+    HpackEncoder();
+
+    // Applies SETTINGS_HEADER_TABLE_SIZE of the peer, the encoder never uses more than the default size
+    void SetMaxTableSize(std::size_t max_table_size);
+    // Header names must be lowercase
+    void Encode(const HpackHeaderList& headers, std::string& out);
+
+private:
+    void EncodeString(std::string_view str, std::string& out);
+};
+
+#endif //HTTP_SERVER_HPACK_H
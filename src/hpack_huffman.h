@@ -0,0 +1,16 @@
+#ifndef HTTP_SERVER_HPACK_HUFFMAN_H
+#define HTTP_SERVER_HPACK_HUFFMAN_H
+
+#include <string>
+#include <string_view>
+
+#include <cstddef>
+
+// Static Huffman code of HPACK, RFC 7541 Appendix B
+
+std::size_t HuffmanEncodedSize(std::string_view data) noexcept;
+void HuffmanEncode(std::string_view data, std::string& out);
+// Fails on the EOS symbol and on padding which is not a prefix of it
+bool HuffmanDecode(std::string_view data, std::string& out);
+
+#endif //HTTP_SERVER_HPACK_HUFFMAN_H
@@ -1,27 +1,68 @@
 #include "http.h"
 
 #include "http_utils.h"
+#include "utils.h"
 
 #include <string_view>
 
-namespace {
-constexpr std::string_view ToString(HttpResponseStatus status) noexcept {
+std::size_t GetBodySize(const HttpResponseBody& body) noexcept {
+    return std::visit(overloaded{
+        [](const std::string& bytes) { return bytes.size(); },
+        [](std::string_view bytes) { return bytes.size(); },
+        [](const std::shared_ptr<const std::string>& bytes) { return bytes ? bytes->size() : 0; },
+        [](const HttpFileRegion& region) { return region.size; },
+    }, body);
+}
+
+std::optional<std::size_t> GetContentLength(const HttpResponse& response) noexcept {
+    if (response.response_status == HttpResponseStatus::k304NotModified) {
+        return std::nullopt;
+    }
+    return GetBodySize(response.body);
+}
+
+std::optional<std::string_view> GetBodyBytes(const HttpResponseBody& body) noexcept {
+    return std::visit(overloaded{
+        [](const std::string& bytes) { return std::optional<std::string_view>{bytes}; },
+        [](std::string_view bytes) { return std::optional<std::string_view>{bytes}; },
+        [](const std::shared_ptr<const std::string>& bytes) {
+            return std::optional<std::string_view>{bytes ? std::string_view{*bytes} : std::string_view{}};
+        },
+        [](const HttpFileRegion& region) { return std::optional<std::string_view>{}; },
+    }, body);
+}
+
+std::string_view ToString(HttpResponseStatus status) noexcept {
     switch (status) {
     case HttpResponseStatus::k200Ok:
         return "200 OK";
     case HttpResponseStatus::k201Created:
         return "201 Created";
+    case HttpResponseStatus::k304NotModified:
+        return "304 Not Modified";
     case HttpResponseStatus::k400BadRequest:
         return "400 Bad Request";
     case HttpResponseStatus::k404NotFound:
         return "404 Not Found";
     case HttpResponseStatus::k422UnprocessableContent:
         return "422 Unprocessable Content";
+    case HttpResponseStatus::k429TooManyRequests:
+        return "429 Too Many Requests";
+    case HttpResponseStatus::k500InternalServerError:
+        return "500 Internal Server Error";
+    case HttpResponseStatus::k501NotImplemented:
+        return "501 Not Implemented";
+    case HttpResponseStatus::k502BadGateway:
+        return "502 Bad Gateway";
+    case HttpResponseStatus::k503ServiceUnavailable:
+        return "503 Service Unavailable";
+    case HttpResponseStatus::k504GatewayTimeout:
+        return "504 Gateway Timeout";
     }
-}
+    return "500 Internal Server Error";
 }
 
-std::string ToString(const HttpResponse& response) {
+std::string ToHeadString(const HttpResponse& response) {
     std::string res;
     res += kHttpVersion;
     res += ' ';
@@ -34,16 +75,15 @@ std::string ToString(const HttpResponse& response) {
         res += value;
         res += kHttpLineTerminator;
     }
-    res += kHttpContentLengthHeader;
-    res += ": ";
-    res += std::to_string(response.body.size());
-    res += kHttpLineTerminator;
+    if (const std::optional<std::size_t> content_length{GetContentLength(response)}) {
+        res += kHttpContentLengthHeader;
+        res += ": ";
+        res += std::to_string(*content_length);
+        res += kHttpLineTerminator;
+    }
 
 
     res += kHttpLineTerminator;
 
-    res += response.body;
-
     return res;
 }
-
@@ -1,8 +1,17 @@
 #ifndef HTTP_SERVER_HTTP_H
 #define HTTP_SERVER_HTTP_H
 
+#include "file_descriptor.h"
+
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <variant>
+
+#include <cstddef>
+#include <cstdint>
 
 enum class HttpMethod {
     kGet,
@@ -19,18 +28,47 @@ struct HttpRequest {
 enum class HttpResponseStatus {
     k200Ok = 200,
     k201Created = 201,
+    k304NotModified = 304,
     k400BadRequest = 400,
     k404NotFound = 404,
     k422UnprocessableContent = 422,
+    k429TooManyRequests = 429,
+    k500InternalServerError = 500,
+    k501NotImplemented = 501,
+    k502BadGateway = 502,
+    k503ServiceUnavailable = 503,
+    k504GatewayTimeout = 504,
+};
+
+// Part of an open file, sent without passing through user space where the transport allows it
+struct HttpFileRegion {
+    std::shared_ptr<FileDescriptor> file;
+    std::uint64_t offset{0};
+    std::size_t size{0};
 };
 
+// Body of a response. Besides owning its bytes it may borrow them, from the request, which outlives the
+// response, or from data of the handler; share immutable bytes with other responses, or refer to a file.
+using HttpResponseBody = std::variant<std::string, std::string_view, std::shared_ptr<const std::string>,
+                                      HttpFileRegion>;
+
 struct HttpResponse {
     HttpResponseStatus response_status{HttpResponseStatus::k400BadRequest};
     std::unordered_map<std::string, std::string> headers;
-    std::string body;
+    HttpResponseBody body;
 
 };
 
-std::string ToString(const HttpResponse& response);
+std::size_t GetBodySize(const HttpResponseBody& body) noexcept;
+// Value of Content-Length, nothing for a 304 whose headers describe the body it did not send
+std::optional<std::size_t> GetContentLength(const HttpResponse& response) noexcept;
+// Bytes of a body held in memory, nothing for file regions
+std::optional<std::string_view> GetBodyBytes(const HttpResponseBody& body) noexcept;
+
+// Status code followed by the reason phrase, e.g. "200 OK"
+std::string_view ToString(HttpResponseStatus status) noexcept;
+
+// Status line and headers up to the empty line, the body is sent after it
+std::string ToHeadString(const HttpResponse& response);
 
 #endif //HTTP_SERVER_HTTP_H
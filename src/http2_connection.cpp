@@ -0,0 +1,885 @@
+#include "http2_connection.h"
+
+#include "http_utils.h"
+#include "str_utils.h"
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <utility>
+
+#include <cctype>
+
+namespace {
+enum class Http2FrameType : std::uint8_t {
+    kData = 0x0,
+    kHeaders = 0x1,
+    kPriority = 0x2,
+    kRstStream = 0x3,
+    kSettings = 0x4,
+    kPushPromise = 0x5,
+    kPing = 0x6,
+    kGoAway = 0x7,
+    kWindowUpdate = 0x8,
+    kContinuation = 0x9,
+};
+
+enum class Http2Setting : std::uint16_t {
+    kHeaderTableSize = 0x1,
+    kEnablePush = 0x2,
+    kMaxConcurrentStreams = 0x3,
+    kInitialWindowSize = 0x4,
+    kMaxFrameSize = 0x5,
+    kMaxHeaderListSize = 0x6,
+};
+
+constexpr std::uint8_t kFlagEndStream{0x1};
+constexpr std::uint8_t kFlagAck{0x1};
+constexpr std::uint8_t kFlagEndHeaders{0x4};
+constexpr std::uint8_t kFlagPadded{0x8};
+constexpr std::uint8_t kFlagPriority{0x20};
+
+constexpr std::size_t kFrameHeaderSize{9};
+constexpr std::size_t kSettingSize{6};
+constexpr std::size_t kPriorityFieldsSize{5};
+constexpr std::size_t kDefaultMaxFrameSize{16'384};
+constexpr std::size_t kLargestMaxFrameSize{16'777'215};
+constexpr std::int64_t kDefaultWindowSize{65'535};
+constexpr std::int64_t kMaxWindowSize{2'147'483'647};
+
+// Advertised to the peer
+constexpr std::uint32_t kMaxConcurrentStreams{100};
+constexpr std::int64_t kStreamWindowSize{256 * 1024};
+constexpr std::int64_t kConnectionWindowSize{1024 * 1024};
+// Bounds both the encoded header block and the header list it decodes to
+constexpr std::size_t kMaxHeaderBlockBytes{64 * 1024};
+
+// Flow-controlled data produced per TakeOutput call
+constexpr std::size_t kMaxOutputBytes{64 * 1024};
+// Response streams are asked to pause once this much data waits for flow control
+constexpr std::size_t kMaxPendingStreamBytes{64 * 1024};
+
+// Connection-specific header fields are not allowed in HTTP/2
+constexpr std::array<std::string_view, 5> kConnectionSpecificHeaders{
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"};
+
+std::uint32_t ReadUint32(std::string_view data) noexcept {
+    return (static_cast<std::uint32_t>(static_cast<unsigned char>(data[0])) << 24)
+        | (static_cast<std::uint32_t>(static_cast<unsigned char>(data[1])) << 16)
+        | (static_cast<std::uint32_t>(static_cast<unsigned char>(data[2])) << 8)
+        | static_cast<std::uint32_t>(static_cast<unsigned char>(data[3]));
+}
+
+void WriteUint32(std::uint32_t value, std::string& out) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+void WriteSetting(Http2Setting setting, std::uint32_t value, std::string& out) {
+    out += static_cast<char>(static_cast<std::uint16_t>(setting) >> 8);
+    out += static_cast<char>(static_cast<std::uint16_t>(setting));
+    WriteUint32(value, out);
+}
+
+bool IsConnectionSpecificHeader(std::string_view name) noexcept {
+    return std::ranges::any_of(kConnectionSpecificHeaders,
+        [name](std::string_view header) { return EqualsIgnoreCase(name, header); });
+}
+
+// Handlers look headers up the way HTTP/1.1 clients usually spell them, e.g. "User-Agent"
+std::string ToCanonicalHeaderName(std::string_view name) {
+    std::string canonical{name};
+    bool word_start{true};
+    for (char& c : canonical) {
+        c = static_cast<char>(word_start ? std::toupper(static_cast<unsigned char>(c)) : c);
+        word_start = c == '-';
+    }
+    return canonical;
+}
+
+// Validates the pseudo-header fields and turns the header list into a request
+bool BuildRequest(HpackHeaderList& fields, HttpRequest& request) {
+    bool has_method{false};
+    bool has_scheme{false};
+    bool regular_header_seen{false};
+    for (auto& [name, value] : fields) {
+        if (name.starts_with(':')) {
+            if (regular_header_seen) {
+                return false;
+            }
+            if (name == ":method") {
+                const std::optional<HttpMethod> method{ToHttpMethod(value)};
+                if (!method || has_method) {
+                    return false;
+                }
+                request.method = *method;
+                has_method = true;
+            } else if (name == ":path") {
+                if (value.empty() || !request.path.empty()) {
+                    return false;
+                }
+                request.path = std::move(value);
+            } else if (name == ":scheme") {
+                has_scheme = true;
+            } else if (name == ":authority") {
+                request.headers.insert_or_assign("Host", std::move(value));
+            } else {
+                return false;
+            }
+            continue;
+        }
+
+        regular_header_seen = true;
+        if (std::ranges::any_of(name, [](char c) { return std::isupper(static_cast<unsigned char>(c)) != 0; })
+            || IsConnectionSpecificHeader(name)) {
+            return false;
+        }
+        auto [header_it, inserted]{request.headers.try_emplace(ToCanonicalHeaderName(name), value)};
+        if (!inserted) {
+            // Cookies may be split into several fields
+            header_it->second += name == "cookie" ? "; " : ", ";
+            header_it->second += value;
+        }
+    }
+    return has_method && has_scheme && !request.path.empty();
+}
+}
+
+// Response stream of a single HTTP/2 stream, handed to the handlers
+class Http2Connection::ResponseStream final : public HttpResponseStream {
+    Http2Connection* connection_;
+    std::uint32_t stream_id_;
+    std::function<void()> writable_callback_;
+
+public:
+    ResponseStream(Http2Connection& connection, std::uint32_t stream_id)
+        : connection_{&connection}
+        , stream_id_{stream_id}
+    {
+    }
+
+    void WriteHead(std::string_view status, const Headers& headers, std::optional<size_t> content_length) override {
+        if (connection_ != nullptr) {
+            connection_->SendHeaders(stream_id_, status, headers, content_length);
+        }
+    }
+
+    bool WriteBody(std::string_view data) override {
+        return connection_ != nullptr && connection_->QueueData(stream_id_, data);
+    }
+
+    void Finish() override {
+        if (connection_ != nullptr) {
+            connection_->FinishStream(stream_id_);
+        }
+    }
+
+    void Abort() override {
+        if (connection_ != nullptr) {
+            connection_->ResetStream(stream_id_, Http2ErrorCode::kInternalError);
+        }
+    }
+
+    bool IsClosed() const noexcept override {
+        return connection_ == nullptr;
+    }
+
+    void SetWritableCallback(std::function<void()> callback) override {
+        writable_callback_ = std::move(callback);
+    }
+
+    void NotifyWritable() {
+        if (writable_callback_) {
+            writable_callback_();
+        }
+    }
+
+    void Detach() noexcept {
+        connection_ = nullptr;
+    }
+};
+
+bool MayBeHttp2ConnectionPreface(std::string_view data) noexcept {
+    return data.size() <= kHttp2ConnectionPreface.size() ? kHttp2ConnectionPreface.starts_with(data)
+                                                         : data.starts_with(kHttp2ConnectionPreface);
+}
+
+std::optional<std::string> DecodeHttp2SettingsHeader(std::string_view value) {
+    // base64url, trailing padding is tolerated
+    while (value.ends_with('=')) {
+        value.remove_suffix(1);
+    }
+    std::string settings;
+    std::uint32_t bits{0};
+    std::size_t bit_count{0};
+    for (const char c : value) {
+        std::uint32_t sextet;
+        if (c >= 'A' && c <= 'Z') {
+            sextet = static_cast<std::uint32_t>(c - 'A');
+        } else if (c >= 'a' && c <= 'z') {
+            sextet = static_cast<std::uint32_t>(c - 'a' + 26);
+        } else if (c >= '0' && c <= '9') {
+            sextet = static_cast<std::uint32_t>(c - '0' + 52);
+        } else if (c == '-') {
+            sextet = 62;
+        } else if (c == '_') {
+            sextet = 63;
+        } else {
+            return std::nullopt;
+        }
+        bits = (bits << 6) | sextet;
+        bit_count += 6;
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            settings += static_cast<char>(bits >> bit_count);
+        }
+    }
+    if (settings.size() % kSettingSize != 0) {
+        return std::nullopt;
+    }
+    return settings;
+}
+
+Http2Connection::Http2Connection(Http2ConnectionListener& listener)
+    : listener_{&listener}
+    , decoder_{kHpackDefaultTableSize, kMaxHeaderBlockBytes}
+    , peer_max_frame_size_{kDefaultMaxFrameSize}
+    , peer_initial_window_size_{kDefaultWindowSize}
+    , send_window_{kDefaultWindowSize}
+    , receive_window_{kConnectionWindowSize}
+{
+    // The server connection preface
+    std::string settings;
+    WriteSetting(Http2Setting::kMaxConcurrentStreams, kMaxConcurrentStreams, settings);
+    WriteSetting(Http2Setting::kInitialWindowSize, static_cast<std::uint32_t>(kStreamWindowSize), settings);
+    WriteSetting(Http2Setting::kMaxHeaderListSize, static_cast<std::uint32_t>(kMaxHeaderBlockBytes), settings);
+    WriteFrameHeader(settings.size(), static_cast<std::uint8_t>(Http2FrameType::kSettings), 0, 0);
+    output_ += settings;
+    WriteWindowUpdate(0, static_cast<std::size_t>(kConnectionWindowSize - kDefaultWindowSize));
+}
+
+Http2Connection::~Http2Connection() {
+    for (auto& [stream_id, stream] : streams_) {
+        if (stream.response_stream) {
+            stream.response_stream->Detach();
+        }
+    }
+}
+
+void Http2Connection::StartUpgraded(std::string_view settings, HttpRequest request) {
+    // The settings of the upgrade request are acknowledged by the 101 response itself
+    if (!ApplySettings(settings)) {
+        return;
+    }
+    last_stream_id_ = 1;
+    Stream& stream{OpenStream(1)};
+    stream.stats.method = request.method;
+    stream.stats.path = request.path;
+    buffered_bytes_ += request.body.size();
+    stream.request = std::move(request);
+    stream.remote_closed = true;
+    completed_streams_.push_back(1);
+    DispatchCompletedStreams();
+}
+
+void Http2Connection::Receive(std::string_view data) {
+    if (failed_) {
+        return;
+    }
+    input_ += data;
+
+    if (!preface_received_) {
+        if (!MayBeHttp2ConnectionPreface(input_)) {
+            ConnectionError(Http2ErrorCode::kProtocolError);
+            return;
+        } else if (input_.size() < kHttp2ConnectionPreface.size()) {
+            return;
+        }
+        input_.erase(0, kHttp2ConnectionPreface.size());
+        preface_received_ = true;
+    }
+
+    std::string_view frames{input_};
+    while (frames.size() >= kFrameHeaderSize) {
+        const std::size_t length{(static_cast<std::size_t>(static_cast<unsigned char>(frames[0])) << 16)
+            | (static_cast<std::size_t>(static_cast<unsigned char>(frames[1])) << 8)
+            | static_cast<std::size_t>(static_cast<unsigned char>(frames[2]))};
+        // The peer must stick to the default SETTINGS_MAX_FRAME_SIZE, no larger one is announced
+        if (length > kDefaultMaxFrameSize) {
+            ConnectionError(Http2ErrorCode::kFrameSizeError);
+            break;
+        }
+        if (frames.size() < kFrameHeaderSize + length) {
+            break;
+        }
+        const std::uint8_t type{static_cast<std::uint8_t>(frames[3])};
+        const std::uint8_t flags{static_cast<std::uint8_t>(frames[4])};
+        const std::uint32_t stream_id{ReadUint32(frames.substr(5)) & 0x7fff'ffffu};
+        const std::string_view payload{frames.substr(kFrameHeaderSize, length)};
+        frames.remove_prefix(kFrameHeaderSize + length);
+        if (!ProcessFrame(type, flags, stream_id, payload)) {
+            break;
+        }
+    }
+    input_.erase(0, input_.size() - frames.size());
+
+    DispatchCompletedStreams();
+}
+
+std::string Http2Connection::TakeOutput() {
+    ScheduleData();
+    std::string output{std::move(output_)};
+    output_.clear();
+    NotifyWritableStreams();
+    return output;
+}
+
+void Http2Connection::Shutdown() {
+    if (!going_away_) {
+        going_away_ = true;
+        WriteGoAway(Http2ErrorCode::kNoError);
+    }
+}
+
+void Http2Connection::Terminate(Http2ErrorCode error_code) {
+    ConnectionError(error_code);
+}
+
+bool Http2Connection::IsFinished() const noexcept {
+    return failed_ || ((going_away_ || peer_going_away_) && streams_.empty());
+}
+
+bool Http2Connection::ProcessFrame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id,
+                                   std::string_view payload) {
+    // Nothing may interleave with a header block
+    if (header_block_stream_id_ != 0 && type != static_cast<std::uint8_t>(Http2FrameType::kContinuation)) {
+        return ConnectionError(Http2ErrorCode::kProtocolError);
+    }
+
+    switch (static_cast<Http2FrameType>(type)) {
+    case Http2FrameType::kData:
+        return ProcessData(flags, stream_id, payload);
+    case Http2FrameType::kHeaders:
+        return ProcessHeaders(flags, stream_id, payload);
+    case Http2FrameType::kPriority:
+        // Streams are served round-robin, priorities are not taken into account
+        if (stream_id == 0) {
+            return ConnectionError(Http2ErrorCode::kProtocolError);
+        }
+        if (payload.size() != kPriorityFieldsSize) {
+            ResetStream(stream_id, Http2ErrorCode::kFrameSizeError);
+        }
+        return true;
+    case Http2FrameType::kRstStream:
+        return ProcessRstStream(stream_id, payload);
+    case Http2FrameType::kSettings:
+        return ProcessSettings(flags, stream_id, payload);
+    case Http2FrameType::kPushPromise:
+        // Clients cannot push
+        return ConnectionError(Http2ErrorCode::kProtocolError);
+    case Http2FrameType::kPing:
+        return ProcessPing(flags, stream_id, payload);
+    case Http2FrameType::kGoAway:
+        return ProcessGoAway(stream_id, payload);
+    case Http2FrameType::kWindowUpdate:
+        return ProcessWindowUpdate(stream_id, payload);
+    case Http2FrameType::kContinuation:
+        return ProcessContinuation(flags, stream_id, payload);
+    }
+    // Unknown frame types are ignored
+    return true;
+}
+
+bool Http2Connection::ProcessData(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload) {
+    if (stream_id == 0) {
+        return ConnectionError(Http2ErrorCode::kProtocolError);
+    }
+
+    // The whole frame counts against flow control, padding included
+    receive_window_ -= static_cast<std::int64_t>(payload.size());
+    if (receive_window_ < 0) {
+        return ConnectionError(Http2ErrorCode::kFlowControlError);
+    }
+    unacknowledged_bytes_ += payload.size();
+    if (unacknowledged_bytes_ >= static_cast<std::size_t>(kConnectionWindowSize / 2)) {
+        WriteWindowUpdate(0, unacknowledged_bytes_);
+        receive_window_ += static_cast<std::int64_t>(std::exchange(unacknowledged_bytes_, 0));
+    }
+
+    const std::size_t frame_size{payload.size()};
+    if ((flags & kFlagPadded) != 0) {
+        if (payload.empty() || static_cast<unsigned char>(payload.front()) >= payload.size()) {
+            return ConnectionError(Http2ErrorCode::kProtocolError);
+        }
+        const std::size_t padding{static_cast<unsigned char>(payload.front())};
+        payload = payload.substr(1, payload.size() - 1 - padding);
+    }
+
+    auto stream_it{streams_.find(stream_id)};
+    if (stream_it == streams_.end()) {
+        if (stream_id > last_stream_id_) {
+            return ConnectionError(Http2ErrorCode::kProtocolError);
+        }
+        WriteRstStream(stream_id, Http2ErrorCode::kStreamClosed);
+        return true;
+    }
+    Stream& stream{stream_it->second};
+    if (stream.remote_closed) {
+        ResetStream(stream_id, Http2ErrorCode::kStreamClosed);
+        return true;
+    }
+    stream.receive_window -= static_cast<std::int64_t>(frame_size);
+    if (stream.receive_window < 0) {
+        ResetStream(stream_id, Http2ErrorCode::kFlowControlError);
+        return true;
+    }
+
+    stream.request.body += payload;
+    buffered_bytes_ += payload.size();
+    if ((flags & kFlagEndStream) != 0) {
+        stream.remote_closed = true;
+        completed_streams_.push_back(stream_id);
+        return true;
+    }
+    stream.unacknowledged_bytes += frame_size;
+    if (stream.unacknowledged_bytes >= static_cast<std::size_t>(kStreamWindowSize / 2)) {
+        WriteWindowUpdate(stream_id, stream.unacknowledged_bytes);
+        stream.receive_window += static_cast<std::int64_t>(std::exchange(stream.unacknowledged_bytes, 0));
+    }
+    return true;
+}
+
+bool Http2Connection::ProcessHeaders(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload) {
+    if (stream_id == 0) {
+        return ConnectionError(Http2ErrorCode::kProtocolError);
+    }
+
+    std::size_t padding{0};
+    if ((flags & kFlagPadded) != 0) {
+        if (payload.empty()) {
+            return ConnectionError(Http2ErrorCode::kProtocolError);
+        }
+        padding = static_cast<unsigned char>(payload.front());
+        payload.remove_prefix(1);
+    }
+    if ((flags & kFlagPriority) != 0) {
+        if (payload.size() < kPriorityFieldsSize) {
+            return ConnectionError(Http2ErrorCode::kFrameSizeError);
+        }
+        payload.remove_prefix(kPriorityFieldsSize);
+    }
+    if (padding > payload.size()) {
+        return ConnectionError(Http2ErrorCode::kProtocolError);
+    }
+    payload.remove_suffix(padding);
+
+    if (!streams_.contains(stream_id)) {
+        // Client streams are odd and their identifiers only grow
+        if (stream_id % 2 == 0) {
+            return ConnectionError(Http2ErrorCode::kProtocolError);
+        } else if (stream_id <= last_stream_id_) {
+            return ConnectionError(Http2ErrorCode::kStreamClosed);
+        }
+        last_stream_id_ = stream_id;
+    }
+
+    header_block_stream_id_ = stream_id;
+    header_block_.assign(payload);
+    header_block_end_stream_ = (flags & kFlagEndStream) != 0;
+    return (flags & kFlagEndHeaders) == 0 || ProcessHeaderBlock();
+}
+
+bool Http2Connection::ProcessContinuation(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload) {
+    if (header_block_stream_id_ == 0 || stream_id != header_block_stream_id_) {
+        return ConnectionError(Http2ErrorCode::kProtocolError);
+    }
+    if (header_block_.size() + payload.size() > kMaxHeaderBlockBytes) {
+        return ConnectionError(Http2ErrorCode::kEnhanceYourCalm);
+    }
+    header_block_ += payload;
+    return (flags & kFlagEndHeaders) == 0 || ProcessHeaderBlock();
+}
+
+bool Http2Connection::ProcessHeaderBlock() {
+    const std::uint32_t stream_id{std::exchange(header_block_stream_id_, 0)};
+    // Every block is decoded, even the ones of refused streams, to keep the decoder in sync with the peer
+    HpackHeaderList fields;
+    if (!decoder_.Decode(header_block_, fields)) {
+        return ConnectionError(Http2ErrorCode::kCompressionError);
+    }
+    header_block_.clear();
+
+    if (auto stream_it{streams_.find(stream_id)}; stream_it != streams_.end()) {
+        // Trailers, which are not passed on to the handlers
+        Stream& stream{stream_it->second};
+        if (!header_block_end_stream_ || stream.remote_closed) {
+            ResetStream(stream_id, Http2ErrorCode::kProtocolError);
+            return true;
+        }
+        stream.remote_closed = true;
+        completed_streams_.push_back(stream_id);
+        return true;
+    }
+
+    if (going_away_) {
+        // Beyond the last stream announced with GOAWAY, the peer retries it elsewhere
+        return true;
+    }
+    if (streams_.size() >= kMaxConcurrentStreams) {
+        WriteRstStream(stream_id, Http2ErrorCode::kRefusedStream);
+        return true;
+    }
+
+    Stream& stream{OpenStream(stream_id)};
+    stream.bad_request = !BuildRequest(fields, stream.request);
+    stream.stats.method = stream.request.method;
+    stream.stats.path = stream.request.path;
+    if (header_block_end_stream_) {
+        stream.remote_closed = true;
+        completed_streams_.push_back(stream_id);
+    }
+    return true;
+}
+
+bool Http2Connection::ProcessRstStream(std::uint32_t stream_id, std::string_view payload) {
+    if (stream_id == 0 || stream_id > last_stream_id_) {
+        return ConnectionError(Http2ErrorCode::kProtocolError);
+    } else if (payload.size() != 4) {
+        return ConnectionError(Http2ErrorCode::kFrameSizeError);
+    }
+    if (auto stream_it{streams_.find(stream_id)}; stream_it != streams_.end()) {
+        CloseStream(stream_it);
+    }
+    return true;
+}
+
+bool Http2Connection::ProcessSettings(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload) {
+    if (stream_id != 0) {
+        return ConnectionError(Http2ErrorCode::kProtocolError);
+    }
+    if ((flags & kFlagAck) != 0) {
+        return payload.empty() || ConnectionError(Http2ErrorCode::kFrameSizeError);
+    }
+    if (!ApplySettings(payload)) {
+        return false;
+    }
+    WriteFrameHeader(0, static_cast<std::uint8_t>(Http2FrameType::kSettings), kFlagAck, 0);
+    return true;
+}
+
+bool Http2Connection::ApplySettings(std::string_view payload) {
+    if (payload.size() % kSettingSize != 0) {
+        return ConnectionError(Http2ErrorCode::kFrameSizeError);
+    }
+    for (; !payload.empty(); payload.remove_prefix(kSettingSize)) {
+        const auto setting{static_cast<Http2Setting>(
+            (static_cast<unsigned char>(payload[0]) << 8) | static_cast<unsigned char>(payload[1]))};
+        const std::uint32_t value{ReadUint32(payload.substr(2))};
+        switch (setting) {
+        case Http2Setting::kHeaderTableSize:
+            encoder_.SetMaxTableSize(value);
+            break;
+        case Http2Setting::kEnablePush:
+            if (value > 1) {
+                return ConnectionError(Http2ErrorCode::kProtocolError);
+            }
+            break;
+        case Http2Setting::kInitialWindowSize: {
+            if (value > kMaxWindowSize) {
+                return ConnectionError(Http2ErrorCode::kFlowControlError);
+            }
+            // Applies to the open streams as well
+            const std::int64_t delta{static_cast<std::int64_t>(value) - peer_initial_window_size_};
+            peer_initial_window_size_ = value;
+            for (auto& [id, stream] : streams_) {
+                stream.send_window += delta;
+                if (stream.send_window > kMaxWindowSize) {
+                    return ConnectionError(Http2ErrorCode::kFlowControlError);
+                }
+            }
+            break;
+        }
+        case Http2Setting::kMaxFrameSize:
+            if (value < kDefaultMaxFrameSize || value > kLargestMaxFrameSize) {
+                return ConnectionError(Http2ErrorCode::kProtocolError);
+            }
+            peer_max_frame_size_ = value;
+            break;
+        case Http2Setting::kMaxConcurrentStreams:
+        case Http2Setting::kMaxHeaderListSize:
+            // The server neither pushes nor sends large header lists
+            break;
+        }
+    }
+    return true;
+}
+
+bool Http2Connection::ProcessPing(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload) {
+    static constexpr std::size_t kPingSize{8};
+    if (stream_id != 0) {
+        return ConnectionError(Http2ErrorCode::kProtocolError);
+    } else if (payload.size() != kPingSize) {
+        return ConnectionError(Http2ErrorCode::kFrameSizeError);
+    }
+    if ((flags & kFlagAck) == 0) {
+        WriteFrameHeader(kPingSize, static_cast<std::uint8_t>(Http2FrameType::kPing), kFlagAck, 0);
+        output_ += payload;
+    }
+    return true;
+}
+
+bool Http2Connection::ProcessGoAway(std::uint32_t stream_id, std::string_view payload) {
+    if (stream_id != 0) {
+        return ConnectionError(Http2ErrorCode::kProtocolError);
+    } else if (payload.size() < 8) {
+        return ConnectionError(Http2ErrorCode::kFrameSizeError);
+    }
+    // Streams already started are completed, the server does not open any
+    peer_going_away_ = true;
+    return true;
+}
+
+bool Http2Connection::ProcessWindowUpdate(std::uint32_t stream_id, std::string_view payload) {
+    if (payload.size() != 4) {
+        return ConnectionError(Http2ErrorCode::kFrameSizeError);
+    }
+    const std::int64_t increment{ReadUint32(payload) & 0x7fff'ffffu};
+    if (stream_id == 0) {
+        if (increment == 0) {
+            return ConnectionError(Http2ErrorCode::kProtocolError);
+        }
+        send_window_ += increment;
+        return send_window_ <= kMaxWindowSize || ConnectionError(Http2ErrorCode::kFlowControlError);
+    }
+
+    auto stream_it{streams_.find(stream_id)};
+    if (stream_it == streams_.end()) {
+        // Updates may still arrive for streams closed in the meantime
+        return stream_id <= last_stream_id_ || ConnectionError(Http2ErrorCode::kProtocolError);
+    }
+    if (increment == 0) {
+        ResetStream(stream_id, Http2ErrorCode::kProtocolError);
+        return true;
+    }
+    stream_it->second.send_window += increment;
+    if (stream_it->second.send_window > kMaxWindowSize) {
+        ResetStream(stream_id, Http2ErrorCode::kFlowControlError);
+    }
+    return true;
+}
+
+bool Http2Connection::ConnectionError(Http2ErrorCode error_code) {
+    if (!failed_) {
+        failed_ = true;
+        going_away_ = true;
+        WriteGoAway(error_code);
+    }
+    return false;
+}
+
+Http2Connection::Stream& Http2Connection::OpenStream(std::uint32_t stream_id) {
+    Stream& stream{streams_[stream_id]};
+    stream.send_window = peer_initial_window_size_;
+    stream.receive_window = kStreamWindowSize;
+    stream.stats.started_at = std::chrono::steady_clock::now();
+    return stream;
+}
+
+void Http2Connection::DispatchCompletedStreams() {
+    // Handlers may respond right away, which can close streams and append further ones
+    for (std::size_t i{0}; i < completed_streams_.size(); ++i) {
+        const std::uint32_t stream_id{completed_streams_[i]};
+        auto stream_it{streams_.find(stream_id)};
+        if (stream_it == streams_.end() || stream_it->second.dispatched) {
+            continue;
+        }
+        Stream& stream{stream_it->second};
+        stream.dispatched = true;
+        buffered_bytes_ -= stream.request.body.size();
+        stream.response_stream = std::make_shared<ResponseStream>(*this, stream_id);
+        std::shared_ptr<ResponseStream> response_stream{stream.response_stream};
+        if (stream.bad_request) {
+            response_stream->WriteResponse(HttpResponse{.response_status = HttpResponseStatus::k400BadRequest});
+        } else {
+            listener_->OnHttp2Request(std::move(stream.request), std::move(response_stream));
+        }
+    }
+    completed_streams_.clear();
+}
+
+void Http2Connection::CloseStream(std::unordered_map<std::uint32_t, Stream>::iterator stream_it) {
+    Stream& stream{stream_it->second};
+    if (!stream.dispatched) {
+        buffered_bytes_ -= stream.request.body.size();
+    }
+    if (stream.response_stream) {
+        stream.response_stream->Detach();
+        listener_->OnHttp2StreamFinished(stream.stats);
+    }
+    streams_.erase(stream_it);
+}
+
+void Http2Connection::ScheduleStream(std::uint32_t stream_id, Stream& stream) {
+    if (!stream.in_send_queue) {
+        stream.in_send_queue = true;
+        send_queue_.push_back(stream_id);
+    }
+}
+
+void Http2Connection::ScheduleData() {
+    bool progress{true};
+    while (progress && output_.size() < kMaxOutputBytes && !send_queue_.empty()) {
+        progress = false;
+        for (std::size_t pending{send_queue_.size()}; pending > 0 && output_.size() < kMaxOutputBytes; --pending) {
+            const std::uint32_t stream_id{send_queue_.front()};
+            send_queue_.pop_front();
+            auto stream_it{streams_.find(stream_id)};
+            if (stream_it == streams_.end()) {
+                continue;
+            }
+            Stream& stream{stream_it->second};
+            stream.in_send_queue = false;
+
+            const std::size_t window{static_cast<std::size_t>(std::max<std::int64_t>(
+                std::min(stream.send_window, send_window_), 0))};
+            const std::size_t chunk{std::min({stream.pending_data.size(), window, peer_max_frame_size_})};
+            const bool end_stream{stream.finish_pending && chunk == stream.pending_data.size()};
+            if (chunk == 0 && !end_stream) {
+                // Waits for WINDOW_UPDATE
+                ScheduleStream(stream_id, stream);
+                continue;
+            }
+
+            WriteFrameHeader(chunk, static_cast<std::uint8_t>(Http2FrameType::kData),
+                             end_stream ? kFlagEndStream : 0, stream_id);
+            output_.append(stream.pending_data, 0, chunk);
+            stream.pending_data.erase(0, chunk);
+            stream.send_window -= static_cast<std::int64_t>(chunk);
+            send_window_ -= static_cast<std::int64_t>(chunk);
+            stream.stats.bytes += chunk;
+            progress = true;
+
+            if (end_stream) {
+                // Both sides are closed, requests are only dispatched once fully received
+                CloseStream(stream_it);
+            } else if (!stream.pending_data.empty()) {
+                ScheduleStream(stream_id, stream);
+            }
+        }
+    }
+}
+
+void Http2Connection::NotifyWritableStreams() {
+    std::vector<std::shared_ptr<ResponseStream>> writable_streams;
+    for (auto& [stream_id, stream] : streams_) {
+        if (stream.writer_blocked && stream.pending_data.size() < kMaxPendingStreamBytes) {
+            stream.writer_blocked = false;
+            writable_streams.push_back(stream.response_stream);
+        }
+    }
+    // Callbacks write to the streams, which changes streams_
+    for (const std::shared_ptr<ResponseStream>& response_stream : writable_streams) {
+        response_stream->NotifyWritable();
+    }
+}
+
+void Http2Connection::WriteFrameHeader(std::size_t length, std::uint8_t type, std::uint8_t flags,
+                                       std::uint32_t stream_id) {
+    output_ += static_cast<char>(length >> 16);
+    output_ += static_cast<char>(length >> 8);
+    output_ += static_cast<char>(length);
+    output_ += static_cast<char>(type);
+    output_ += static_cast<char>(flags);
+    WriteUint32(stream_id, output_);
+}
+
+void Http2Connection::WriteWindowUpdate(std::uint32_t stream_id, std::size_t increment) {
+    WriteFrameHeader(4, static_cast<std::uint8_t>(Http2FrameType::kWindowUpdate), 0, stream_id);
+    WriteUint32(static_cast<std::uint32_t>(increment), output_);
+}
+
+void Http2Connection::WriteRstStream(std::uint32_t stream_id, Http2ErrorCode error_code) {
+    WriteFrameHeader(4, static_cast<std::uint8_t>(Http2FrameType::kRstStream), 0, stream_id);
+    WriteUint32(static_cast<std::uint32_t>(error_code), output_);
+}
+
+void Http2Connection::WriteGoAway(Http2ErrorCode error_code) {
+    WriteFrameHeader(8, static_cast<std::uint8_t>(Http2FrameType::kGoAway), 0, 0);
+    WriteUint32(last_stream_id_, output_);
+    WriteUint32(static_cast<std::uint32_t>(error_code), output_);
+}
+
+void Http2Connection::SendHeaders(std::uint32_t stream_id, std::string_view status,
+                                  const HttpResponseStream::Headers& headers,
+                                  std::optional<std::size_t> content_length) {
+    auto stream_it{streams_.find(stream_id)};
+    if (failed_ || stream_it == streams_.end()) {
+        return;
+    }
+    stream_it->second.stats.status = static_cast<unsigned>(TryParseSizeT(status.substr(0, 3)).value_or(0));
+
+    HpackHeaderList fields;
+    fields.emplace_back(":status", status.substr(0, 3));
+    for (const auto& [name, value] : headers) {
+        if (IsConnectionSpecificHeader(name) || EqualsIgnoreCase(name, kHttpContentLengthHeader)) {
+            continue;
+        }
+        std::string lowercase_name{name};
+        std::ranges::transform(lowercase_name, lowercase_name.begin(),
+            [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+        fields.emplace_back(std::move(lowercase_name), value);
+    }
+    if (content_length) {
+        fields.emplace_back("content-length", std::to_string(*content_length));
+    }
+    std::string block;
+    encoder_.Encode(fields, block);
+
+    // Blocks larger than a frame continue in CONTINUATION frames
+    std::string_view remaining{block};
+    auto type{Http2FrameType::kHeaders};
+    do {
+        const std::string_view fragment{remaining.substr(0, peer_max_frame_size_)};
+        remaining.remove_prefix(fragment.size());
+        WriteFrameHeader(fragment.size(), static_cast<std::uint8_t>(type), remaining.empty() ? kFlagEndHeaders : 0,
+                         stream_id);
+        output_ += fragment;
+        type = Http2FrameType::kContinuation;
+    } while (!remaining.empty());
+    listener_->OnHttp2Output();
+}
+
+bool Http2Connection::QueueData(std::uint32_t stream_id, std::string_view data) {
+    auto stream_it{streams_.find(stream_id)};
+    if (failed_ || stream_it == streams_.end() || stream_it->second.finish_pending) {
+        return false;
+    }
+    Stream& stream{stream_it->second};
+    if (!data.empty()) {
+        stream.pending_data += data;
+        ScheduleStream(stream_id, stream);
+        listener_->OnHttp2Output();
+    }
+    stream.writer_blocked = stream.pending_data.size() >= kMaxPendingStreamBytes;
+    return !stream.writer_blocked;
+}
+
+void Http2Connection::FinishStream(std::uint32_t stream_id) {
+    auto stream_it{streams_.find(stream_id)};
+    if (failed_ || stream_it == streams_.end()) {
+        return;
+    }
+    stream_it->second.finish_pending = true;
+    ScheduleStream(stream_id, stream_it->second);
+    listener_->OnHttp2Output();
+}
+
+void Http2Connection::ResetStream(std::uint32_t stream_id, Http2ErrorCode error_code) {
+    WriteRstStream(stream_id, error_code);
+    if (auto stream_it{streams_.find(stream_id)}; stream_it != streams_.end()) {
+        CloseStream(stream_it);
+    }
+    listener_->OnHttp2Output();
+}
@@ -0,0 +1,165 @@
+#ifndef HTTP_SERVER_HTTP2_CONNECTION_H
+#define HTTP_SERVER_HTTP2_CONNECTION_H
+
+#include "hpack.h"
+#include "http.h"
+#include "http_response_stream.h"
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+inline constexpr std::string_view kHttp2ConnectionPreface{"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"};
+
+enum class Http2ErrorCode : std::uint32_t {
+    kNoError = 0x0,
+    kProtocolError = 0x1,
+    kInternalError = 0x2,
+    kFlowControlError = 0x3,
+    kStreamClosed = 0x5,
+    kFrameSizeError = 0x6,
+    kRefusedStream = 0x7,
+    kCompressionError = 0x9,
+    kEnhanceYourCalm = 0xb,
+};
+
+struct Http2StreamStats {
+    HttpMethod method{HttpMethod::kGet};
+    std::string path;
+    unsigned status{0};
+    std::uint64_t bytes{0};
+    std::chrono::steady_clock::time_point started_at;
+};
+
+class Http2ConnectionListener {
+public:
+    virtual ~Http2ConnectionListener() = default;
+
+    // A request arrived completely on a new stream, the response is written to the given stream
+    virtual void OnHttp2Request(HttpRequest request, std::shared_ptr<HttpResponseStream> response_stream) = 0;
+    // Response streams queued frames outside of Receive and TakeOutput
+    virtual void OnHttp2Output() = 0;
+    virtual void OnHttp2StreamFinished(const Http2StreamStats& stats) = 0;
+};
+
+// True while the data received so far does not rule out the HTTP/2 connection preface
+bool MayBeHttp2ConnectionPreface(std::string_view data) noexcept;
+// Payload of the SETTINGS frame carried by the HTTP2-Settings header of an h2c upgrade request
+std::optional<std::string> DecodeHttp2SettingsHeader(std::string_view value);
+
+// Server side of an HTTP/2 connection, RFC 9113. It only parses and produces bytes, the transport is up to the owner.
+class Http2Connection {
+    class ResponseStream;
+
+    struct Stream {
+        HttpRequest request;
+        bool bad_request{false};
+        std::shared_ptr<ResponseStream> response_stream;
+        // Response body waiting for flow control
+        std::string pending_data;
+        std::int64_t send_window;
+        std::int64_t receive_window;
+        // Received bytes not yet granted back with WINDOW_UPDATE
+        std::size_t unacknowledged_bytes{0};
+        Http2StreamStats stats;
+        bool remote_closed{false};
+        bool dispatched{false};
+        // END_STREAM follows once the pending data is sent
+        bool finish_pending{false};
+        bool in_send_queue{false};
+        bool writer_blocked{false};
+    };
+
+    Http2ConnectionListener* listener_;
+    HpackDecoder decoder_;
+    HpackEncoder encoder_;
+    std::string input_;
+    std::string output_;
+    bool preface_received_{false};
+    bool going_away_{false};
+    bool peer_going_away_{false};
+    bool failed_{false};
+    std::uint32_t last_stream_id_{0};
+
+    // Header block split into CONTINUATION frames
+    std::uint32_t header_block_stream_id_{0};
+    std::string header_block_;
+    bool header_block_end_stream_{false};
+
+    std::size_t peer_max_frame_size_;
+    std::int64_t peer_initial_window_size_;
+    std::int64_t send_window_;
+    std::int64_t receive_window_;
+    std::size_t unacknowledged_bytes_{0};
+    std::size_t buffered_bytes_{0};
+
+    std::unordered_map<std::uint32_t, Stream> streams_;
+    // Streams with response data or END_STREAM to send, served round-robin
+    std::deque<std::uint32_t> send_queue_;
+    // Streams whose request is complete, dispatched once the received frames are processed
+    std::vector<std::uint32_t> completed_streams_;
+
+public:
+    explicit Http2Connection(Http2ConnectionListener& listener);
+    ~Http2Connection();
+
+    Http2Connection(const Http2Connection&) = delete;
+    Http2Connection& operator=(const Http2Connection&) = delete;
+
+    // Continues an HTTP/1.1 request which asked for the upgrade, it becomes stream 1
+    void StartUpgraded(std::string_view settings, HttpRequest request);
+    void Receive(std::string_view data);
+    // Frames to send; flow-controlled data is produced in bounded amounts, so call again once they are sent
+    std::string TakeOutput();
+    // Sends GOAWAY, streams already started are still served
+    void Shutdown();
+    void Terminate(Http2ErrorCode error_code);
+
+    // Nothing is left to do besides sending the output
+    bool IsFinished() const noexcept;
+    // Request bytes held until their streams are complete
+    std::size_t GetBufferedBytes() const noexcept { return buffered_bytes_; }
+
+private:
+    bool ProcessFrame(std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+    bool ProcessData(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+    bool ProcessHeaders(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+    bool ProcessContinuation(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+    bool ProcessHeaderBlock();
+    bool ProcessRstStream(std::uint32_t stream_id, std::string_view payload);
+    bool ProcessSettings(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+    bool ApplySettings(std::string_view payload);
+    bool ProcessPing(std::uint8_t flags, std::uint32_t stream_id, std::string_view payload);
+    bool ProcessGoAway(std::uint32_t stream_id, std::string_view payload);
+    bool ProcessWindowUpdate(std::uint32_t stream_id, std::string_view payload);
+    bool ConnectionError(Http2ErrorCode error_code);
+
+    Stream& OpenStream(std::uint32_t stream_id);
+    void DispatchCompletedStreams();
+    void CloseStream(std::unordered_map<std::uint32_t, Stream>::iterator stream_it);
+    void ScheduleStream(std::uint32_t stream_id, Stream& stream);
+    void ScheduleData();
+    void NotifyWritableStreams();
+
+    void WriteFrameHeader(std::size_t length, std::uint8_t type, std::uint8_t flags, std::uint32_t stream_id);
+    void WriteWindowUpdate(std::uint32_t stream_id, std::size_t increment);
+    void WriteRstStream(std::uint32_t stream_id, Http2ErrorCode error_code);
+    void WriteGoAway(Http2ErrorCode error_code);
+
+    // Used by the response streams
+    void SendHeaders(std::uint32_t stream_id, std::string_view status, const HttpResponseStream::Headers& headers,
+                     std::optional<std::size_t> content_length);
+    bool QueueData(std::uint32_t stream_id, std::string_view data);
+    void FinishStream(std::uint32_t stream_id);
+    void ResetStream(std::uint32_t stream_id, Http2ErrorCode error_code);
+};
+
+#endif //HTTP_SERVER_HTTP2_CONNECTION_H
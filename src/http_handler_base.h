@@ -1,15 +1,28 @@
 #ifndef HTTP_SERVER_HTTP_HANDLER_BASE_H
 #define HTTP_SERVER_HTTP_HANDLER_BASE_H
 
+#include "file_descriptor.h"
 #include "http.h"
 
+class AsyncHttpHandlerBase;
 
 class HttpHandlerBase {
 public:
     virtual ~HttpHandlerBase() = default;
 
     virtual bool IsMyRequest(const HttpRequest& request) const = 0;
-    virtual HttpResponse HandleRequest(const HttpRequest& request) = 0;
+    // The request is handed over, fields may be moved into the response. What is left of it stays alive
+    // until the response is sent, so the body may also be a view into it.
+    virtual HttpResponse HandleRequest(HttpRequest&& request) = 0;
+
+    virtual AsyncHttpHandlerBase* AsAsync() noexcept { return nullptr; }
+
+    // Handlers storing request bodies in files may return the file here, the server then moves the body into it
+    // without buffering and calls HandleStoredRequest instead of HandleRequest. The request has no body yet.
+    virtual FileDescriptor OpenRequestBodyFile(const HttpRequest& request) { return FileDescriptor{}; }
+    virtual HttpResponse HandleStoredRequest(HttpRequest&& request) {
+        return HttpResponse{.response_status = HttpResponseStatus::k500InternalServerError};
+    }
 };
 
 #endif //HTTP_SERVER_HTTP_HANDLER_BASE_H
@@ -49,6 +49,21 @@ HttpRequest HttpParser::GetRequest() {
     return request;
 }
 
+std::optional<size_t> HttpParser::GetContentLength() const {
+    auto content_length_it{request_.headers.find(std::string{kHttpContentLengthHeader})};
+    if (content_length_it == request_.headers.end()) {
+        return std::nullopt;
+    }
+    return TryParseSizeT(content_length_it->second);
+}
+
+HttpRequest HttpParser::TakeRequestWithPartialBody() {
+    assert(state_ == HttpParserState::kBody);
+    auto request{std::exchange(request_, HttpRequest{})};
+    state_ = HttpParserState::kStartLine;
+    return request;
+}
+
 bool HttpParser::ParseStartLine(std::string_view& buffer) {
     assert(state_ == HttpParserState::kStartLine);
 
@@ -121,9 +136,8 @@ bool HttpParser::ParseBody(std::string_view& buffer) {
     assert(state_ == HttpParserState::kBody);
 
     size_t body_size{0};
-    auto content_length_it{request_.headers.find(std::string{kHttpContentLengthHeader})};
-    if (content_length_it != request_.headers.end()) {
-        if (const auto size{TryParseSizeT(content_length_it->second)}) {
+    if (request_.headers.contains(std::string{kHttpContentLengthHeader})) {
+        if (const auto size{GetContentLength()}) {
             body_size = *size;
         } else {
             // Failed to read Content-Length number
@@ -3,9 +3,12 @@
 
 #include "http.h"
 
+#include <optional>
 #include <string>
 #include <string_view>
 
+#include <cstddef>
+
 enum class HttpParserState {
     kStartLine,
     kHeaders,
@@ -23,6 +26,11 @@ public:
     HttpParserState GetState() const noexcept { return state_; }
     HttpParserState Parse(std::string& buffer);
     HttpRequest GetRequest();
+    // Body size announced by the request, valid from kBody on
+    std::optional<std::size_t> GetContentLength() const;
+    const HttpRequest& GetPartialRequest() const noexcept { return request_; }
+    // Hands out a request whose body is still being received, valid in kBody; the caller takes over the rest of it
+    HttpRequest TakeRequestWithPartialBody();
 
 private:
     bool ParseStartLine(std::string_view& buffer);
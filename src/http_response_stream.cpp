@@ -0,0 +1,44 @@
+#include "http_response_stream.h"
+
+#include <algorithm>
+#include <array>
+
+#include <cerrno>
+
+#include <unistd.h>
+
+namespace {
+constexpr std::size_t kFileReadBufSize{64 * 1024};
+}
+
+void HttpResponseStream::WriteResponse(const HttpResponse& response) {
+    WriteHead(ToString(response.response_status), Headers{response.headers.begin(), response.headers.end()},
+              GetContentLength(response));
+    if (const std::optional<std::string_view> bytes{GetBodyBytes(response.body)}) {
+        WriteBody(*bytes);
+        Finish();
+        return;
+    }
+
+    // Streams of a multiplexed transport take the file contents as data
+    const HttpFileRegion& region{std::get<HttpFileRegion>(response.body)};
+    std::array<char, kFileReadBufSize> buf;
+    std::uint64_t offset{region.offset};
+    std::size_t remaining{region.size};
+    while (remaining != 0) {
+        const ssize_t bytes_read{pread(region.file->Get(), buf.data(), std::min(buf.size(), remaining),
+                                       static_cast<off_t>(offset))};
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        // The file shrank or failed, the promised length cannot be delivered
+        if (bytes_read <= 0) {
+            Abort();
+            return;
+        }
+        WriteBody(std::string_view{buf.data(), static_cast<std::size_t>(bytes_read)});
+        offset += static_cast<std::size_t>(bytes_read);
+        remaining -= static_cast<std::size_t>(bytes_read);
+    }
+    Finish();
+}
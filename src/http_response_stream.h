@@ -0,0 +1,39 @@
+#ifndef HTTP_SERVER_HTTP_RESPONSE_STREAM_H
+#define HTTP_SERVER_HTTP_RESPONSE_STREAM_H
+
+#include "http.h"
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <cstddef>
+
+// Response which is produced piece by piece, e.g. while it is being received from an upstream.
+// Writes never block, the stream keeps a bounded amount of data which the peer did not take yet.
+class HttpResponseStream {
+public:
+    using Headers = std::vector<std::pair<std::string, std::string>>;
+
+    virtual ~HttpResponseStream() = default;
+
+    // status is the status code followed by the reason phrase, e.g. "200 OK". Without a content
+    // length the end of the body is signalled by Finish.
+    virtual void WriteHead(std::string_view status, const Headers& headers, std::optional<size_t> content_length) = 0;
+    // Returns false once the peer does not keep up; stop producing until the writable callback fires
+    virtual bool WriteBody(std::string_view data) = 0;
+    virtual void Finish() = 0;
+    // Gives up on a response that cannot be completed
+    virtual void Abort() = 0;
+
+    // The peer is gone, nothing written to the stream will be delivered
+    virtual bool IsClosed() const noexcept = 0;
+    virtual void SetWritableCallback(std::function<void()> callback) = 0;
+
+    void WriteResponse(const HttpResponse& response);
+};
+
+#endif //HTTP_SERVER_HTTP_RESPONSE_STREAM_H
@@ -10,6 +10,7 @@ inline constexpr std::string_view kHttpLineTerminator{"\r\n"};
 inline constexpr std::string_view kHttpVersion{"HTTP/1.1"};
 inline constexpr std::string_view kHttpContentLengthHeader{"Content-Length"};
 inline constexpr std::string_view kHttpContentTypeHeader{"Content-Type"};
+inline constexpr std::string_view kHttpRetryAfterHeader{"Retry-After"};
 
 constexpr std::optional<HttpMethod> ToHttpMethod(std::string_view method) noexcept {
     using enum HttpMethod;
@@ -21,4 +22,15 @@ constexpr std::optional<HttpMethod> ToHttpMethod(std::string_view method) noexce
     return std::nullopt;
 }
 
+constexpr std::string_view ToString(HttpMethod method) noexcept {
+    using enum HttpMethod;
+    switch (method) {
+    case kGet:
+        return "GET";
+    case kPost:
+        return "POST";
+    }
+    return "GET";
+}
+
 #endif //HTTP_SERVER_HTTP_UTILS_H
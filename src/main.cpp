@@ -1,53 +1,260 @@
+#include "get_asset_pack_http_handler.h"
 #include "get_echo_http_handler.h"
 #include "get_post_file_http_handler.h"
 #include "get_root_http_handler.h"
 #include "get_user_agent_http_handler.h"
+#include "proxy_http_handler.h"
+#include "rate_limiter.h"
+#include "response_cache.h"
 #include "server.h"
+#include "str_utils.h"
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <iostream>
+#include <limits>
 #include <optional>
+#include <string>
 #include <string_view>
 #include <utility>
+#include <vector>
+
+#include <cstdint>
 
 #include <netinet/in.h>
 
 namespace {
+struct ProxyRoute {
+    std::string path_prefix;
+    std::vector<std::string> upstreams;
+};
+
 struct CommandLine {
     std::filesystem::directory_entry dir_entry;
+    std::filesystem::path asset_pack_path;
+    std::vector<ProxyRoute> proxy_routes;
+    std::filesystem::path access_log_path;
+    std::filesystem::path slow_request_log_path;
+    std::chrono::milliseconds slow_request_threshold{0};
+    std::vector<ListenAddress> listen_addresses;
+    std::vector<unsigned> cpu_affinity;
+    std::chrono::microseconds busy_poll_duration{0};
+    std::chrono::microseconds socket_busy_poll{0};
+    std::optional<RateLimiterConfig> rate_limit;
+    std::optional<ResponseCacheConfig> response_cache;
 };
 
-std::optional<CommandLine> ParseArgs(int argc, char** argv) {
-    if (argc == 1) {
-        return CommandLine{};
+std::vector<std::string> SplitList(std::string_view list) {
+    std::vector<std::string> items;
+    while (!list.empty()) {
+        const size_t item_size{std::min(list.find(','), list.size())};
+        if (item_size != 0) {
+            items.emplace_back(list.substr(0, item_size));
+        }
+        list.remove_prefix(std::min(item_size + 1, list.size()));
+    }
+    return items;
+}
+
+// Accepts "<ipv4>:<port>", "[<ipv6>]:<port>" and "unix:<path>"
+std::optional<ListenAddress> ParseListenAddress(std::string_view arg) {
+    static constexpr std::string_view kUnixPrefix{"unix:"};
+    if (arg.starts_with(kUnixPrefix)) {
+        arg.remove_prefix(kUnixPrefix.size());
+        if (arg.empty()) {
+            return std::nullopt;
+        }
+        return UnixListenAddress{.path = std::filesystem::path{arg}};
+    }
+
+    const size_t port_separator{arg.rfind(':')};
+    if (port_separator == std::string_view::npos) {
+        return std::nullopt;
+    }
+    const std::optional<size_t> port{TryParseSizeT(arg.substr(port_separator + 1))};
+    if (!port || *port > std::numeric_limits<std::uint16_t>::max()) {
+        return std::nullopt;
+    }
+    std::string_view host{arg.substr(0, port_separator)};
+    if (host.starts_with('[') && host.ends_with(']')) {
+        host.remove_prefix(1);
+        host.remove_suffix(1);
+        return Ipv6ListenAddress{.address = std::string{host}, .port = static_cast<std::uint16_t>(*port)};
+    }
+    return Ipv4ListenAddress{.address = std::string{host}, .port = static_cast<std::uint16_t>(*port)};
+}
+
+// Accepts "<per-second>" and "<per-second>:<burst>", the burst defaults to one second worth of requests
+std::optional<RateLimit> ParseRateLimit(std::string_view arg) {
+    const size_t burst_separator{std::min(arg.find(':'), arg.size())};
+    const std::optional<size_t> per_second{TryParseSizeT(arg.substr(0, burst_separator))};
+    std::optional<size_t> burst{per_second};
+    if (burst_separator != arg.size()) {
+        burst = TryParseSizeT(arg.substr(burst_separator + 1));
     }
-    if (argc == 3 && std::string_view{argv[1]} == "--directory") {
-        std::filesystem::directory_entry dir_entry{std::string_view{argv[2]}};
-        if (dir_entry.exists()) {
-            return CommandLine{.dir_entry = std::move(dir_entry)};
+    if (!per_second || !burst || *per_second == 0 || *burst == 0
+        || std::max(*per_second, *burst) > std::numeric_limits<unsigned>::max()) {
+        return std::nullopt;
+    }
+    return RateLimit{.per_second = static_cast<unsigned>(*per_second), .burst = static_cast<unsigned>(*burst)};
+}
+
+std::optional<CommandLine> ParseArgs(int argc, char** argv) {
+    CommandLine command_line;
+    for (int i{1}; i < argc; ++i) {
+        const std::string_view arg{argv[i]};
+        if (arg == "--directory" && i + 1 < argc) {
+            std::filesystem::directory_entry dir_entry{std::string_view{argv[++i]}};
+            if (!dir_entry.exists()) {
+                return std::nullopt;
+            }
+            command_line.dir_entry = std::move(dir_entry);
+        } else if (arg == "--asset-pack" && i + 1 < argc) {
+            command_line.asset_pack_path = argv[++i];
+        } else if (arg == "--proxy" && i + 2 < argc) {
+            ProxyRoute route{.path_prefix = argv[i + 1], .upstreams = SplitList(argv[i + 2])};
+            i += 2;
+            if (route.upstreams.empty()) {
+                return std::nullopt;
+            }
+            command_line.proxy_routes.push_back(std::move(route));
+        } else if (arg == "--access-log" && i + 1 < argc) {
+            command_line.access_log_path = argv[++i];
+        } else if (arg == "--slow-request-log" && i + 2 < argc) {
+            const std::optional<size_t> milliseconds{TryParseSizeT(argv[i + 2])};
+            if (!milliseconds) {
+                return std::nullopt;
+            }
+            command_line.slow_request_log_path = argv[i + 1];
+            command_line.slow_request_threshold = std::chrono::milliseconds{*milliseconds};
+            i += 2;
+        } else if (arg == "--listen" && i + 1 < argc) {
+            std::optional<ListenAddress> address{ParseListenAddress(argv[++i])};
+            if (!address) {
+                return std::nullopt;
+            }
+            command_line.listen_addresses.push_back(std::move(*address));
+        } else if (arg == "--cpus" && i + 1 < argc) {
+            for (const std::string& cpu : SplitList(argv[++i])) {
+                const std::optional<size_t> cpu_index{TryParseSizeT(cpu)};
+                if (!cpu_index) {
+                    return std::nullopt;
+                }
+                command_line.cpu_affinity.push_back(static_cast<unsigned>(*cpu_index));
+            }
+        } else if ((arg == "--busy-poll" || arg == "--socket-busy-poll") && i + 1 < argc) {
+            const std::optional<size_t> microseconds{TryParseSizeT(argv[++i])};
+            if (!microseconds) {
+                return std::nullopt;
+            }
+            (arg == "--busy-poll" ? command_line.busy_poll_duration : command_line.socket_busy_poll) =
+                std::chrono::microseconds{*microseconds};
+        } else if ((arg == "--rate-limit" || arg == "--connection-rate-limit") && i + 1 < argc) {
+            std::optional<RateLimit> limit{ParseRateLimit(argv[++i])};
+            if (!limit) {
+                return std::nullopt;
+            }
+            RateLimiterConfig& rate_limit{command_line.rate_limit ? *command_line.rate_limit
+                                                                  : command_line.rate_limit.emplace()};
+            (arg == "--rate-limit" ? rate_limit.requests : rate_limit.connections) = *limit;
+        } else if (arg == "--route-rate-limit" && i + 2 < argc) {
+            std::optional<RateLimit> limit{ParseRateLimit(argv[i + 2])};
+            if (!limit) {
+                return std::nullopt;
+            }
+            RateLimiterConfig& rate_limit{command_line.rate_limit ? *command_line.rate_limit
+                                                                  : command_line.rate_limit.emplace()};
+            rate_limit.routes.push_back(RouteRateLimit{.path_prefix = argv[i + 1], .limit = *limit});
+            i += 2;
+        } else if (arg == "--cache" && i + 2 < argc) {
+            const std::optional<size_t> milliseconds{TryParseSizeT(argv[i + 2])};
+            if (!milliseconds) {
+                return std::nullopt;
+            }
+            ResponseCacheConfig& response_cache{command_line.response_cache ? *command_line.response_cache
+                                                                            : command_line.response_cache.emplace()};
+            response_cache.routes.push_back(CacheRoute{
+                .path_prefix = argv[i + 1], .ttl = std::chrono::milliseconds{*milliseconds}});
+            i += 2;
+        } else if (arg == "--cache-vary" && i + 1 < argc) {
+            // Applies to the preceding --cache
+            if (!command_line.response_cache || command_line.response_cache->routes.empty()) {
+                return std::nullopt;
+            }
+            command_line.response_cache->routes.back().vary_headers = SplitList(argv[++i]);
+        } else if (arg == "--cache-size" && i + 1 < argc) {
+            const std::optional<size_t> bytes{TryParseSizeT(argv[++i])};
+            if (!bytes) {
+                return std::nullopt;
+            }
+            ResponseCacheConfig& response_cache{command_line.response_cache ? *command_line.response_cache
+                                                                            : command_line.response_cache.emplace()};
+            response_cache.max_bytes = *bytes;
+        } else {
+            return std::nullopt;
         }
     }
-    return std::nullopt;
+    return command_line;
 }
 }
 
 int main(int argc, char **argv) {
     auto command_line = ParseArgs(argc, argv);
     if (!command_line) {
-        std::cout << "Usage: server [--directory <path-to-directory>]\n";
+        std::cout << "Usage: server [--directory <path-to-directory>] [--asset-pack <path-to-pack>] "
+                     "[--proxy <path-prefix> <host:port>[,<host:port>...]]... [--access-log <path>] "
+                     "[--slow-request-log <path> <milliseconds>] "
+                     "[--listen <ipv4>:<port> | [<ipv6>]:<port> | unix:<path>]... "
+                     "[--cpus <cpu>[,<cpu>...]] [--busy-poll <microseconds>] [--socket-busy-poll <microseconds>] "
+                     "[--rate-limit <per-second>[:<burst>]] [--connection-rate-limit <per-second>[:<burst>]] "
+                     "[--route-rate-limit <path-prefix> <per-second>[:<burst>]]... "
+                     "[--cache <path-prefix> <ttl-milliseconds> [--cache-vary <header>[,<header>...]]]... "
+                     "[--cache-size <bytes>]\n";
         return 1;
     }
 
-    HttpServer server;
-    server.AddHandler(std::make_unique<GetRootHttpHandler>());
-    server.AddHandler(std::make_unique<GetEchoHttpHandler>());
-    server.AddHandler(std::make_unique<GetUserAgentHttpHandler>());
-    if (!command_line->dir_entry.path().empty()) {
-        server.AddHandler(std::make_unique<GetFileHttpHandler>(command_line->dir_entry));
-        server.AddHandler(std::make_unique<PostFileHttpHandler>(std::move(command_line->dir_entry)));
+    HttpServerConfig config;
+    if (!command_line->access_log_path.empty()) {
+        config.access_log = AccessLogConfig{.path = std::move(command_line->access_log_path)};
+    }
+    if (!command_line->slow_request_log_path.empty()) {
+        config.slow_request_log = SlowRequestLogConfig{
+            .log = AccessLogConfig{.path = std::move(command_line->slow_request_log_path)},
+            .threshold = command_line->slow_request_threshold};
     }
+
+    config.cpu_affinity = std::move(command_line->cpu_affinity);
+    config.busy_poll_duration = command_line->busy_poll_duration;
+    config.socket_busy_poll = command_line->socket_busy_poll;
+    config.rate_limit = std::move(command_line->rate_limit);
+    config.response_cache = std::move(command_line->response_cache);
+
+    HttpServer server{std::move(config)};
     try {
-        server.Run(INADDR_ANY, 4221);
+        // Proxied routes take precedence over the built-in ones
+        for (ProxyRoute& route : command_line->proxy_routes) {
+            server.AddHandler(std::make_unique<ProxyHttpHandler>(std::move(route.path_prefix), route.upstreams));
+        }
+        server.AddHandler(std::make_unique<GetRootHttpHandler>());
+        server.AddHandler(std::make_unique<GetEchoHttpHandler>());
+        server.AddHandler(std::make_unique<GetUserAgentHttpHandler>());
+        // A pack serves the files in place of the directory, uploads still go to the directory
+        if (!command_line->asset_pack_path.empty()) {
+            server.AddHandler(std::make_unique<GetAssetPackHttpHandler>(command_line->asset_pack_path));
+        } else if (!command_line->dir_entry.path().empty()) {
+            server.AddHandler(std::make_unique<GetFileHttpHandler>(command_line->dir_entry));
+        }
+        if (!command_line->dir_entry.path().empty()) {
+            server.AddHandler(std::make_unique<PostFileHttpHandler>(std::move(command_line->dir_entry)));
+        }
+        if (command_line->listen_addresses.empty()) {
+            server.AddListener(Ipv4ListenAddress{.address = INADDR_ANY, .port = 4221});
+        }
+        for (ListenAddress& address : command_line->listen_addresses) {
+            server.AddListener(std::move(address));
+        }
+        server.Run();
     } catch (const std::exception& e) {
         std::cerr << e.what();
         return 1;
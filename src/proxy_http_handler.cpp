@@ -0,0 +1,578 @@
+#include "proxy_http_handler.h"
+
+#include "http_utils.h"
+#include "str_utils.h"
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <ranges>
+#include <string_view>
+#include <utility>
+
+#include <cerrno>
+#include <cstring>
+
+#include <netdb.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+namespace {
+constexpr std::chrono::milliseconds kMaxTimerTick{1'000};
+constexpr std::uint32_t kUpstreamEvents{EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET};
+
+constexpr std::string_view kConnectionHeader{"Connection"};
+constexpr std::string_view kTransferEncodingHeader{"Transfer-Encoding"};
+
+// Headers which describe the client connection rather than the request. The body is always framed
+// by the Content-Length of the forwarded request.
+constexpr std::array<std::string_view, 8> kNotForwardedHeaders{
+    kConnectionHeader, "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade", kHttpContentLengthHeader,
+    kTransferEncodingHeader,
+};
+
+const std::string* FindHeader(const HttpRequest& request, std::string_view name) {
+    auto header_it{std::ranges::find_if(request.headers,
+        [name](const auto& header) { return EqualsIgnoreCase(header.first, name); })};
+    return header_it != request.headers.end() ? &header_it->second : nullptr;
+}
+
+// Headers the client lists in Connection are hop-by-hop as well, RFC 9110 section 7.6.1
+bool IsNamedInConnection(std::string_view header, std::string_view connection) {
+    while (!connection.empty()) {
+        const size_t option_size{std::min(connection.find(','), connection.size())};
+        if (EqualsIgnoreCase(Strip(connection.substr(0, option_size)), header)) {
+            return true;
+        }
+        connection.remove_prefix(std::min(option_size + 1, connection.size()));
+    }
+    return false;
+}
+
+std::string SerializeRequest(const HttpRequest& request, std::string_view upstream_name) {
+    std::string res;
+    res += ToString(request.method);
+    res += ' ';
+    res += request.path;
+    res += ' ';
+    res += kHttpVersion;
+    res += kHttpLineTerminator;
+
+    const std::string* connection{FindHeader(request, kConnectionHeader)};
+    bool has_host{false};
+    for (const auto& [header, value] : request.headers) {
+        if (std::ranges::any_of(kNotForwardedHeaders, [&header](std::string_view not_forwarded) {
+                return EqualsIgnoreCase(header, not_forwarded);
+            }) || (connection != nullptr && IsNamedInConnection(header, *connection))) {
+            continue;
+        }
+        has_host = has_host || EqualsIgnoreCase(header, "Host");
+        res += header;
+        res += ": ";
+        res += value;
+        res += kHttpLineTerminator;
+    }
+    if (!has_host) {
+        res += "Host: ";
+        res += upstream_name;
+        res += kHttpLineTerminator;
+    }
+    if (!request.body.empty() || request.method == HttpMethod::kPost) {
+        res += kHttpContentLengthHeader;
+        res += ": ";
+        res += std::to_string(request.body.size());
+        res += kHttpLineTerminator;
+    }
+    res += kHttpLineTerminator;
+    res += request.body;
+    return res;
+}
+
+std::pair<std::string, std::string> SplitHostPort(std::string_view upstream) {
+    const size_t port_separator{upstream.rfind(':')};
+    if (port_separator == std::string_view::npos || port_separator + 1 == upstream.size()) {
+        throw ProxyHttpHandlerException{"Upstream must be given as host:port: " + std::string{upstream}};
+    }
+    std::string_view host{upstream.substr(0, port_separator)};
+    if (host.starts_with('[') && host.ends_with(']')) {
+        host = host.substr(1, host.size() - 2);
+    }
+    return {std::string{host}, std::string{upstream.substr(port_separator + 1)}};
+}
+}
+
+// Receives the response of a health check and reports it back to the handler
+class ProxyHttpHandler::HealthProbeStream final : public HttpResponseStream {
+    ProxyHttpHandler& handler_;
+    std::size_t upstream_index_;
+    bool success_{false};
+    bool done_{false};
+
+public:
+    HealthProbeStream(ProxyHttpHandler& handler, std::size_t upstream_index)
+        : handler_{handler}
+        , upstream_index_{upstream_index}
+    {
+    }
+
+    void WriteHead(std::string_view status, const Headers&, std::optional<size_t>) override {
+        success_ = status.starts_with('2') || status.starts_with('3');
+    }
+
+    bool WriteBody(std::string_view) override {
+        return true;
+    }
+
+    void Finish() override {
+        Report(success_);
+    }
+
+    void Abort() override {
+        Report(false);
+    }
+
+    bool IsClosed() const noexcept override {
+        return false;
+    }
+
+    void SetWritableCallback(std::function<void()>) override {
+    }
+
+private:
+    void Report(bool success) {
+        if (!std::exchange(done_, true)) {
+            handler_.upstreams_[upstream_index_].probe_in_flight = false;
+            handler_.RecordResult(upstream_index_, success);
+        }
+    }
+};
+
+ProxyHttpHandler::ProxyHttpHandler(std::string path_prefix, const std::vector<std::string>& upstreams,
+                                   ProxyHttpHandlerConfig config)
+    : path_prefix_{std::move(path_prefix)}
+    , config_{std::move(config)}
+{
+    if (upstreams.empty()) {
+        throw ProxyHttpHandlerException{"No upstreams given for " + path_prefix_};
+    }
+
+    // Resolved once up front, the event loop must not block on DNS
+    for (const std::string& upstream_name : upstreams) {
+        const auto [host, port]{SplitHostPort(upstream_name)};
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+        addrinfo* addresses{nullptr};
+        if (const int error{getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses)}; error != 0) {
+            throw ProxyHttpHandlerException{"Failed to resolve " + upstream_name + ": " + gai_strerror(error)};
+        }
+
+        Upstream& upstream{upstreams_.emplace_back()};
+        upstream.name = upstream_name;
+        std::memcpy(&upstream.address, addresses->ai_addr, addresses->ai_addrlen);
+        upstream.address_len = addresses->ai_addrlen;
+        freeaddrinfo(addresses);
+    }
+}
+
+bool ProxyHttpHandler::IsMyRequest(const HttpRequest& request) const {
+    return request.path.starts_with(path_prefix_);
+}
+
+void ProxyHttpHandler::Attach(EventLoop& event_loop) {
+    event_loop_ = &event_loop;
+
+    timer_fd_ = FileDescriptor{timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)};
+    if (timer_fd_.IsEmpty()) {
+        throw ProxyHttpHandlerException{StrError("timerfd_create failed")};
+    }
+    const auto tick{std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::min(config_.health_check_interval, kMaxTimerTick))};
+    const timespec tick_spec{
+        .tv_sec = static_cast<time_t>(tick.count() / 1'000'000'000),
+        .tv_nsec = static_cast<long>(tick.count() % 1'000'000'000),
+    };
+    const itimerspec timer_spec{.it_interval = tick_spec, .it_value = tick_spec};
+    if (timerfd_settime(timer_fd_.Get(), 0, &timer_spec, nullptr) == -1) {
+        throw ProxyHttpHandlerException{StrError("timerfd_settime failed")};
+    }
+    event_loop_->Register(timer_fd_.Get(), EPOLLIN | EPOLLET, *this);
+    next_health_check_ = std::chrono::steady_clock::now() + config_.health_check_interval;
+}
+
+void ProxyHttpHandler::HandleRequestAsync(HttpRequest request, std::shared_ptr<HttpResponseStream> response_stream) {
+    // The body was read by Content-Length alone. Forwarded on a pooled connection, a body the upstream frames
+    // differently would end early and its rest be taken for the next request, so such requests stop here.
+    if (FindHeader(request, kTransferEncodingHeader) != nullptr) {
+        response_stream->WriteResponse(HttpResponse{
+            .response_status = FindHeader(request, kHttpContentLengthHeader) != nullptr
+                ? HttpResponseStatus::k400BadRequest : HttpResponseStatus::k501NotImplemented});
+        return;
+    }
+
+    const std::size_t upstream_index{PickUpstream()};
+    const ExchangeKind kind{request.method == HttpMethod::kGet ? ExchangeKind::kRetriableRequest
+                                                               : ExchangeKind::kRequest};
+    StartExchange(upstream_index, SerializeRequest(request, upstreams_[upstream_index].name),
+                  std::move(response_stream), kind);
+}
+
+void ProxyHttpHandler::OnEvents(int fd, std::uint32_t events) {
+    if (fd == timer_fd_.Get()) {
+        OnTimer();
+        return;
+    }
+
+    auto connection_it{connections_.find(fd)};
+    if (connection_it == connections_.end()) {
+        return;
+    }
+    UpstreamConnection& connection{*connection_it->second};
+
+    switch (connection.state) {
+    case UpstreamConnectionState::kIdle:
+        // Pooled connection was closed by the upstream or got unsolicited data
+        if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0) {
+            CloseConnection(connection);
+        }
+        break;
+    case UpstreamConnectionState::kConnecting: {
+        int error{0};
+        socklen_t error_len{sizeof(error)};
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0) {
+            FailExchange(connection, HttpResponseStatus::k502BadGateway);
+        } else if ((events & EPOLLOUT) != 0) {
+            connection.state = UpstreamConnectionState::kSending;
+            SendRequest(connection);
+        }
+        break;
+    }
+    case UpstreamConnectionState::kSending:
+        if ((events & EPOLLERR) != 0) {
+            FailExchange(connection, HttpResponseStatus::k502BadGateway);
+        } else if ((events & EPOLLOUT) != 0) {
+            SendRequest(connection);
+        }
+        break;
+    case UpstreamConnectionState::kReceiving:
+        ReceiveResponse(connection);
+        break;
+    }
+}
+
+void ProxyHttpHandler::OnTimer() {
+    std::uint64_t expirations;
+    while (read(timer_fd_.Get(), &expirations, sizeof(expirations)) == sizeof(expirations)) {
+    }
+
+    const auto now{std::chrono::steady_clock::now()};
+    std::vector<int> timed_out;
+    std::vector<int> abandoned;
+    for (const auto& [fd, connection] : connections_) {
+        if (connection->state == UpstreamConnectionState::kIdle) {
+            continue;
+        }
+        if (connection->response_stream->IsClosed()) {
+            abandoned.push_back(fd);
+        } else if (connection->deadline <= now) {
+            timed_out.push_back(fd);
+        }
+    }
+    for (const int fd : abandoned) {
+        UpstreamConnection& connection{*connections_.at(fd)};
+        if (!connection.is_probe) {
+            --upstreams_[connection.upstream_index].active_exchanges;
+        }
+        CloseConnection(connection);
+    }
+    for (const int fd : timed_out) {
+        FailExchange(*connections_.at(fd), HttpResponseStatus::k504GatewayTimeout);
+    }
+
+    if (now < next_health_check_) {
+        return;
+    }
+    next_health_check_ = now + config_.health_check_interval;
+    for (std::size_t upstream_index{0}; upstream_index < upstreams_.size(); ++upstream_index) {
+        Upstream& upstream{upstreams_[upstream_index]};
+        if (upstream.probe_in_flight) {
+            continue;
+        }
+        upstream.probe_in_flight = true;
+        HttpRequest probe{.method = HttpMethod::kGet, .path = config_.health_check_path};
+        StartExchange(upstream_index, SerializeRequest(probe, upstream.name),
+                      std::make_shared<HealthProbeStream>(*this, upstream_index), ExchangeKind::kProbe);
+    }
+}
+
+std::size_t ProxyHttpHandler::PickUpstream() {
+    const bool any_healthy{std::ranges::any_of(upstreams_, &Upstream::healthy)};
+    // When everything looks down, keep trying all of them rather than failing every request
+    auto is_candidate{[any_healthy](const Upstream& upstream) { return upstream.healthy || !any_healthy; }};
+
+    std::optional<std::size_t> picked;
+    for (std::size_t offset{0}; offset < upstreams_.size(); ++offset) {
+        const std::size_t upstream_index{(next_upstream_ + offset) % upstreams_.size()};
+        const Upstream& upstream{upstreams_[upstream_index]};
+        if (!is_candidate(upstream)) {
+            continue;
+        }
+        if (config_.balancing == UpstreamBalancing::kRoundRobin) {
+            picked = upstream_index;
+            break;
+        }
+        if (!picked || upstream.active_exchanges < upstreams_[*picked].active_exchanges) {
+            picked = upstream_index;
+        }
+    }
+    next_upstream_ = (*picked + 1) % upstreams_.size();
+    return *picked;
+}
+
+void ProxyHttpHandler::StartExchange(std::size_t upstream_index, std::string request,
+                                     std::shared_ptr<HttpResponseStream> response_stream, ExchangeKind kind) {
+    const bool is_probe{kind == ExchangeKind::kProbe};
+    UpstreamConnection* connection{
+        AcquireConnection(upstream_index, kind == ExchangeKind::kRequest || kind == ExchangeKind::kRetriableRequest)};
+    if (connection == nullptr) {
+        if (!is_probe) {
+            RecordResult(upstream_index, false);
+        }
+        response_stream->WriteResponse(HttpResponse{.response_status = HttpResponseStatus::k502BadGateway});
+        return;
+    }
+
+    connection->exchange_id = next_exchange_id_++;
+    connection->is_probe = is_probe;
+    connection->retriable = kind == ExchangeKind::kRetriableRequest;
+    connection->head_sent = false;
+    connection->paused = false;
+    connection->request = std::move(request);
+    connection->request_sent = 0;
+    connection->buffer.clear();
+    connection->parser = UpstreamResponseParser{};
+    connection->response_stream = std::move(response_stream);
+    connection->deadline = std::chrono::steady_clock::now() + config_.response_timeout;
+    connection->response_stream->SetWritableCallback(
+        [this, fd = connection->socket.Get(), exchange_id = connection->exchange_id] {
+            ResumeExchange(fd, exchange_id);
+        });
+    if (!is_probe) {
+        ++upstreams_[upstream_index].active_exchanges;
+    }
+
+    if (connection->state == UpstreamConnectionState::kSending) {
+        SendRequest(*connection);
+    }
+}
+
+ProxyHttpHandler::UpstreamConnection* ProxyHttpHandler::AcquireConnection(std::size_t upstream_index,
+                                                                          bool allow_reuse) {
+    Upstream& upstream{upstreams_[upstream_index]};
+    if (allow_reuse && !upstream.idle_connections.empty()) {
+        UpstreamConnection& connection{*connections_.at(upstream.idle_connections.back())};
+        upstream.idle_connections.pop_back();
+        connection.state = UpstreamConnectionState::kSending;
+        connection.reused = true;
+        return &connection;
+    }
+
+    FileDescriptor socket{::socket(upstream.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)};
+    if (socket.IsEmpty()) {
+        return nullptr;
+    }
+    const int connected{connect(socket.Get(), reinterpret_cast<const sockaddr*>(&upstream.address),
+                                upstream.address_len)};
+    if (connected == -1 && errno != EINPROGRESS) {
+        return nullptr;
+    }
+
+    const int fd{socket.Get()};
+    auto connection{std::make_unique<UpstreamConnection>()};
+    connection->socket = std::move(socket);
+    connection->upstream_index = upstream_index;
+    connection->state = connected == 0 ? UpstreamConnectionState::kSending : UpstreamConnectionState::kConnecting;
+    event_loop_->Register(fd, kUpstreamEvents, *this);
+    return connections_.insert_or_assign(fd, std::move(connection)).first->second.get();
+}
+
+void ProxyHttpHandler::SendRequest(UpstreamConnection& connection) {
+    while (connection.request_sent < connection.request.size()) {
+        const ssize_t bytes_sent{send(connection.socket.Get(), connection.request.data() + connection.request_sent,
+                                      connection.request.size() - connection.request_sent, MSG_NOSIGNAL)};
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            FailExchange(connection, HttpResponseStatus::k502BadGateway);
+            return;
+        }
+        connection.request_sent += static_cast<std::size_t>(bytes_sent);
+    }
+
+    connection.state = UpstreamConnectionState::kReceiving;
+    ReceiveResponse(connection);
+}
+
+void ProxyHttpHandler::ReceiveResponse(UpstreamConnection& connection) {
+    static constexpr std::size_t kReadBufSize{16 * 1024};
+    std::array<char, kReadBufSize> read_buf;
+    while (!connection.paused) {
+        if (connection.response_stream->IsClosed()) {
+            // Client is gone, the rest of the response has nowhere to go
+            if (!connection.is_probe) {
+                --upstreams_[connection.upstream_index].active_exchanges;
+            }
+            CloseConnection(connection);
+            return;
+        }
+
+        const ssize_t bytes_read{read(connection.socket.Get(), read_buf.data(), read_buf.size())};
+        if (bytes_read == 0) {
+            if (connection.parser.ParseEof() == UpstreamResponseParserState::kFinished) {
+                CompleteExchange(connection);
+            } else {
+                FailExchange(connection, HttpResponseStatus::k502BadGateway);
+            }
+            return;
+        } else if (bytes_read == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            FailExchange(connection, HttpResponseStatus::k502BadGateway);
+            return;
+        }
+
+        connection.buffer.append(read_buf.data(), static_cast<std::size_t>(bytes_read));
+        if (!ParseResponse(connection)) {
+            return;
+        }
+    }
+}
+
+void ProxyHttpHandler::ResumeExchange(int fd, std::uint64_t exchange_id) {
+    auto connection_it{connections_.find(fd)};
+    if (connection_it == connections_.end()) {
+        return;
+    }
+    UpstreamConnection& connection{*connection_it->second};
+    if (connection.exchange_id != exchange_id || !connection.paused) {
+        return;
+    }
+
+    connection.paused = false;
+    if (ParseResponse(connection)) {
+        ReceiveResponse(connection);
+    }
+}
+
+bool ProxyHttpHandler::ParseResponse(UpstreamConnection& connection) {
+    auto write_head{[&connection] {
+        if (!std::exchange(connection.head_sent, true)) {
+            connection.response_stream->WriteHead(
+                connection.parser.GetStatus(), connection.parser.GetHeaders(), connection.parser.GetContentLength());
+        }
+    }};
+
+    const UpstreamResponseParserState state{connection.parser.Parse(
+        connection.buffer, [&connection, &write_head](std::string_view data) {
+            write_head();
+            if (!connection.response_stream->WriteBody(data)) {
+                connection.paused = true;
+            }
+            return !connection.paused;
+        })};
+
+    if (state == UpstreamResponseParserState::kError) {
+        FailExchange(connection, HttpResponseStatus::k502BadGateway);
+        return false;
+    }
+    if (connection.parser.HasHead()) {
+        write_head();
+    }
+    if (state == UpstreamResponseParserState::kFinished) {
+        CompleteExchange(connection);
+        return false;
+    }
+    return !connection.paused;
+}
+
+void ProxyHttpHandler::CompleteExchange(UpstreamConnection& connection) {
+    const std::size_t upstream_index{connection.upstream_index};
+    Upstream& upstream{upstreams_[upstream_index]};
+    std::shared_ptr<HttpResponseStream> response_stream{std::move(connection.response_stream)};
+    if (!connection.is_probe) {
+        --upstream.active_exchanges;
+        RecordResult(upstream_index, true);
+    }
+
+    if (connection.parser.IsReusable() && connection.buffer.empty()
+        && upstream.idle_connections.size() < config_.max_idle_connections_per_upstream) {
+        connection.state = UpstreamConnectionState::kIdle;
+        connection.request.clear();
+        connection.parser = UpstreamResponseParser{};
+        upstream.idle_connections.push_back(connection.socket.Get());
+    } else {
+        CloseConnection(connection);
+    }
+    response_stream->Finish();
+}
+
+void ProxyHttpHandler::FailExchange(UpstreamConnection& connection, HttpResponseStatus status) {
+    const std::size_t upstream_index{connection.upstream_index};
+    const bool is_probe{connection.is_probe};
+    const bool head_sent{connection.head_sent};
+    if (!is_probe) {
+        --upstreams_[upstream_index].active_exchanges;
+    }
+
+    // A pooled connection closed by the upstream while idle: nothing was processed, so try a fresh one
+    const bool stale_connection{connection.reused && connection.retriable && !head_sent
+                                && status == HttpResponseStatus::k502BadGateway && connection.buffer.empty()
+                                && connection.parser.GetState() == UpstreamResponseParserState::kStatusLine
+                                && !connection.parser.HasInterimResponse()};
+    std::string request{std::move(connection.request)};
+    std::shared_ptr<HttpResponseStream> response_stream{std::move(connection.response_stream)};
+    CloseConnection(connection);
+
+    if (stale_connection) {
+        StartExchange(upstream_index, std::move(request), std::move(response_stream), ExchangeKind::kRetry);
+        return;
+    }
+
+    if (!is_probe) {
+        RecordResult(upstream_index, false);
+    }
+    if (head_sent) {
+        response_stream->Abort();
+    } else {
+        response_stream->WriteResponse(HttpResponse{.response_status = status});
+    }
+}
+
+void ProxyHttpHandler::CloseConnection(UpstreamConnection& connection) {
+    const int fd{connection.socket.Get()};
+    if (connection.state == UpstreamConnectionState::kIdle) {
+        std::erase(upstreams_[connection.upstream_index].idle_connections, fd);
+    }
+    event_loop_->Unregister(fd);
+    connections_.erase(fd);
+}
+
+void ProxyHttpHandler::RecordResult(std::size_t upstream_index, bool success) {
+    Upstream& upstream{upstreams_[upstream_index]};
+    if (success) {
+        upstream.consecutive_failures = 0;
+        upstream.healthy = true;
+    } else if (++upstream.consecutive_failures >= config_.max_failures) {
+        upstream.healthy = false;
+    }
+}
@@ -0,0 +1,136 @@
+#ifndef HTTP_SERVER_PROXY_HTTP_HANDLER_H
+#define HTTP_SERVER_PROXY_HTTP_HANDLER_H
+
+#include "async_http_handler_base.h"
+#include "event_loop.h"
+#include "file_descriptor.h"
+#include "http.h"
+#include "http_response_stream.h"
+#include "upstream_response_parser.h"
+
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/socket.h>
+
+struct ProxyHttpHandlerException : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+enum class UpstreamBalancing {
+    kRoundRobin,
+    kLeastConnections,
+};
+
+struct ProxyHttpHandlerConfig {
+    UpstreamBalancing balancing{UpstreamBalancing::kRoundRobin};
+    std::size_t max_idle_connections_per_upstream{32};
+    // Consecutive failures after which an upstream is skipped until a health check passes
+    std::size_t max_failures{3};
+    std::string health_check_path{"/"};
+    std::chrono::milliseconds health_check_interval{5'000};
+    std::chrono::milliseconds response_timeout{30'000};
+};
+
+// Forwards requests under a path prefix to upstream HTTP/1.1 servers. Upstream sockets live in the
+// server's event loop, are kept alive in per-upstream pools and responses are streamed back to the
+// client as they arrive.
+class ProxyHttpHandler : public AsyncHttpHandlerBase, private EventLoopListener {
+    class HealthProbeStream;
+
+    struct Upstream {
+        // host:port as given, sent as Host of the health checks
+        std::string name;
+        sockaddr_storage address{};
+        socklen_t address_len{0};
+        std::vector<int> idle_connections;
+        std::size_t active_exchanges{0};
+        std::size_t consecutive_failures{0};
+        bool healthy{true};
+        bool probe_in_flight{false};
+    };
+
+    enum class ExchangeKind {
+        kRequest,
+        // Safe to resend on a fresh connection when a pooled one turns out to be closed
+        kRetriableRequest,
+        // The resent request, which must not pick another pooled connection that may be just as stale
+        kRetry,
+        // Health check, which always opens a connection of its own
+        kProbe,
+    };
+
+    enum class UpstreamConnectionState {
+        kConnecting,
+        kSending,
+        kReceiving,
+        kIdle,
+    };
+
+    struct UpstreamConnection {
+        FileDescriptor socket;
+        std::size_t upstream_index{0};
+        UpstreamConnectionState state{UpstreamConnectionState::kConnecting};
+        // Tells exchanges apart when the connection is reused
+        std::uint64_t exchange_id{0};
+        bool reused{false};
+        bool is_probe{false};
+        // Safe to resend on a fresh connection when a pooled one turns out to be closed
+        bool retriable{false};
+        bool head_sent{false};
+        bool paused{false};
+        std::string request;
+        std::size_t request_sent{0};
+        std::string buffer;
+        UpstreamResponseParser parser;
+        std::shared_ptr<HttpResponseStream> response_stream;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    std::string path_prefix_;
+    ProxyHttpHandlerConfig config_;
+    std::vector<Upstream> upstreams_;
+    std::size_t next_upstream_{0};
+    std::uint64_t next_exchange_id_{0};
+    EventLoop* event_loop_{nullptr};
+    FileDescriptor timer_fd_;
+    std::chrono::steady_clock::time_point next_health_check_;
+    std::unordered_map<int, std::unique_ptr<UpstreamConnection>> connections_;
+
+public:
+    // upstreams are host:port pairs, IPv6 hosts in brackets
+    ProxyHttpHandler(std::string path_prefix, const std::vector<std::string>& upstreams,
+                     ProxyHttpHandlerConfig config = {});
+
+    bool IsMyRequest(const HttpRequest& request) const override;
+    void Attach(EventLoop& event_loop) override;
+    void HandleRequestAsync(HttpRequest request, std::shared_ptr<HttpResponseStream> response_stream) override;
+
+private:
+    void OnEvents(int fd, std::uint32_t events) override;
+    void OnTimer();
+
+    std::size_t PickUpstream();
+    void StartExchange(std::size_t upstream_index, std::string request,
+                       std::shared_ptr<HttpResponseStream> response_stream, ExchangeKind kind);
+    UpstreamConnection* AcquireConnection(std::size_t upstream_index, bool allow_reuse);
+
+    void SendRequest(UpstreamConnection& connection);
+    void ReceiveResponse(UpstreamConnection& connection);
+    void ResumeExchange(int fd, std::uint64_t exchange_id);
+    bool ParseResponse(UpstreamConnection& connection);
+    void CompleteExchange(UpstreamConnection& connection);
+    void FailExchange(UpstreamConnection& connection, HttpResponseStatus status);
+    void CloseConnection(UpstreamConnection& connection);
+
+    void RecordResult(std::size_t upstream_index, bool success);
+};
+
+#endif //HTTP_SERVER_PROXY_HTTP_HANDLER_H
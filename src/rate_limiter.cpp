@@ -0,0 +1,154 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <bit>
+
+#include <cstring>
+
+#include <netinet/in.h>
+
+namespace {
+constexpr std::size_t kConnectionLimit{0};
+constexpr std::size_t kRequestLimit{1};
+constexpr std::size_t kFirstRouteLimit{2};
+
+constexpr std::int64_t kNanosecondsPerSecond{1'000'000'000};
+
+// Finalizer of MurmurHash3
+constexpr std::uint64_t Mix(std::uint64_t value) noexcept {
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    value *= 0xc4ceb9fe1a85ec53ULL;
+    value ^= value >> 33;
+    return value;
+}
+
+constexpr std::uint64_t HashAddress(std::uint64_t high, std::uint64_t low) noexcept {
+    return Mix(high ^ Mix(low));
+}
+
+// IPv4 clients hash the same whether they connect over IPv4 or to a dual-stack socket
+std::optional<std::uint64_t> HashPeerAddress(const sockaddr_storage& peer) noexcept {
+    static constexpr std::uint64_t kIpv4MappedPrefix{0xffffULL << 32};
+    if (peer.ss_family == AF_INET) {
+        const auto& address{reinterpret_cast<const sockaddr_in&>(peer).sin_addr};
+        return HashAddress(0, kIpv4MappedPrefix | ntohl(address.s_addr));
+    } else if (peer.ss_family == AF_INET6) {
+        const auto& address{reinterpret_cast<const sockaddr_in6&>(peer).sin6_addr};
+        if (IN6_IS_ADDR_V4MAPPED(&address)) {
+            std::uint32_t ipv4_address;
+            std::memcpy(&ipv4_address, address.s6_addr + 12, sizeof(ipv4_address));
+            return HashAddress(0, kIpv4MappedPrefix | ntohl(ipv4_address));
+        }
+        std::uint64_t high;
+        std::uint64_t low;
+        std::memcpy(&high, address.s6_addr, sizeof(high));
+        std::memcpy(&low, address.s6_addr + sizeof(high), sizeof(low));
+        return HashAddress(high, low);
+    }
+    return std::nullopt;
+}
+}
+
+RateLimiter::RateLimiter(const RateLimiterConfig& config)
+    : limits_(kFirstRouteLimit + config.routes.size())
+    , shard_mask_{std::bit_ceil(std::max<std::size_t>(config.max_buckets / kBucketsPerShard, 1)) - 1}
+{
+    auto set_limit = [this](std::size_t limit_index, const std::optional<RateLimit>& limit) {
+        if (limit && limit->per_second != 0) {
+            // Beyond a billion per second the interval would round down to zero, which means no limit at all
+            limits_[limit_index].token_interval =
+                std::max<std::int64_t>(kNanosecondsPerSecond / limit->per_second, 1);
+            limits_[limit_index].bucket_interval =
+                limits_[limit_index].token_interval * std::max<std::int64_t>(limit->burst, 1);
+        }
+    };
+    set_limit(kConnectionLimit, config.connections);
+    set_limit(kRequestLimit, config.requests);
+    for (std::size_t i{0}; i < config.routes.size(); ++i) {
+        set_limit(kFirstRouteLimit + i, config.routes[i].limit);
+        route_prefixes_.push_back(config.routes[i].path_prefix);
+    }
+    shards_ = std::make_unique<Shard[]>(shard_mask_ + 1);
+}
+
+std::optional<std::chrono::seconds> RateLimiter::CheckConnection(const sockaddr_storage& peer,
+                                                                 Clock::time_point now) noexcept {
+    const std::optional<std::uint64_t> address_hash{HashPeerAddress(peer)};
+    if (!address_hash) {
+        return std::nullopt;
+    }
+    return Take(*address_hash, kConnectionLimit, std::chrono::nanoseconds{now.time_since_epoch()}.count());
+}
+
+std::optional<std::chrono::seconds> RateLimiter::CheckRequest(const sockaddr_storage& peer, std::string_view path,
+                                                              Clock::time_point now) noexcept {
+    const std::optional<std::uint64_t> address_hash{HashPeerAddress(peer)};
+    if (!address_hash) {
+        return std::nullopt;
+    }
+    const std::int64_t now_ns{std::chrono::nanoseconds{now.time_since_epoch()}.count()};
+    if (std::optional<std::chrono::seconds> retry_after{Take(*address_hash, kRequestLimit, now_ns)}) {
+        return retry_after;
+    }
+    for (std::size_t i{0}; i < route_prefixes_.size(); ++i) {
+        if (path.starts_with(route_prefixes_[i])) {
+            std::optional<std::chrono::seconds> retry_after{Take(*address_hash, kFirstRouteLimit + i, now_ns)};
+            // A request throttled on its route is not served, so it leaves the other routes alone
+            if (retry_after) {
+                Refund(*address_hash, kRequestLimit);
+            }
+            return retry_after;
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<std::chrono::seconds> RateLimiter::Take(std::uint64_t address_hash, std::size_t limit_index,
+                                                      std::int64_t now) noexcept {
+    const Limit& limit{limits_[limit_index]};
+    if (limit.token_interval == 0) {
+        return std::nullopt;
+    }
+
+    const std::uint64_t key{Mix(address_hash + limit_index) | 1};
+    Bucket* buckets{shards_[(key >> 32) & shard_mask_].buckets};
+    const std::size_t position{static_cast<std::size_t>(FindBucket(key) - buckets)};
+    Bucket bucket{buckets[position]};
+    if (bucket.key != key) {
+        bucket = Bucket{.key = key, .full_at = now};
+    }
+
+    // Every token taken moves the time the bucket is full again further out
+    std::optional<std::chrono::seconds> retry_after;
+    const std::int64_t full_at{std::max(bucket.full_at, now) + limit.token_interval};
+    if (full_at - now > limit.bucket_interval) {
+        // Retry-After is in whole seconds, so the wait for the next token is rounded up
+        retry_after = std::chrono::seconds{
+            (full_at - now - limit.bucket_interval + kNanosecondsPerSecond - 1) / kNanosecondsPerSecond};
+    } else {
+        bucket.full_at = full_at;
+    }
+
+    std::move_backward(buckets, buckets + position, buckets + position + 1);
+    buckets[0] = bucket;
+    return retry_after;
+}
+
+void RateLimiter::Refund(std::uint64_t address_hash, std::size_t limit_index) noexcept {
+    const Limit& limit{limits_[limit_index]};
+    const std::uint64_t key{Mix(address_hash + limit_index) | 1};
+    if (Bucket* bucket{FindBucket(key)}; limit.token_interval != 0 && bucket->key == key) {
+        bucket->full_at -= limit.token_interval;
+    }
+}
+
+RateLimiter::Bucket* RateLimiter::FindBucket(std::uint64_t key) noexcept {
+    Bucket* buckets{shards_[(key >> 32) & shard_mask_].buckets};
+    std::size_t position{0};
+    while (position + 1 < kBucketsPerShard && buckets[position].key != key) {
+        ++position;
+    }
+    return &buckets[position];
+}
@@ -0,0 +1,92 @@
+#ifndef HTTP_SERVER_RATE_LIMITER_H
+#define HTTP_SERVER_RATE_LIMITER_H
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/socket.h>
+
+struct RateLimit {
+    // Sustained rate the bucket refills at
+    unsigned per_second{10};
+    // Bucket size, the number of requests a client may send at once
+    unsigned burst{20};
+};
+
+struct RouteRateLimit {
+    std::string path_prefix;
+    RateLimit limit;
+};
+
+struct RateLimiterConfig {
+    // New connections per client, checked when they are accepted
+    std::optional<RateLimit> connections;
+    // Requests per client on any route
+    std::optional<RateLimit> requests;
+    // Requests per client on the route of the first matching prefix, on top of the limit for any route
+    std::vector<RouteRateLimit> routes;
+    // Buckets kept across all limits; the least recently seen clients are forgotten beyond that
+    std::size_t max_buckets{64 * 1024};
+};
+
+// Per-client token buckets, keyed by the peer IP address. Buckets live in a fixed-size hash table split
+// into shards of one cache line, kept in least recently used order, so a check touches a single cache line
+// and never allocates. A bucket is stored as the time at which it is full again and refilled lazily when
+// the client comes back. Unix domain socket peers cannot be told apart and are never throttled.
+class RateLimiter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    static constexpr std::size_t kBucketsPerShard{4};
+
+    struct Limit {
+        // Nanoseconds one token takes to refill and the whole bucket takes
+        std::int64_t token_interval{0};
+        std::int64_t bucket_interval{0};
+    };
+
+    struct Bucket {
+        // Hash of the address and the limit, zero for unused buckets. Clients colliding on all
+        // 64 bits would share a bucket, which is unlikely enough to be ignored.
+        std::uint64_t key{0};
+        // Clock time in nanoseconds at which the bucket is full again
+        std::int64_t full_at{0};
+    };
+
+    // Most recently used bucket first
+    struct alignas(64) Shard {
+        Bucket buckets[kBucketsPerShard];
+    };
+
+    // Connections, requests on any route, then the routes in order; disabled limits have no interval
+    std::vector<Limit> limits_;
+    std::vector<std::string> route_prefixes_;
+    std::unique_ptr<Shard[]> shards_;
+    std::size_t shard_mask_;
+
+public:
+    explicit RateLimiter(const RateLimiterConfig& config);
+
+    // Retry-After for a throttled client, nothing when it may go on and a token was taken
+    std::optional<std::chrono::seconds> CheckConnection(const sockaddr_storage& peer, Clock::time_point now) noexcept;
+    std::optional<std::chrono::seconds> CheckRequest(const sockaddr_storage& peer, std::string_view path,
+                                                     Clock::time_point now) noexcept;
+
+private:
+    std::optional<std::chrono::seconds> Take(std::uint64_t address_hash, std::size_t limit_index,
+                                             std::int64_t now) noexcept;
+    // Gives back a token just taken
+    void Refund(std::uint64_t address_hash, std::size_t limit_index) noexcept;
+    // Bucket of the key, or the least recently used one of its shard which a new client takes over
+    Bucket* FindBucket(std::uint64_t key) noexcept;
+};
+
+#endif //HTTP_SERVER_RATE_LIMITER_H
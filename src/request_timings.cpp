@@ -0,0 +1,47 @@
+#include "request_timings.h"
+
+#include <thread>
+
+namespace {
+// Nanoseconds per CycleClock tick
+double MeasureTickPeriod() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    static constexpr std::chrono::milliseconds kCalibrationTime{10};
+    const auto start_time{std::chrono::steady_clock::now()};
+    const std::uint64_t start_ticks{CycleClock::Now()};
+    std::this_thread::sleep_for(kCalibrationTime);
+    const auto end_time{std::chrono::steady_clock::now()};
+    const std::uint64_t end_ticks{CycleClock::Now()};
+    if (end_ticks <= start_ticks) {
+        return 1.0;
+    }
+    return static_cast<double>(std::chrono::nanoseconds{end_time - start_time}.count())
+        / static_cast<double>(end_ticks - start_ticks);
+#else
+    return static_cast<double>(std::chrono::nanoseconds{std::chrono::steady_clock::duration{1}}.count());
+#endif
+}
+
+double GetTickPeriod() noexcept {
+    static const double tick_period{MeasureTickPeriod()};
+    return tick_period;
+}
+}
+
+std::chrono::nanoseconds CycleClock::ToDuration(std::uint64_t ticks) noexcept {
+    return std::chrono::nanoseconds{static_cast<std::int64_t>(static_cast<double>(ticks) * GetTickPeriod())};
+}
+
+void CycleClock::Calibrate() noexcept {
+    GetTickPeriod();
+}
+
+std::optional<std::chrono::nanoseconds> RequestTimings::Between(RequestPhase from, RequestPhase to) const noexcept {
+    const std::uint64_t from_ticks{ticks[static_cast<std::size_t>(from)]};
+    const std::uint64_t to_ticks{ticks[static_cast<std::size_t>(to)]};
+    if (from_ticks == 0 || to_ticks == 0) {
+        return std::nullopt;
+    }
+    // Counters of different cores may be slightly apart, which must not turn into a huge duration
+    return to_ticks >= from_ticks ? CycleClock::ToDuration(to_ticks - from_ticks) : std::chrono::nanoseconds{0};
+}
@@ -0,0 +1,62 @@
+#ifndef HTTP_SERVER_REQUEST_TIMINGS_H
+#define HTTP_SERVER_REQUEST_TIMINGS_H
+
+#include <array>
+#include <chrono>
+#include <optional>
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Monotonic clock cheap enough to be read several times per request. On x86 it reads the time stamp
+// counter, which runs at a constant rate on current CPUs, and ticks are converted to time with a factor
+// measured against steady_clock once. Other architectures fall back to steady_clock.
+class CycleClock {
+public:
+    static std::uint64_t Now() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    static std::chrono::nanoseconds ToDuration(std::uint64_t ticks) noexcept;
+
+    // The first conversion measures the tick rate, which takes a few milliseconds; call it up front instead
+    static void Calibrate() noexcept;
+};
+
+enum class RequestPhase : std::size_t {
+    kAccepted,
+    kFirstByte,
+    kHeadersParsed,
+    kBodyComplete,
+    kHandlerStarted,
+    kHandlerFinished,
+    kLastByteWritten,
+};
+
+inline constexpr std::size_t kRequestPhaseCount{static_cast<std::size_t>(RequestPhase::kLastByteWritten) + 1};
+
+// CycleClock ticks at which a request reached each phase, zero for phases it did not reach
+struct RequestTimings {
+    std::array<std::uint64_t, kRequestPhaseCount> ticks{};
+
+    // Only the first time a phase is reached counts
+    void Mark(RequestPhase phase) noexcept {
+        std::uint64_t& phase_ticks{ticks[static_cast<std::size_t>(phase)]};
+        if (phase_ticks == 0) {
+            phase_ticks = CycleClock::Now();
+        }
+    }
+
+    // Time from one phase to another, nothing unless both were reached
+    std::optional<std::chrono::nanoseconds> Between(RequestPhase from, RequestPhase to) const noexcept;
+};
+
+#endif //HTTP_SERVER_REQUEST_TIMINGS_H
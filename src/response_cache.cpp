@@ -0,0 +1,364 @@
+#include "response_cache.h"
+
+#include "str_utils.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+constexpr std::string_view kCacheControlHeader{"Cache-Control"};
+constexpr std::string_view kAgeHeader{"Age"};
+constexpr std::string_view kAuthorizationHeader{"Authorization"};
+constexpr std::string_view kSetCookieHeader{"Set-Cookie"};
+constexpr std::string_view kVaryHeader{"Vary"};
+
+struct CacheControl {
+    bool no_store{false};
+    bool no_cache{false};
+    bool is_private{false};
+    std::optional<std::chrono::seconds> max_age;
+};
+
+// HTTP/1.1 requests keep header names as sent, so they are matched ignoring case
+const std::string* FindHeader(const std::unordered_map<std::string, std::string>& headers, std::string_view name) {
+    auto header_it{std::ranges::find_if(headers,
+        [name](const auto& header) { return EqualsIgnoreCase(header.first, name); })};
+    return header_it != headers.end() ? &header_it->second : nullptr;
+}
+
+CacheControl ParseCacheControl(const std::unordered_map<std::string, std::string>& headers) {
+    CacheControl cache_control;
+    const std::string* header{FindHeader(headers, kCacheControlHeader)};
+    if (header == nullptr) {
+        return cache_control;
+    }
+    std::optional<std::chrono::seconds> s_maxage;
+    std::string_view directives{*header};
+    while (!directives.empty()) {
+        const size_t directive_size{std::min(directives.find(','), directives.size())};
+        const std::string_view directive{Strip(directives.substr(0, directive_size))};
+        directives.remove_prefix(std::min(directive_size + 1, directives.size()));
+
+        const size_t value_separator{std::min(directive.find('='), directive.size())};
+        const std::string_view name{directive.substr(0, value_separator)};
+        std::string_view value{directive.substr(std::min(value_separator + 1, directive.size()))};
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+            value = value.substr(1, value.size() - 2);
+        }
+        if (EqualsIgnoreCase(name, "no-store")) {
+            cache_control.no_store = true;
+        } else if (EqualsIgnoreCase(name, "no-cache")) {
+            cache_control.no_cache = true;
+        } else if (EqualsIgnoreCase(name, "private")) {
+            cache_control.is_private = true;
+        } else if (EqualsIgnoreCase(name, "max-age") || EqualsIgnoreCase(name, "s-maxage")) {
+            // A malformed age makes the response stale right away
+            const std::optional<size_t> seconds{TryParseSizeT(value)};
+            const std::chrono::seconds age{seconds ? static_cast<std::chrono::seconds::rep>(*seconds) : 0};
+            (EqualsIgnoreCase(name, "max-age") ? cache_control.max_age : s_maxage) = age;
+        }
+    }
+    // The shared cache variant takes precedence
+    if (s_maxage) {
+        cache_control.max_age = s_maxage;
+    }
+    return cache_control;
+}
+
+// Whether the key tells apart all the requests the response may differ for
+bool IsCoveredByKey(std::string_view vary, std::span<const std::string> key_headers) {
+    while (!vary.empty()) {
+        const size_t element_size{std::min(vary.find(','), vary.size())};
+        const std::string_view header{Strip(vary.substr(0, element_size))};
+        vary.remove_prefix(std::min(element_size + 1, vary.size()));
+        if (header.empty()) {
+            continue;
+        }
+        // "*" varies on things outside the request
+        if (header == "*" || std::ranges::none_of(key_headers,
+                [header](const std::string& key_header) { return EqualsIgnoreCase(key_header, header); })) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool IsCacheableStatus(HttpResponseStatus status) noexcept {
+    return status == HttpResponseStatus::k200Ok || status == HttpResponseStatus::k404NotFound;
+}
+
+std::size_t GetHeadersSize(const std::unordered_map<std::string, std::string>& headers) noexcept {
+    std::size_t size{0};
+    for (const auto& [header, value] : headers) {
+        size += header.size() + value.size();
+    }
+    return size;
+}
+}
+
+// Passes the response on to the client which started the flight and records it for the cache and the waiters
+class ResponseCache::RecordingResponseStream final : public HttpResponseStream {
+    ResponseCache* cache_;
+    ResponseCacheKey key_;
+    std::shared_ptr<HttpResponseStream> response_stream_;
+    // Nothing once the response is too large to be kept
+    std::optional<HttpResponse> response_;
+    bool finished_{false};
+
+public:
+    RecordingResponseStream(ResponseCache& cache, ResponseCacheKey key,
+                            std::shared_ptr<HttpResponseStream> response_stream)
+        : cache_{&cache}
+        , key_{std::move(key)}
+        , response_stream_{std::move(response_stream)}
+    {
+    }
+
+    ~RecordingResponseStream() override {
+        // The handler dropped the response, e.g. while it is shut down
+        if (!finished_) {
+            cache_->AbandonFlight(key_);
+        }
+    }
+
+    void WriteHead(std::string_view status, const Headers& headers, std::optional<size_t> content_length) override {
+        response_stream_->WriteHead(status, headers, content_length);
+        const std::optional<size_t> status_code{TryParseSizeT(status.substr(0, 3))};
+        if (status_code && content_length.value_or(0) <= cache_->config_.max_entry_bytes) {
+            response_.emplace(HttpResponse{
+                .response_status = static_cast<HttpResponseStatus>(*status_code),
+                .headers = {headers.begin(), headers.end()},
+                .body = std::string{}
+            });
+        }
+    }
+
+    bool WriteBody(std::string_view data) override {
+        if (response_) {
+            std::string& body{std::get<std::string>(response_->body)};
+            if (body.size() + data.size() > cache_->config_.max_entry_bytes) {
+                response_.reset();
+            } else {
+                body += data;
+            }
+        }
+        // The waiters still need the response when the client which asked first is gone
+        return response_stream_->IsClosed() || response_stream_->WriteBody(data);
+    }
+
+    void Finish() override {
+        response_stream_->Finish();
+        finished_ = true;
+        cache_->EndFlight(key_, std::move(response_));
+    }
+
+    void Abort() override {
+        response_stream_->Abort();
+        finished_ = true;
+        cache_->EndFlight(key_, std::nullopt);
+    }
+
+    bool IsClosed() const noexcept override {
+        if (!response_stream_->IsClosed()) {
+            return false;
+        }
+        auto flight_it{cache_->flights_.find(key_.key)};
+        return finished_ || flight_it == cache_->flights_.end() || flight_it->second.waiters.empty();
+    }
+
+    void SetWritableCallback(std::function<void()> callback) override {
+        response_stream_->SetWritableCallback(std::move(callback));
+    }
+};
+
+ResponseCache::ResponseCache(ResponseCacheConfig config)
+    : config_{std::move(config)}
+{
+}
+
+std::optional<ResponseCacheKey> ResponseCache::MakeKey(const HttpRequest& request) const {
+    if (request.method != HttpMethod::kGet) {
+        return std::nullopt;
+    }
+    auto route_it{std::ranges::find_if(config_.routes,
+        [&request](const CacheRoute& route) { return request.path.starts_with(route.path_prefix); })};
+    // Responses to credentials are personal
+    if (route_it == config_.routes.end() || FindHeader(request.headers, kAuthorizationHeader) != nullptr) {
+        return std::nullopt;
+    }
+    const CacheControl cache_control{ParseCacheControl(request.headers)};
+    if (cache_control.no_store) {
+        return std::nullopt;
+    }
+
+    ResponseCacheKey key{
+        .ttl = route_it->ttl,
+        .vary_headers = route_it->vary_headers,
+        .skip_lookup = cache_control.no_cache || cache_control.max_age == std::chrono::seconds{0}
+    };
+    key.key = request.path;
+    for (const std::string& header : route_it->vary_headers) {
+        key.key += '\n';
+        if (const std::string* value{FindHeader(request.headers, header)}) {
+            key.key += *value;
+        }
+    }
+    return key;
+}
+
+std::optional<HttpResponse> ResponseCache::Find(const ResponseCacheKey& key, Clock::time_point now) {
+    if (key.skip_lookup) {
+        return std::nullopt;
+    }
+    auto slot_index_it{slot_indices_.find(key.key)};
+    if (slot_index_it == slot_indices_.end()) {
+        return std::nullopt;
+    }
+    Entry& entry{*slots_[slot_index_it->second]};
+    if (entry.expires_at <= now) {
+        Evict(slot_index_it->second);
+        return std::nullopt;
+    }
+    entry.referenced = true;
+    HttpResponse response{.response_status = entry.response_status, .headers = entry.headers, .body = entry.body};
+    response.headers.insert_or_assign(std::string{kAgeHeader},
+        std::to_string(std::chrono::duration_cast<std::chrono::seconds>(now - entry.stored_at).count()));
+    return response;
+}
+
+bool ResponseCache::Store(const ResponseCacheKey& key, HttpResponse& response, Clock::time_point now) {
+    // A cookie belongs to the one client it was set for
+    if (!IsCacheableStatus(response.response_status) || FindHeader(response.headers, kSetCookieHeader) != nullptr) {
+        return false;
+    }
+    if (const std::string* vary{FindHeader(response.headers, kVaryHeader)};
+            vary != nullptr && !IsCoveredByKey(*vary, key.vary_headers)) {
+        return false;
+    }
+    const CacheControl cache_control{ParseCacheControl(response.headers)};
+    if (cache_control.no_store || cache_control.no_cache || cache_control.is_private) {
+        return false;
+    }
+    const std::chrono::milliseconds ttl{
+        cache_control.max_age ? std::min<std::chrono::milliseconds>(key.ttl, *cache_control.max_age) : key.ttl};
+    const std::optional<std::string_view> body{GetBodyBytes(response.body)};
+    // File regions may change underneath
+    if (ttl <= std::chrono::milliseconds{0} || !body) {
+        return false;
+    }
+    const std::size_t size{sizeof(Entry) + key.key.size() + GetHeadersSize(response.headers) + body->size()};
+    if (size > config_.max_entry_bytes) {
+        return false;
+    }
+
+    if (auto slot_index_it{slot_indices_.find(key.key)}; slot_index_it != slot_indices_.end()) {
+        Evict(slot_index_it->second);
+    }
+    if (!MakeRoom(size, now)) {
+        return false;
+    }
+    if (!std::holds_alternative<std::shared_ptr<const std::string>>(response.body)) {
+        response.body = std::make_shared<const std::string>(*body);
+    }
+
+    std::size_t slot_index;
+    if (!free_slots_.empty()) {
+        slot_index = free_slots_.back();
+        free_slots_.pop_back();
+    } else {
+        slot_index = slots_.size();
+        slots_.emplace_back();
+    }
+    slots_[slot_index] = Entry{
+        .key = key.key,
+        .response_status = response.response_status,
+        .headers = response.headers,
+        .body = std::get<std::shared_ptr<const std::string>>(response.body),
+        .stored_at = now,
+        .expires_at = now + ttl,
+        .size = size
+    };
+    slot_indices_.emplace(key.key, slot_index);
+    size_ += size;
+    return true;
+}
+
+bool ResponseCache::Wait(const ResponseCacheKey& key, HttpRequest& request,
+                         std::shared_ptr<HttpResponseStream>& response_stream) {
+    auto flight_it{flights_.find(key.key)};
+    if (flight_it == flights_.end()) {
+        return false;
+    }
+    flight_it->second.waiters.push_back(Waiter{
+        .request = std::move(request), .response_stream = std::move(response_stream)});
+    return true;
+}
+
+std::shared_ptr<HttpResponseStream> ResponseCache::StartFlight(const ResponseCacheKey& key,
+                                                               AsyncHttpHandlerBase& handler,
+                                                               std::shared_ptr<HttpResponseStream> response_stream) {
+    flights_.insert_or_assign(key.key, Flight{.handler = &handler});
+    return std::make_shared<RecordingResponseStream>(*this, key, std::move(response_stream));
+}
+
+void ResponseCache::EndFlight(const ResponseCacheKey& key, std::optional<HttpResponse> response) {
+    auto flight_it{flights_.find(key.key)};
+    if (flight_it == flights_.end()) {
+        return;
+    }
+    Flight flight{std::move(flight_it->second)};
+    flights_.erase(flight_it);
+
+    if (response && Store(key, *response, Clock::now())) {
+        for (Waiter& waiter : flight.waiters) {
+            waiter.response_stream->WriteResponse(*response);
+        }
+        return;
+    }
+    // A response which is not stored must not be shared either, every waiter gets its own
+    for (Waiter& waiter : flight.waiters) {
+        flight.handler->HandleRequestAsync(std::move(waiter.request), std::move(waiter.response_stream));
+    }
+}
+
+void ResponseCache::AbandonFlight(const ResponseCacheKey& key) {
+    auto flight_it{flights_.find(key.key)};
+    if (flight_it == flights_.end()) {
+        return;
+    }
+    const Flight flight{std::move(flight_it->second)};
+    flights_.erase(flight_it);
+    for (const Waiter& waiter : flight.waiters) {
+        waiter.response_stream->Abort();
+    }
+}
+
+void ResponseCache::Evict(std::size_t slot_index) {
+    std::optional<Entry>& slot{slots_[slot_index]};
+    size_ -= slot->size;
+    slot_indices_.erase(slot->key);
+    slot.reset();
+    free_slots_.push_back(slot_index);
+}
+
+bool ResponseCache::MakeRoom(std::size_t size, Clock::time_point now) {
+    if (size > config_.max_bytes) {
+        return false;
+    }
+    // CLOCK: the hand clears reference bits as it goes and evicts the first entry without one.
+    // Expired entries go regardless. Every entry is evicted within two turns, so this ends.
+    while (size_ + size > config_.max_bytes) {
+        if (clock_hand_ >= slots_.size()) {
+            clock_hand_ = 0;
+        }
+        if (std::optional<Entry>& slot{slots_[clock_hand_]}; slot) {
+            if (slot->referenced && slot->expires_at > now) {
+                slot->referenced = false;
+            } else {
+                Evict(clock_hand_);
+            }
+        }
+        ++clock_hand_;
+    }
+    return true;
+}
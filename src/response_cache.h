@@ -0,0 +1,113 @@
+#ifndef HTTP_SERVER_RESPONSE_CACHE_H
+#define HTTP_SERVER_RESPONSE_CACHE_H
+
+#include "async_http_handler_base.h"
+#include "http.h"
+#include "http_response_stream.h"
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <cstddef>
+
+struct CacheRoute {
+    std::string path_prefix;
+    // Upper bound of how long a response stays fresh, a shorter max-age of the response wins
+    std::chrono::milliseconds ttl{1000};
+    // Request headers the response depends on besides method and path
+    std::vector<std::string> vary_headers;
+};
+
+struct ResponseCacheConfig {
+    // The first route matching the path applies, other requests are not cached
+    std::vector<CacheRoute> routes;
+    // Bodies, headers and keys of all entries together
+    std::size_t max_bytes{64 * 1024 * 1024};
+    // Larger responses are not cached
+    std::size_t max_entry_bytes{1024 * 1024};
+};
+
+struct ResponseCacheKey {
+    std::string key;
+    std::chrono::milliseconds ttl;
+    // Request headers the key is made of, responses which vary on others are not stored
+    std::span<const std::string> vary_headers;
+    // The request asked for a fresh response, it may still be stored
+    bool skip_lookup{false};
+};
+
+// Cache of GET responses in front of the handlers. Entries are evicted once they expire or, over the memory
+// cap, by the CLOCK policy. Identical requests to an asynchronous handler which arrive while one of them is
+// in flight wait for its response instead of running the handler again; synchronous handlers finish before
+// the next request is read, so they never overlap.
+class ResponseCache {
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    class RecordingResponseStream;
+
+    struct Entry {
+        std::string key;
+        HttpResponseStatus response_status;
+        std::unordered_map<std::string, std::string> headers;
+        std::shared_ptr<const std::string> body;
+        Clock::time_point stored_at;
+        Clock::time_point expires_at;
+        std::size_t size;
+        // Set on every hit, the CLOCK hand spares an entry once for it
+        bool referenced{false};
+    };
+
+    struct Waiter {
+        HttpRequest request;
+        std::shared_ptr<HttpResponseStream> response_stream;
+    };
+
+    struct Flight {
+        AsyncHttpHandlerBase* handler;
+        std::vector<Waiter> waiters;
+    };
+
+    ResponseCacheConfig config_;
+    // Empty slots are reused before the vector grows
+    std::vector<std::optional<Entry>> slots_;
+    std::vector<std::size_t> free_slots_;
+    std::unordered_map<std::string, std::size_t> slot_indices_;
+    std::size_t clock_hand_{0};
+    std::size_t size_{0};
+    std::unordered_map<std::string, Flight> flights_;
+
+public:
+    explicit ResponseCache(ResponseCacheConfig config);
+
+    // Nothing when the request bypasses the cache
+    std::optional<ResponseCacheKey> MakeKey(const HttpRequest& request) const;
+
+    // Fresh response for the key, its body is shared with the cache
+    std::optional<HttpResponse> Find(const ResponseCacheKey& key, Clock::time_point now);
+    // Keeps the response when its status, Cache-Control and Vary allow it, its body is then shared with the cache
+    bool Store(const ResponseCacheKey& key, HttpResponse& response, Clock::time_point now);
+
+    // Takes over the request when an identical one is in flight, it is answered along with that one
+    bool Wait(const ResponseCacheKey& key, HttpRequest& request, std::shared_ptr<HttpResponseStream>& response_stream);
+    // Starts a flight, the returned stream replaces the response stream handed to the handler. Once it finishes
+    // the response is stored and the waiters are answered with it, or dispatched to the handler themselves
+    // when it cannot be shared; this happens from within the handler's Finish or Abort call.
+    std::shared_ptr<HttpResponseStream> StartFlight(const ResponseCacheKey& key, AsyncHttpHandlerBase& handler,
+                                                    std::shared_ptr<HttpResponseStream> response_stream);
+
+private:
+    void EndFlight(const ResponseCacheKey& key, std::optional<HttpResponse> response);
+    void AbandonFlight(const ResponseCacheKey& key);
+    void Evict(std::size_t slot_index);
+    bool MakeRoom(std::size_t size, Clock::time_point now);
+};
+
+#endif //HTTP_SERVER_RESPONSE_CACHE_H
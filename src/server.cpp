@@ -1,24 +1,248 @@
 #include "server.h"
 
+#include "async_http_handler_base.h"
+#include "http_response_stream.h"
+#include "http_utils.h"
 #include "str_utils.h"
+#include "trace_probes.h"
 #include "utils.h"
 
 #include <algorithm>
 #include <array>
+#include <functional>
+#include <iostream>
+#include <optional>
 #include <ranges>
 #include <string>
 #include <string_view>
+#include <system_error>
 #include <utility>
 
 #include <cerrno>
+#include <csignal>
 #include <cstddef>
+#include <cstring>
 
 #include <arpa/inet.h>
 
 #include <netinet/in.h>
 
+#include <fcntl.h>
+#include <sched.h>
+
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+namespace {
+constexpr std::uint32_t kEPollEdgeTriggeredReadEvent{EPOLLIN | EPOLLET};
+// Writable edges are only acted upon while a response is pending, which saves EPOLL_CTL_MOD calls
+constexpr std::uint32_t kEPollClientEvents{EPOLLIN | EPOLLOUT | EPOLLET};
+// Asynchronous handlers are asked to pause once this much response data is pending
+constexpr size_t kMaxPendingOutputBytes{64 * 1024};
+// Rejected connections beyond this many are closed right away
+constexpr size_t kMaxLingeringSockets{1024};
+
+// Reads and drops what the client sent; true once it closed its side or failed
+bool DiscardInput(int socket_fd) noexcept {
+    static constexpr size_t kMaxDiscardedBytes{64 * 1024};
+    std::array<char, 4096> buf;
+    for (size_t discarded{0}; discarded < kMaxDiscardedBytes;) {
+        const ssize_t bytes_read{recv(socket_fd, buf.data(), buf.size(), MSG_DONTWAIT)};
+        if (bytes_read > 0) {
+            discarded += static_cast<size_t>(bytes_read);
+        } else if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+    }
+    return false;
+}
+
+// Settings of an h2c upgrade request, which the server accepts whenever they are well-formed
+std::optional<std::string> GetHttp2UpgradeSettings(const HttpRequest& request) {
+    auto upgrade_it{request.headers.find("Upgrade")};
+    auto settings_it{request.headers.find("HTTP2-Settings")};
+    if (upgrade_it == request.headers.end() || settings_it == request.headers.end()) {
+        return std::nullopt;
+    }
+    std::string_view protocols{upgrade_it->second};
+    while (!protocols.empty()) {
+        const size_t protocol_size{std::min(protocols.find(','), protocols.size())};
+        if (EqualsIgnoreCase(Strip(protocols.substr(0, protocol_size)), "h2c")) {
+            return DecodeHttp2SettingsHeader(settings_it->second);
+        }
+        protocols.remove_prefix(std::min(protocol_size + 1, protocols.size()));
+    }
+    return std::nullopt;
+}
+
+HttpResponse MakeTooManyRequestsResponse(std::chrono::seconds retry_after) {
+    return HttpResponse{
+        .response_status = HttpResponseStatus::k429TooManyRequests,
+        .headers = {{std::string{kHttpRetryAfterHeader}, std::to_string(retry_after.count())}}
+    };
+}
+}
+
+// Response stream of a client connection, handed to asynchronous handlers
+class HttpServer::ConnectionResponseStream final : public HttpResponseStream {
+    HttpServer* server_;
+    int socket_fd_;
+    std::function<void()> writable_callback_;
+
+public:
+    ConnectionResponseStream(HttpServer& server, int socket_fd)
+        : server_{&server}
+        , socket_fd_{socket_fd}
+    {
+    }
+
+    void WriteHead(std::string_view status, const Headers& headers, std::optional<size_t> content_length) override {
+        if (server_ != nullptr) {
+            if (auto connection_state_it{server_->connections_.find(socket_fd_)};
+                connection_state_it != server_->connections_.end()) {
+                connection_state_it->second.response_status =
+                    static_cast<unsigned>(TryParseSizeT(status.substr(0, 3)).value_or(0));
+            }
+        }
+
+        std::string head;
+        head += kHttpVersion;
+        head += ' ';
+        head += status;
+        head += kHttpLineTerminator;
+        for (const auto& [header, value] : headers) {
+            head += header;
+            head += ": ";
+            head += value;
+            head += kHttpLineTerminator;
+        }
+        if (content_length) {
+            head += kHttpContentLengthHeader;
+            head += ": ";
+            head += std::to_string(*content_length);
+            head += kHttpLineTerminator;
+        }
+        // The connection is closed after the response, which also delimits a body of unknown length
+        head += "Connection: close";
+        head += kHttpLineTerminator;
+        head += kHttpLineTerminator;
+        Write(head);
+    }
+
+    bool WriteBody(std::string_view data) override {
+        return Write(data);
+    }
+
+    void Finish() override {
+        if (server_ != nullptr) {
+            server_->FinishResponse(socket_fd_, false);
+        }
+    }
+
+    void Abort() override {
+        if (server_ != nullptr) {
+            server_->FinishResponse(socket_fd_, true);
+        }
+    }
+
+    bool IsClosed() const noexcept override {
+        return server_ == nullptr;
+    }
+
+    void SetWritableCallback(std::function<void()> callback) override {
+        writable_callback_ = std::move(callback);
+    }
+
+    void NotifyWritable() {
+        if (writable_callback_) {
+            writable_callback_();
+        }
+    }
+
+    void Detach() noexcept {
+        server_ = nullptr;
+    }
+
+private:
+    bool Write(std::string_view data) {
+        if (server_ == nullptr) {
+            return false;
+        }
+        auto connection_state_it{server_->connections_.find(socket_fd_)};
+        if (connection_state_it == server_->connections_.end()) {
+            return false;
+        }
+        ConnectionState& connection_state{connection_state_it->second};
+        if (!server_->WriteToConnection(connection_state, data)) {
+            server_->FinishResponse(socket_fd_, true);
+            return false;
+        }
+        return connection_state.output.size() < kMaxPendingOutputBytes;
+    }
+};
+
+// Ties an HTTP/2 connection to its client connection
+class HttpServer::Http2Session final : public Http2ConnectionListener {
+    HttpServer* server_;
+    int socket_fd_;
+    Http2Connection connection_;
+
+public:
+    Http2Session(HttpServer& server, int socket_fd)
+        : server_{&server}
+        , socket_fd_{socket_fd}
+        , connection_{*this}
+    {
+    }
+
+    Http2Connection& GetConnection() noexcept {
+        return connection_;
+    }
+
+    void OnHttp2Request(HttpRequest request, std::shared_ptr<HttpResponseStream> response_stream) override {
+        server_->HandleHttp2Request(socket_fd_, std::move(request), std::move(response_stream));
+    }
+
+    void OnHttp2Output() override {
+        server_->ScheduleHttp2Output(socket_fd_);
+    }
+
+    void OnHttp2StreamFinished(const Http2StreamStats& stats) override {
+        server_->WriteHttp2AccessLogRecord(socket_fd_, stats);
+    }
+};
+
+HttpServer::HttpServer(HttpServerConfig config)
+    : config_{std::move(config)}
+    , service_unavailable_response_{ToHeadString(HttpResponse{
+        .response_status = HttpResponseStatus::k503ServiceUnavailable,
+        .headers = {{std::string{kHttpRetryAfterHeader}, std::to_string(config_.retry_after_seconds)}}
+    })}
+{
+    if (config_.rate_limit) {
+        rate_limiter_.emplace(*config_.rate_limit);
+    }
+    if (config_.response_cache) {
+        response_cache_.emplace(*config_.response_cache);
+    }
+}
+
+HttpServer::~HttpServer() {
+    for (const UnixSocketFile& socket_file : unix_socket_files_) {
+        struct stat file_stat;
+        if (stat(socket_file.path.c_str(), &file_stat) == 0 && file_stat.st_dev == socket_file.device
+            && file_stat.st_ino == socket_file.inode) {
+            unlink(socket_file.path.c_str());
+        }
+    }
+}
 
 void HttpServer::AddHandler(std::unique_ptr<HttpHandlerBase> handler) {
     if (handler) {
@@ -26,25 +250,68 @@ void HttpServer::AddHandler(std::unique_ptr<HttpHandlerBase> handler) {
     }
 }
 
-void HttpServer::Run(const std::variant<std::string, uint32_t>& ipv4_address, std::uint16_t port) {
+void HttpServer::AddListener(ListenAddress address) {
+    listen_addresses_.push_back(std::move(address));
+}
+
+void HttpServer::Run() {
     CreateEPoll();
-    OpenListeningSocket(ipv4_address, port);
-    Listen();
+    // Threads inherit the signal mask, so signals are blocked before any of them is started
+    SetUpSignalHandling();
+    // Measured before serving so that converting timings never stalls a request
+    CycleClock::Calibrate();
+    OpenAccessLog();
+    for (HttpHandlerBase* handler : handlers_ | std::views::transform(ToAddress{})) {
+        if (AsyncHttpHandlerBase* async_handler{handler->AsAsync()}) {
+            async_handler->Attach(*this);
+        }
+    }
+    reserve_fd_ = FileDescriptor{open("/dev/null", O_RDONLY | O_CLOEXEC)};
+    // The access log thread is already running and keeps its own placement
+    PinToCpus();
+    if (std::optional<FileDescriptor> handoff_channel{TakeInheritedHandoffChannel()}) {
+        TakeOverListeningSockets(*handoff_channel);
+    } else {
+        if (listen_addresses_.empty()) {
+            throw HttpServerException{"No listeners were added"};
+        }
+        for (const ListenAddress& address : listen_addresses_) {
+            listening_sockets_.push_back(OpenListeningSocket(address));
+            Listen(listening_sockets_.back());
+        }
+    }
+    for (FileDescriptor& listening_socket : listening_sockets_) {
+        ConfigureListeningSocket(listening_socket);
+    }
     RunEventLoop();
 }
 
+void HttpServer::Run(const std::variant<std::string, uint32_t>& ipv4_address, std::uint16_t port) {
+    AddListener(Ipv4ListenAddress{.address = ipv4_address, .port = port});
+    Run();
+}
+
 void HttpServer::CreateEPoll() {
-    epoll_fd_ = FileDescriptor{epoll_create1(0)};
+    epoll_fd_ = FileDescriptor{epoll_create1(EPOLL_CLOEXEC)};
     if (epoll_fd_.IsEmpty()) {
         throw HttpServerException{StrError("epoll_create1 failed")};
     }
 }
 
+void HttpServer::OpenAccessLog() {
+    if (config_.access_log && !access_log_) {
+        access_log_ = std::make_unique<AccessLog>(*config_.access_log);
+        access_log_writer_ = access_log_->CreateWriter();
+    }
+    if (config_.slow_request_log && !slow_request_log_) {
+        slow_request_log_ = std::make_unique<AccessLog>(config_.slow_request_log->log);
+        slow_request_log_writer_ = slow_request_log_->CreateWriter();
+    }
+}
 
-void HttpServer::AddFileDescriptorToEPoll(FileDescriptor& fd) {
-    static constexpr auto kEPollEdgeTriggeredReadEvent{EPOLLIN | EPOLLET};
+void HttpServer::AddFileDescriptorToEPoll(FileDescriptor& fd, std::uint32_t events) {
     epoll_event event;
-    event.events = kEPollEdgeTriggeredReadEvent;
+    event.events = events;
     event.data.fd = fd.Get();
     if (epoll_ctl(epoll_fd_.Get(), EPOLL_CTL_ADD, fd.Get(), &event) == -1) {
         throw HttpServerException(StrError("EPOLL_CTL_ADD on File Descriptor " + std::to_string(fd.Get()) + " failed"));
@@ -57,116 +324,505 @@ void HttpServer::RemoveFileDescriptorFromEPoll(FileDescriptor& fd) {
     }
 }
 
-void HttpServer::OpenListeningSocket(const std::variant<std::string, uint32_t>& ipv4_address, std::uint16_t port) {
-    const uint32_t addr = std::visit(overloaded{
-        [](const std::string& address) {
-            const uint32_t addr = inet_addr(address.c_str());
-            if (addr == (uint32_t)(-1)) {
-                throw std::invalid_argument("Invalid IP address: " + address);
+FileDescriptor HttpServer::OpenListeningSocket(const ListenAddress& address) {
+    sockaddr_storage server_addr{};
+    socklen_t server_addr_len{0};
+    std::string description;
+    std::visit(overloaded{
+        [&](const Ipv4ListenAddress& ipv4) {
+            auto& addr{reinterpret_cast<sockaddr_in&>(server_addr)};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(ipv4.port);
+            addr.sin_addr.s_addr = std::visit(overloaded{
+                [](const std::string& address) {
+                    const uint32_t addr = inet_addr(address.c_str());
+                    if (addr == (uint32_t)(-1)) {
+                        throw std::invalid_argument("Invalid IP address: " + address);
+                    }
+                    return addr;
+                },
+                [](uint32_t address) { return htonl(address); }
+            }, ipv4.address);
+            server_addr_len = sizeof(addr);
+            std::array<char, INET_ADDRSTRLEN> buf;
+            description = std::string{inet_ntop(AF_INET, &addr.sin_addr, buf.data(), buf.size())} + ':' +
+                          std::to_string(ipv4.port);
+        },
+        [&](const Ipv6ListenAddress& ipv6) {
+            auto& addr{reinterpret_cast<sockaddr_in6&>(server_addr)};
+            addr.sin6_family = AF_INET6;
+            addr.sin6_port = htons(ipv6.port);
+            if (inet_pton(AF_INET6, ipv6.address.c_str(), &addr.sin6_addr) != 1) {
+                throw std::invalid_argument("Invalid IPv6 address: " + ipv6.address);
             }
-            return addr;
+            server_addr_len = sizeof(addr);
+            description = '[' + ipv6.address + "]:" + std::to_string(ipv6.port);
         },
-        [](uint32_t address) { return htonl(address); }
-    }, ipv4_address);
-    const std::uint16_t network_port = htons(port);
+        [&](const UnixListenAddress& unix_address) {
+            auto& addr{reinterpret_cast<sockaddr_un&>(server_addr)};
+            addr.sun_family = AF_UNIX;
+            const std::string& path{unix_address.path.native()};
+            if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+                throw std::invalid_argument("Invalid Unix socket path: " + path);
+            }
+            std::ranges::copy(path, addr.sun_path);
+            server_addr_len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+            description = "unix:" + path;
+        }
+    }, address);
 
+    FileDescriptor listening_socket{socket(server_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)};
+    if (listening_socket.IsEmpty()) {
+        throw HttpServerException{StrError("Failed to create server socket for " + description)};
+    }
+    listening_socket.SetNonBlocking(true);
 
-    listening_socket_ = FileDescriptor{socket(AF_INET, SOCK_STREAM, 0)};
-    if (listening_socket_.IsEmpty()) {
-        throw HttpServerException{StrError("Failed to create server socket")};
+    if (server_addr.ss_family == AF_UNIX) {
+        // A socket file left behind by a previous run would make bind fail with EADDRINUSE, but a running
+        // server still listening on the path keeps it: only a refused connection means the file is stale.
+        const std::filesystem::path& path{std::get<UnixListenAddress>(address).path};
+        std::error_code error;
+        if (std::filesystem::is_socket(path, error)) {
+            FileDescriptor probe{socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)};
+            if (!probe.IsEmpty() && connect(probe.Get(), (sockaddr*)&server_addr, server_addr_len) == -1
+                    && errno == ECONNREFUSED) {
+                std::filesystem::remove(path, error);
+            }
+        }
+    } else {
+        // Since the tester restarts your program quite often, setting REUSE_PORT
+        // ensures that we don't run into 'Address already in use' errors
+        static constexpr int kReusePort{1};
+        if (setsockopt(listening_socket.Get(), SOL_SOCKET, SO_REUSEPORT, &kReusePort, sizeof(kReusePort)) < 0) {
+            throw HttpServerException{StrError("setsockopt failed")};
+        }
+    }
+    if (server_addr.ss_family == AF_INET6) {
+        const int v6_only{std::get<Ipv6ListenAddress>(address).v6_only ? 1 : 0};
+        if (setsockopt(listening_socket.Get(), IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only)) < 0) {
+            throw HttpServerException{StrError("setsockopt IPV6_V6ONLY failed")};
+        }
     }
-    listening_socket_.SetNonBlocking(true);
 
-    // Since the tester restarts your program quite often, setting REUSE_PORT
-    // ensures that we don't run into 'Address already in use' errors
-    static constexpr int kReusePort{1};
-    if (setsockopt(listening_socket_.Get(), SOL_SOCKET, SO_REUSEPORT, &kReusePort, sizeof(kReusePort)) < 0) {
-        throw HttpServerException{StrError("setsockopt failed")};
+    if (bind(listening_socket.Get(), (sockaddr*)&server_addr, server_addr_len) != 0) {
+        throw HttpServerException{StrError("Failed to bind to " + description)};
     }
+    return listening_socket;
+}
 
-    sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = addr;
-    server_addr.sin_port = network_port;
+void HttpServer::Listen(FileDescriptor& listening_socket) {
+    // Connections wait in the kernel backlog while accepting is paused
+    static constexpr int kConnectionBacklog{SOMAXCONN};
+    if (listen(listening_socket.Get(), kConnectionBacklog) == -1) {
+        throw HttpServerException{StrError("listen failed")};
+    }
+}
 
-    if (bind(listening_socket_.Get(), (sockaddr*)&server_addr, sizeof(server_addr)) != 0) {
-        using namespace std::string_literals;
-        throw HttpServerException{StrError(
-            "Failed to bind to IP address"s + inet_ntoa(server_addr.sin_addr) + "on port " + std::to_string(port)
-        )};
+void HttpServer::TakeOverListeningSockets(FileDescriptor& handoff_channel) {
+    // The listeners of the previous instance win over the ones configured for this one
+    listening_sockets_ = ReceiveFileDescriptors(handoff_channel);
+    if (listening_sockets_.empty()) {
+        throw HttpServerException{"Expected listening sockets from the previous instance"};
+    }
+    for (FileDescriptor& listening_socket : listening_sockets_) {
+        listening_socket.SetNonBlocking(true);
     }
+    // The previous instance stops accepting as soon as it sees the acknowledgement
+    SendHandoffAck(handoff_channel);
 }
 
-void HttpServer::Listen() {
-    static constexpr int kConnectionBacklog{5};
-    if (listen(listening_socket_.Get(), kConnectionBacklog) == -1) {
-        throw HttpServerException{StrError("listen failed")};
+void HttpServer::SetUpSignalHandling() {
+    // Writes to closed connections should fail with EPIPE instead of killing the server
+    std::signal(SIGPIPE, SIG_IGN);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &mask, nullptr) == -1) {
+        throw HttpServerException{StrError("sigprocmask failed")};
+    }
+
+    signal_fd_ = FileDescriptor{signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)};
+    if (signal_fd_.IsEmpty()) {
+        throw HttpServerException{StrError("signalfd failed")};
+    }
+}
+
+void HttpServer::HandleSignals() {
+    signalfd_siginfo info;
+    while (read(signal_fd_.Get(), &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+        case SIGTERM:
+        case SIGINT:
+            StartDraining();
+            break;
+        case SIGUSR2:
+            HotUpgrade();
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void HttpServer::HotUpgrade() {
+    if (draining_ || upgrade_) {
+        return;
+    }
+
+    UpgradedProcess process;
+    try {
+        process = SpawnUpgradedProcess();
+        std::vector<int> listening_socket_fds;
+        for (FileDescriptor& listening_socket : listening_sockets_) {
+            listening_socket_fds.push_back(listening_socket.Get());
+        }
+        SendFileDescriptors(process.channel, listening_socket_fds);
+    } catch (const SocketHandoffException& e) {
+        // Keep serving with the current binary
+        std::cerr << "Hot upgrade failed: " << e.what() << '\n';
+        AbandonUpgradedProcess(process);
+        return;
+    }
+    // Connections are served on while the new instance starts up, its acknowledgement arrives as an event
+    AddFileDescriptorToEPoll(process.channel, kEPollEdgeTriggeredReadEvent);
+    upgrade_deadline_ = std::chrono::steady_clock::now() + config_.upgrade_timeout;
+    upgrade_ = std::move(process);
+}
+
+void HttpServer::ProcessHotUpgradeAck() {
+    switch (ReceiveHandoffAck(upgrade_->channel)) {
+    case HandoffAck::kPending:
+        break;
+    case HandoffAck::kReceived:
+        // The new instance accepts from now on, it keeps running on its own and removes the socket files
+        RemoveFileDescriptorFromEPoll(upgrade_->channel);
+        upgrade_.reset();
+        unix_socket_files_.clear();
+        StartDraining();
+        break;
+    case HandoffAck::kFailed:
+        AbandonHotUpgrade("Upgraded instance did not take over the listening sockets");
+        break;
+    }
+}
+
+void HttpServer::AbandonHotUpgrade(std::string_view reason) {
+    // Keep serving with the current binary
+    std::cerr << "Hot upgrade failed: " << reason << '\n';
+    RemoveFileDescriptorFromEPoll(upgrade_->channel);
+    AbandonUpgradedProcess(*upgrade_);
+    upgrade_.reset();
+}
+
+void HttpServer::StartDraining() {
+    if (draining_) {
+        return;
+    }
+    // Stopping wins over an upgrade still in progress, which would take over the listeners after all
+    if (upgrade_) {
+        AbandonHotUpgrade("Server is shutting down");
+    }
+    draining_ = true;
+    drain_deadline_ = std::chrono::steady_clock::now() + config_.drain_timeout;
+    accepting_paused_ = false;
+
+    // Pending connections in the backlog are either served by the upgraded instance or reset
+    for (FileDescriptor& listening_socket : listening_sockets_) {
+        RemoveFileDescriptorFromEPoll(listening_socket);
+    }
+    listening_sockets_.clear();
+
+    // HTTP/2 connections stay open between requests, they are told to go away once their streams are done
+    for (auto& [socket_fd, connection_state] : connections_) {
+        if (connection_state.http2) {
+            connection_state.http2->GetConnection().Shutdown();
+            ScheduleHttp2Output(socket_fd);
+        }
     }
 }
 
 void HttpServer::RunEventLoop() {
     static constexpr int kWaitIndefinitely{-1};
+    static constexpr int kDoNotWait{0};
     static constexpr size_t kEPollMaxEvents = 16;
 
-    AddFileDescriptorToEPoll(listening_socket_);
+    for (FileDescriptor& listening_socket : listening_sockets_) {
+        AddFileDescriptorToEPoll(listening_socket, kEPollEdgeTriggeredReadEvent);
+    }
+    AddFileDescriptorToEPoll(signal_fd_, kEPollEdgeTriggeredReadEvent);
+
+    // Bounds how long new events wait while the ready queue is served without polling
+    static constexpr size_t kMaxReadyQueuePassesWithoutPolling{8};
+
+    // Spinning trades CPU time for the scheduler latency of waking up from epoll_wait
+    const bool busy_polling{config_.busy_poll_duration.count() > 0};
+    auto spin_deadline{std::chrono::steady_clock::now() + config_.busy_poll_duration};
+    size_t ready_queue_passes_without_polling{0};
 
     std::array<epoll_event, kEPollMaxEvents> events;
-    while (true) {
-        const int events_count{
-            epoll_wait(epoll_fd_.Get(), events.data(), static_cast<int>(events.size()), kWaitIndefinitely)};
+    while (!draining_ || !connections_.empty()) {
+        // Connections in the ready queue still have data, so only poll for new events
+        int timeout{ready_queue_.empty() ? kWaitIndefinitely : kDoNotWait};
+        if (busy_polling && timeout == kWaitIndefinitely && std::chrono::steady_clock::now() < spin_deadline) {
+            timeout = kDoNotWait;
+        }
+        if (draining_) {
+            const auto time_left{std::chrono::ceil<std::chrono::milliseconds>(
+                drain_deadline_ - std::chrono::steady_clock::now())};
+            if (time_left.count() <= 0) {
+                break;
+            }
+            timeout = timeout == kDoNotWait ? kDoNotWait : static_cast<int>(time_left.count());
+        }
+        if (const std::optional<std::chrono::steady_clock::time_point> deadline{GetNextDeadline()};
+                deadline && timeout != kDoNotWait) {
+            const auto time_left{std::chrono::ceil<std::chrono::milliseconds>(
+                *deadline - std::chrono::steady_clock::now())};
+            const int deadline_timeout{static_cast<int>(std::max<std::int64_t>(time_left.count(), 0))};
+            timeout = timeout == kWaitIndefinitely ? deadline_timeout : std::min(timeout, deadline_timeout);
+        }
 
-        // ToDo: Handle signals, errors, etc. later
-        if (events_count == -1) {
-            continue;
+        int events_count{0};
+        if (busy_polling && !ready_queue_.empty()
+            && ready_queue_passes_without_polling < kMaxReadyQueuePassesWithoutPolling) {
+            // Skip the system call, edge-triggered events stay queued in the epoll instance meanwhile
+            ++ready_queue_passes_without_polling;
+        } else {
+            ready_queue_passes_without_polling = 0;
+            events_count = epoll_wait(epoll_fd_.Get(), events.data(), static_cast<int>(events.size()), timeout);
+            if (events_count == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw HttpServerException{StrError("epoll_wait failed")};
+            }
+            if (busy_polling && events_count > 0) {
+                spin_deadline = std::chrono::steady_clock::now() + config_.busy_poll_duration;
+            }
         }
 
         for (const epoll_event& event : events | std::views::take(static_cast<size_t>(events_count))) {
-            if (event.data.fd == listening_socket_.Get()) {
-                AcceptNewConnections();
+            if (FileDescriptor* listening_socket{FindListeningSocket(event.data.fd)}) {
+                AcceptNewConnections(*listening_socket);
+            } else if (event.data.fd == signal_fd_.Get()) {
+                HandleSignals();
+            } else if (upgrade_ && event.data.fd == upgrade_->channel.Get()) {
+                ProcessHotUpgradeAck();
+            } else if (auto listener_it{listeners_.find(event.data.fd)}; listener_it != listeners_.end()) {
+                listener_it->second->OnEvents(event.data.fd, event.events);
+            } else if (lingering_sockets_.contains(event.data.fd)) {
+                ProcessLingeringSocket(event.data.fd);
             } else {
-                ProcessConnection(event.data.fd);
+                ProcessConnection(event.data.fd, event.events);
+            }
+        }
+
+        ProcessReadyQueue();
+        ProcessHttp2OutputConnections();
+        ProcessFinishedConnections();
+        CloseExpiredLingeringSockets();
+        if (upgrade_ && std::chrono::steady_clock::now() >= upgrade_deadline_) {
+            AbandonHotUpgrade("Upgraded instance did not take over the listening sockets in time");
+        }
+
+        // Some connections were closed, take over the ones waiting in the backlog
+        if (accepting_paused_ && !draining_ && connections_.size() < config_.max_connections) {
+            accepting_paused_ = false;
+            for (FileDescriptor& listening_socket : listening_sockets_) {
+                AcceptNewConnections(listening_socket);
+            }
+        }
+    }
+
+    // Connections still open when the drain timeout runs out are closed like any other
+    while (!connections_.empty()) {
+        CloseConnection(connections_.begin());
+    }
+}
+
+std::optional<std::chrono::steady_clock::time_point> HttpServer::GetNextDeadline() const noexcept {
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    if (!lingering_deadlines_.empty()) {
+        deadline = lingering_deadlines_.front().second;
+    }
+    if (upgrade_ && (!deadline || upgrade_deadline_ < *deadline)) {
+        deadline = upgrade_deadline_;
+    }
+    return deadline;
+}
+
+void HttpServer::ConfigureListeningSocket(FileDescriptor& listening_socket) {
+    sockaddr_storage addr{};
+    socklen_t addr_len{sizeof(addr)};
+    if (getsockname(listening_socket.Get(), (sockaddr*)&addr, &addr_len) == -1) {
+        throw HttpServerException{StrError("getsockname failed")};
+    }
+    if (addr.ss_family == AF_UNIX) {
+        const auto& unix_addr{reinterpret_cast<const sockaddr_un&>(addr)};
+        // Abstract sockets have no file
+        if (addr_len > offsetof(sockaddr_un, sun_path) && unix_addr.sun_path[0] != '\0') {
+            const std::filesystem::path path{std::string_view{unix_addr.sun_path,
+                                             strnlen(unix_addr.sun_path, sizeof(unix_addr.sun_path))}};
+            struct stat file_stat;
+            if (stat(path.c_str(), &file_stat) == 0) {
+                unix_socket_files_.push_back(
+                    UnixSocketFile{.path = path, .device = file_stat.st_dev, .inode = file_stat.st_ino});
             }
         }
+        return;
+    }
+
+    // Among SO_REUSEPORT sockets, the kernel prefers the one whose CPU processed the incoming packet
+    if (!config_.cpu_affinity.empty()) {
+        const int cpu{static_cast<int>(config_.cpu_affinity.front())};
+        if (setsockopt(listening_socket.Get(), SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1) {
+            throw HttpServerException{StrError("setsockopt SO_INCOMING_CPU failed")};
+        }
+    }
+    if (config_.socket_busy_poll.count() > 0) {
+        const int busy_poll{static_cast<int>(config_.socket_busy_poll.count())};
+        // Values above net.core.busy_read need CAP_NET_ADMIN
+        if (setsockopt(listening_socket.Get(), SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == -1) {
+            throw HttpServerException{StrError("setsockopt SO_BUSY_POLL failed")};
+        }
+    }
+}
+
+void HttpServer::PinToCpus() {
+    if (config_.cpu_affinity.empty()) {
+        return;
+    }
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (const unsigned cpu : config_.cpu_affinity) {
+        if (cpu >= CPU_SETSIZE) {
+            throw HttpServerException{"CPU " + std::to_string(cpu) + " is out of range"};
+        }
+        CPU_SET(cpu, &cpu_set);
+    }
+    if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) == -1) {
+        throw HttpServerException{StrError("sched_setaffinity failed")};
     }
 }
 
-void HttpServer::AcceptNewConnections() {
-    sockaddr_in client_addr;
-    socklen_t client_addr_len{sizeof(client_addr)};
+FileDescriptor* HttpServer::FindListeningSocket(int fd) noexcept {
+    const auto listening_socket_it{std::ranges::find(listening_sockets_, fd, &FileDescriptor::Get)};
+    return listening_socket_it != listening_sockets_.end() ? &*listening_socket_it : nullptr;
+}
+
+void HttpServer::AcceptNewConnections(FileDescriptor& listening_socket) {
+    sockaddr_storage client_addr;
     while (true) {
-        FileDescriptor client_socket{accept(listening_socket_.Get(), (sockaddr*)&client_addr, &client_addr_len)};
+        socklen_t client_addr_len{sizeof(client_addr)};
+        if (connections_.size() >= config_.max_connections) {
+            accepting_paused_ = true;
+            break;
+        }
+
+        FileDescriptor client_socket{accept4(
+            listening_socket.Get(), (sockaddr*)&client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC)};
 
         // Check if client successfully connected
         if (client_socket.IsEmpty()) {
             // No connections are present to be accepted
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 break;
+            } else if (errno == EMFILE || errno == ENFILE) {
+                if (reserve_fd_.IsEmpty()) {
+                    // Nothing to shed with, wait for a connection to be closed
+                    accepting_paused_ = true;
+                    break;
+                }
+                // The fd limit is hit before the backlog is checked, so stop once it runs dry
+                if (!ShedConnectionUsingReserveFileDescriptor(listening_socket)) {
+                    break;
+                }
+                continue;
+            } else if (errno == ECONNABORTED || errno == EINTR || errno == EPROTO) {
+                continue;
             } else {
+                // Out of memory and alike, retry on the next wakeup rather than spin
+                break;
+            }
+        }
+
+        if (IsOverloaded()) {
+            ShedConnection(client_socket);
+            Linger(std::move(client_socket));
+            continue;
+        }
+
+        const auto now{std::chrono::steady_clock::now()};
+        if (rate_limiter_) {
+            if (std::optional<std::chrono::seconds> retry_after{rate_limiter_->CheckConnection(client_addr, now)}) {
+                ThrottleConnection(client_socket, *retry_after);
+                Linger(std::move(client_socket));
                 continue;
             }
         }
 
-        client_socket.SetNonBlocking(true);
-        AddFileDescriptorToEPoll(client_socket);
-        connections_.try_emplace(client_socket.Get(), std::move(client_socket));
+        AddFileDescriptorToEPoll(client_socket, kEPollClientEvents);
+        const int socket_fd{client_socket.Get()};
+        ConnectionState& connection_state{connections_.try_emplace(socket_fd, std::move(client_socket)).first->second};
+        connection_state.peer_address = client_addr;
+        connection_state.accepted_at = now;
+        connection_state.timings.Mark(RequestPhase::kAccepted);
+        HTTP_SERVER_PROBE1(connection__accepted, socket_fd);
     }
 }
 
-void HttpServer::ProcessConnection(int socket_fd) {
+void HttpServer::ProcessConnection(int socket_fd, std::uint32_t events) {
     auto connection_state_it{connections_.find(socket_fd)};
     if (connection_state_it == connections_.end()) {
         return;
     }
 
     ConnectionState& connection_state{connection_state_it->second};
+    if (connection_state.http2) {
+        ProcessHttp2Connection(connection_state_it, events);
+        return;
+    }
+    if (connection_state.response_started) {
+        if ((events & (EPOLLHUP | EPOLLERR)) != 0 || !FlushConnection(connection_state)) {
+            CloseConnection(connection_state_it);
+        } else if (connection_state.output.empty() && !connection_state.output_file) {
+            if (connection_state.response_finished) {
+                CloseConnection(connection_state_it);
+            } else if (connection_state.response_stream) {
+                connection_state.response_stream->NotifyWritable();
+            }
+        }
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) == 0) {
+        return;
+    }
+    if (connection_state.file_upload) {
+        ContinueFileUpload(connection_state_it, config_.max_read_bytes_per_wakeup);
+        return;
+    }
+
     HttpParserState parser_state{connection_state.http_parser.GetState()};
 
     static constexpr size_t kReadBufSize{1024};
     std::array<char, kReadBufSize> read_buf;
+    size_t read_budget{config_.max_read_bytes_per_wakeup};
     bool not_enough_data{false};
     while (parser_state != HttpParserState::kError && parser_state != HttpParserState::kFinished) {
+        // Budget is spent: let other connections run and come back to this one later
+        if (read_budget == 0) {
+            if (!connection_state.in_ready_queue) {
+                connection_state.in_ready_queue = true;
+                ready_queue_.push_back(socket_fd);
+            }
+            return;
+        }
 
-        const ssize_t bytes_read{read(connection_state.socket.Get(), read_buf.data(), read_buf.size())};
+        const ssize_t bytes_read{
+            read(connection_state.socket.Get(), read_buf.data(), std::min(read_buf.size(), read_budget))};
 
         // EOF
         if (bytes_read == 0) {
@@ -181,8 +837,38 @@ void HttpServer::ProcessConnection(int socket_fd) {
                 break;
             }
         } else {
+            connection_state.timings.Mark(RequestPhase::kFirstByte);
+            read_budget -= static_cast<size_t>(bytes_read);
+            connection_state.buffered_bytes += static_cast<size_t>(bytes_read);
+            buffered_bytes_ += static_cast<size_t>(bytes_read);
+            if (buffered_bytes_ > config_.max_buffered_bytes) {
+                ShedConnection(connection_state.socket);
+                connection_state.linger_on_close = true;
+                CloseConnection(connection_state_it);
+                return;
+            }
             connection_state.buffer += std::string_view{read_buf.data(), static_cast<size_t>(bytes_read)};
+            // HTTP/2 with prior knowledge starts with its connection preface instead of a request
+            if (parser_state == HttpParserState::kStartLine && MayBeHttp2ConnectionPreface(connection_state.buffer)) {
+                if (connection_state.buffer.size() < kHttp2ConnectionPreface.size()) {
+                    continue;
+                }
+                StartHttp2(connection_state_it);
+                connection_state.http2->GetConnection().Receive(std::exchange(connection_state.buffer, {}));
+                ProcessHttp2Connection(connection_state_it, EPOLLIN);
+                return;
+            }
             parser_state = connection_state.http_parser.Parse(connection_state.buffer);
+            if (parser_state == HttpParserState::kBody || parser_state == HttpParserState::kFinished) {
+                connection_state.timings.Mark(RequestPhase::kHeadersParsed);
+            }
+            if (parser_state == HttpParserState::kFinished) {
+                connection_state.timings.Mark(RequestPhase::kBodyComplete);
+            }
+            if (parser_state == HttpParserState::kBody && !connection_state.file_upload_considered
+                && TryStartFileUpload(connection_state_it, read_budget)) {
+                return;
+            }
         }
     }
 
@@ -190,20 +876,642 @@ void HttpServer::ProcessConnection(int socket_fd) {
         return;
     }
 
-    const HttpResponse response{parser_state == HttpParserState::kFinished
-                                ? HandleRequest(connection_state.http_parser.GetRequest())
-                                : HttpResponse{.response_status = HttpResponseStatus::k400BadRequest}};
+    if (parser_state != HttpParserState::kFinished) {
+        SendResponse(connection_state_it, HttpResponse{.response_status = HttpResponseStatus::k400BadRequest});
+        return;
+    }
+    HandleRequest(connection_state_it, connection_state.http_parser.GetRequest());
+}
+
+bool HttpServer::TryStartFileUpload(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                                    size_t read_budget) {
+    // Smaller bodies are not worth a pipe and the extra system calls
+    static constexpr size_t kMinFileUploadBytes{64 * 1024};
+
+    ConnectionState& connection_state{connection_state_it->second};
+    connection_state.file_upload_considered = true;
+    const std::optional<size_t> content_length{connection_state.http_parser.GetContentLength()};
+    if (!content_length || *content_length < kMinFileUploadBytes) {
+        return false;
+    }
+
+    // The handler is chosen on the request head the same way HandleRequest chooses it for the full request
+    const HttpRequest& partial_request{connection_state.http_parser.GetPartialRequest()};
+    HttpHandlerBase* handler{FindHandler(partial_request)};
+    if (handler == nullptr) {
+        return false;
+    }
+    // Checked before the file is opened, which may already truncate it
+    if (rate_limiter_) {
+        if (std::optional<std::chrono::seconds> retry_after{rate_limiter_->CheckRequest(
+                connection_state.peer_address, partial_request.path, std::chrono::steady_clock::now())}) {
+            StartAccessLogRecord(connection_state, &partial_request);
+            SendResponse(connection_state_it, MakeTooManyRequestsResponse(*retry_after));
+            return true;
+        }
+    }
+    FileDescriptor file{handler->OpenRequestBodyFile(partial_request)};
+    if (file.IsEmpty()) {
+        return false;
+    }
+
+    HttpRequest request{connection_state.http_parser.TakeRequestWithPartialBody()};
+    FileUpload upload{std::move(file), *content_length};
+    const bool stored{upload.Write(request.body)};
+    request.body.clear();
+    StartAccessLogRecord(connection_state, &request);
+    if (!stored) {
+        SendResponse(connection_state_it, HttpResponse{.response_status = HttpResponseStatus::k500InternalServerError});
+        return true;
+    }
+    HTTP_SERVER_PROBE2(request__parsed, connection_state_it->first, request.path.c_str());
+    connection_state.file_upload = FileUploadState{
+        .upload = std::move(upload), .handler = handler, .request = std::move(request)};
+    ContinueFileUpload(connection_state_it, read_budget);
+    return true;
+}
+
+void HttpServer::ContinueFileUpload(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                                    size_t read_budget) {
+    const int socket_fd{connection_state_it->first};
+    ConnectionState& connection_state{connection_state_it->second};
+    switch (connection_state.file_upload->upload.Transfer(socket_fd, read_budget)) {
+    case FileUploadStatus::kWouldBlock:
+        break;
+    case FileUploadStatus::kBudgetSpent:
+        if (!connection_state.in_ready_queue) {
+            connection_state.in_ready_queue = true;
+            ready_queue_.push_back(socket_fd);
+        }
+        break;
+    case FileUploadStatus::kClosed:
+        connection_state.file_upload->upload.Truncate();
+        connection_state.file_upload.reset();
+        SendResponse(connection_state_it, HttpResponse{.response_status = HttpResponseStatus::k400BadRequest});
+        break;
+    case FileUploadStatus::kError:
+        connection_state.file_upload->upload.Truncate();
+        connection_state.file_upload.reset();
+        SendResponse(connection_state_it, HttpResponse{.response_status = HttpResponseStatus::k500InternalServerError});
+        break;
+    case FileUploadStatus::kFinished: {
+        HttpHandlerBase* handler{connection_state.file_upload->handler};
+        HttpRequest request{std::move(connection_state.file_upload->request)};
+        // The file is closed before the response tells the client it is stored
+        connection_state.file_upload.reset();
+        connection_state.timings.Mark(RequestPhase::kBodyComplete);
+        connection_state.timings.Mark(RequestPhase::kHandlerStarted);
+        HTTP_SERVER_PROBE2(handler__started, socket_fd, request.path.c_str());
+        const HttpResponse response{handler->HandleStoredRequest(std::move(request))};
+        connection_state.timings.Mark(RequestPhase::kHandlerFinished);
+        HTTP_SERVER_PROBE2(handler__finished, socket_fd, static_cast<unsigned>(response.response_status));
+        SendResponse(connection_state_it, response);
+        break;
+    }
+    }
+}
+
+void HttpServer::StartHttp2(std::unordered_map<int, ConnectionState>::iterator connection_state_it) {
+    ConnectionState& connection_state{connection_state_it->second};
+    // From now on only request bytes held by the streams count as buffered
+    buffered_bytes_ -= connection_state.buffered_bytes;
+    connection_state.buffered_bytes = 0;
+    connection_state.http2 = std::make_unique<Http2Session>(*this, connection_state_it->first);
+}
+
+void HttpServer::UpgradeToHttp2(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                                std::string_view settings, HttpRequest request) {
+    static constexpr std::string_view kSwitchingProtocolsResponse{
+        "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"};
+
+    ConnectionState& connection_state{connection_state_it->second};
+    StartHttp2(connection_state_it);
+    if (!WriteToConnection(connection_state, kSwitchingProtocolsResponse)) {
+        CloseConnection(connection_state_it);
+        return;
+    }
+    Http2Connection& http2{connection_state.http2->GetConnection()};
+    http2.StartUpgraded(settings, std::move(request));
+    // The client may have sent its connection preface right behind the request
+    if (!connection_state.buffer.empty()) {
+        http2.Receive(std::exchange(connection_state.buffer, {}));
+    }
+    ProcessHttp2Connection(connection_state_it, EPOLLIN);
+}
+
+void HttpServer::ProcessHttp2Connection(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                                        std::uint32_t events) {
+    const int socket_fd{connection_state_it->first};
+    ConnectionState& connection_state{connection_state_it->second};
+    Http2Connection& http2{connection_state.http2->GetConnection()};
+    if ((events & EPOLLOUT) != 0 && !FlushConnection(connection_state)) {
+        CloseConnection(connection_state_it);
+        return;
+    }
+
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0) {
+        static constexpr size_t kReadBufSize{16 * 1024};
+        std::array<char, kReadBufSize> read_buf;
+        size_t read_budget{config_.max_read_bytes_per_wakeup};
+        while (!http2.IsFinished()) {
+            if (read_budget == 0) {
+                if (!connection_state.in_ready_queue) {
+                    connection_state.in_ready_queue = true;
+                    ready_queue_.push_back(socket_fd);
+                }
+                break;
+            }
+            const ssize_t bytes_read{
+                read(connection_state.socket.Get(), read_buf.data(), std::min(read_buf.size(), read_budget))};
+            if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            } else if (bytes_read <= 0) {
+                // Responses still in progress have no one to go to
+                CloseConnection(connection_state_it);
+                return;
+            }
+            read_budget -= static_cast<size_t>(bytes_read);
+            http2.Receive(std::string_view{read_buf.data(), static_cast<size_t>(bytes_read)});
+        }
+
+        const size_t buffered{http2.GetBufferedBytes()};
+        buffered_bytes_ = buffered_bytes_ - connection_state.buffered_bytes + buffered;
+        connection_state.buffered_bytes = buffered;
+        if (buffered_bytes_ > config_.max_buffered_bytes) {
+            http2.Terminate(Http2ErrorCode::kEnhanceYourCalm);
+        }
+    }
+    SendHttp2Output(connection_state_it);
+}
+
+void HttpServer::SendHttp2Output(std::unordered_map<int, ConnectionState>::iterator connection_state_it) {
+    ConnectionState& connection_state{connection_state_it->second};
+    Http2Connection& http2{connection_state.http2->GetConnection()};
+    // More frames are only produced once the socket took the previous ones, flow control keeps the rest
+    while (connection_state.output.empty()) {
+        const std::string frames{http2.TakeOutput()};
+        if (frames.empty()) {
+            break;
+        }
+        if (!WriteToConnection(connection_state, frames)) {
+            CloseConnection(connection_state_it);
+            return;
+        }
+    }
+    if (http2.IsFinished() && connection_state.output.empty()) {
+        CloseConnection(connection_state_it);
+    }
+}
+
+void HttpServer::ScheduleHttp2Output(int socket_fd) {
+    auto connection_state_it{connections_.find(socket_fd)};
+    if (connection_state_it != connections_.end() && !connection_state_it->second.http2_output_scheduled) {
+        connection_state_it->second.http2_output_scheduled = true;
+        http2_output_connections_.push_back(socket_fd);
+    }
+}
+
+void HttpServer::ProcessHttp2OutputConnections() {
+    for (const int socket_fd : std::exchange(http2_output_connections_, {})) {
+        auto connection_state_it{connections_.find(socket_fd)};
+        if (connection_state_it == connections_.end() || !connection_state_it->second.http2_output_scheduled) {
+            continue;
+        }
+        connection_state_it->second.http2_output_scheduled = false;
+        if (connection_state_it->second.http2) {
+            SendHttp2Output(connection_state_it);
+        }
+    }
+}
 
-    const std::string response_str{ToString(response)};
-    write(connection_state.socket.Get(), response_str.data(), response_str.size());
+void HttpServer::ProcessReadyQueue() {
+    // Single round-robin pass: connections re-queued during the pass wait for the next one
+    for (size_t pending{ready_queue_.size()}; pending > 0; --pending) {
+        const int socket_fd{ready_queue_.front()};
+        ready_queue_.pop_front();
+
+        auto connection_state_it{connections_.find(socket_fd)};
+        if (connection_state_it == connections_.end()) {
+            continue;
+        }
+        connection_state_it->second.in_ready_queue = false;
+        ProcessConnection(socket_fd, EPOLLIN);
+    }
+}
+
+void HttpServer::ProcessFinishedConnections() {
+    for (const int socket_fd : std::exchange(finished_connections_, {})) {
+        auto connection_state_it{connections_.find(socket_fd)};
+        if (connection_state_it != connections_.end() && connection_state_it->second.response_finished
+            && connection_state_it->second.output.empty()) {
+            CloseConnection(connection_state_it);
+        }
+    }
+}
+
+void HttpServer::CloseConnection(std::unordered_map<int, ConnectionState>::iterator connection_state_it) {
+    ConnectionState& connection_state{connection_state_it->second};
+    if (connection_state.response_stream) {
+        connection_state.response_stream->Detach();
+    }
+    if (connection_state.response_finished && connection_state.output.empty() && !connection_state.output_file) {
+        connection_state.timings.Mark(RequestPhase::kLastByteWritten);
+        HTTP_SERVER_PROBE3(request__finished, connection_state_it->first, connection_state.response_status,
+                           connection_state.timings.Between(RequestPhase::kAccepted, RequestPhase::kLastByteWritten)
+                               .value_or(std::chrono::nanoseconds{0}).count());
+    }
+    // An upload cut off midway leaves no preallocated space behind, the same as a failed one
+    if (connection_state.file_upload) {
+        connection_state.file_upload->upload.Truncate();
+        connection_state.file_upload.reset();
+    }
+    WriteAccessLogRecord(connection_state);
+    buffered_bytes_ -= connection_state.buffered_bytes;
     RemoveFileDescriptorFromEPoll(connection_state.socket);
+    if (connection_state.linger_on_close) {
+        Linger(std::move(connection_state.socket));
+    }
     connections_.erase(connection_state_it);
 }
 
-HttpResponse HttpServer::HandleRequest(const HttpRequest& request) {
+bool HttpServer::IsOverloaded() const noexcept {
+    return ready_queue_.size() >= config_.max_ready_queue_depth || buffered_bytes_ >= config_.max_buffered_bytes;
+}
+
+void HttpServer::ShedConnection(FileDescriptor& client_socket) {
+    // Best effort: the response is small enough to fit into an empty socket send buffer
+    send(client_socket.Get(), service_unavailable_response_.data(), service_unavailable_response_.size(),
+         MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void HttpServer::ThrottleConnection(FileDescriptor& client_socket, std::chrono::seconds retry_after) {
+    const std::string response{ToHeadString(MakeTooManyRequestsResponse(retry_after))};
+    send(client_socket.Get(), response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+bool HttpServer::ShedConnectionUsingReserveFileDescriptor(FileDescriptor& listening_socket) {
+    reserve_fd_.Close();
+    FileDescriptor client_socket{accept4(listening_socket.Get(), nullptr, nullptr, SOCK_CLOEXEC)};
+    const bool accepted{!client_socket.IsEmpty()};
+    if (accepted) {
+        ShedConnection(client_socket);
+        // Without a File Descriptor to spare the connection cannot linger, only what already arrived is dropped
+        shutdown(client_socket.Get(), SHUT_WR);
+        DiscardInput(client_socket.Get());
+        client_socket.Close();
+    }
+    reserve_fd_ = FileDescriptor{open("/dev/null", O_RDONLY | O_CLOEXEC)};
+    return accepted;
+}
+
+void HttpServer::Linger(FileDescriptor client_socket) {
+    // Closing a socket with unread input makes the kernel reset the connection, and the reset may discard
+    // the response before the client read it. Only the sending side is shut down, which delivers the
+    // response followed by FIN, and what the client still sends is dropped until it closes too.
+    shutdown(client_socket.Get(), SHUT_WR);
+    if (DiscardInput(client_socket.Get()) || lingering_sockets_.size() >= kMaxLingeringSockets) {
+        return;
+    }
+    AddFileDescriptorToEPoll(client_socket, kEPollEdgeTriggeredReadEvent);
+    const int socket_fd{client_socket.Get()};
+    const auto deadline{std::chrono::steady_clock::now() + config_.linger_timeout};
+    lingering_sockets_.emplace(socket_fd, LingeringSocket{.socket = std::move(client_socket), .deadline = deadline});
+    lingering_deadlines_.emplace_back(socket_fd, deadline);
+}
+
+void HttpServer::ProcessLingeringSocket(int socket_fd) {
+    auto lingering_socket_it{lingering_sockets_.find(socket_fd)};
+    if (DiscardInput(socket_fd)) {
+        RemoveFileDescriptorFromEPoll(lingering_socket_it->second.socket);
+        lingering_sockets_.erase(lingering_socket_it);
+    }
+}
+
+void HttpServer::CloseExpiredLingeringSockets() {
+    const auto now{std::chrono::steady_clock::now()};
+    while (!lingering_deadlines_.empty() && lingering_deadlines_.front().second <= now) {
+        const auto [socket_fd, deadline]{lingering_deadlines_.front()};
+        lingering_deadlines_.pop_front();
+        // The socket may be closed already and its number taken by a socket which lingers since later
+        auto lingering_socket_it{lingering_sockets_.find(socket_fd)};
+        if (lingering_socket_it != lingering_sockets_.end() && lingering_socket_it->second.deadline == deadline) {
+            RemoveFileDescriptorFromEPoll(lingering_socket_it->second.socket);
+            lingering_sockets_.erase(lingering_socket_it);
+        }
+    }
+}
+
+bool HttpServer::WriteToConnection(ConnectionState& connection_state, std::string_view data,
+                                   std::string_view more_data) {
+    connection_state.bytes_sent += data.size() + more_data.size();
+    // Keep the order of bytes: nothing goes straight to the socket while older data is pending
+    if (!connection_state.output.empty()) {
+        connection_state.output += data;
+        connection_state.output += more_data;
+        return true;
+    }
+    while (!data.empty() || !more_data.empty()) {
+        std::array<iovec, 2> iov{{
+            {.iov_base = const_cast<char*>(data.data()), .iov_len = data.size()},
+            {.iov_base = const_cast<char*>(more_data.data()), .iov_len = more_data.size()},
+        }};
+        msghdr message{};
+        message.msg_iov = data.empty() ? &iov[1] : iov.data();
+        message.msg_iovlen = data.empty() || more_data.empty() ? 1 : 2;
+        const ssize_t bytes_written{sendmsg(connection_state.socket.Get(), &message, MSG_NOSIGNAL)};
+        if (bytes_written == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        const size_t data_written{std::min(static_cast<size_t>(bytes_written), data.size())};
+        data.remove_prefix(data_written);
+        more_data.remove_prefix(static_cast<size_t>(bytes_written) - data_written);
+    }
+    connection_state.output += data;
+    connection_state.output += more_data;
+    return true;
+}
+
+bool HttpServer::FlushConnection(ConnectionState& connection_state) {
+    size_t flushed{0};
+    while (flushed < connection_state.output.size()) {
+        const ssize_t bytes_written{send(connection_state.socket.Get(), connection_state.output.data() + flushed,
+                                         connection_state.output.size() - flushed, MSG_NOSIGNAL)};
+        if (bytes_written == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        flushed += static_cast<size_t>(bytes_written);
+    }
+    connection_state.output.erase(0, flushed);
+    if (connection_state.output.empty() && connection_state.output_file) {
+        return SendOutputFile(connection_state);
+    }
+    return true;
+}
+
+bool HttpServer::SendOutputFile(ConnectionState& connection_state) {
+    HttpFileRegion& region{*connection_state.output_file};
+    while (region.size != 0) {
+        auto offset{static_cast<off_t>(region.offset)};
+        const ssize_t bytes_sent{sendfile(connection_state.socket.Get(), region.file->Get(), &offset, region.size)};
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        // The file shrank, the announced length cannot be delivered
+        if (bytes_sent == 0) {
+            return false;
+        }
+        region.offset += static_cast<std::uint64_t>(bytes_sent);
+        region.size -= static_cast<size_t>(bytes_sent);
+    }
+    connection_state.output_file.reset();
+    return true;
+}
+
+void HttpServer::FinishResponse(int socket_fd, bool abort) {
+    auto connection_state_it{connections_.find(socket_fd)};
+    if (connection_state_it == connections_.end()) {
+        return;
+    }
+    ConnectionState& connection_state{connection_state_it->second};
+    if (abort) {
+        connection_state.output.clear();
+    }
+    connection_state.response_finished = true;
+    connection_state.timings.Mark(RequestPhase::kHandlerFinished);
+    HTTP_SERVER_PROBE2(handler__finished, socket_fd, connection_state.response_status);
+    if (connection_state.output.empty()) {
+        // Handlers may finish from within their own callbacks, so the connection is closed later
+        finished_connections_.push_back(socket_fd);
+    }
+}
+
+void HttpServer::StartAccessLogRecord(ConnectionState& connection_state, const HttpRequest* request) {
+    if ((!access_log_writer_ && !slow_request_log_writer_) || connection_state.access_log_record) {
+        return;
+    }
+    AccessLogRecord& record{connection_state.access_log_record.emplace()};
+    record.timestamp = std::chrono::system_clock::now();
+    record.peer = connection_state.peer_address;
+    if (request != nullptr) {
+        record.method = request->method;
+        record.SetPath(request->path);
+    }
+}
+
+void HttpServer::WriteAccessLogRecord(ConnectionState& connection_state) {
+    if (!connection_state.access_log_record) {
+        return;
+    }
+    AccessLogRecord& record{*connection_state.access_log_record};
+    record.status = connection_state.response_status;
+    record.bytes = connection_state.bytes_sent;
+    record.duration = std::chrono::steady_clock::now() - connection_state.accepted_at;
+    if (access_log_writer_) {
+        access_log_writer_->Write(record);
+    }
+    if (slow_request_log_writer_ && record.duration >= config_.slow_request_log->threshold) {
+        record.timings = connection_state.timings;
+        slow_request_log_writer_->Write(record);
+    }
+}
+
+void HttpServer::WriteHttp2AccessLogRecord(int socket_fd, const Http2StreamStats& stats) {
+    auto connection_state_it{connections_.find(socket_fd)};
+    if (!access_log_writer_ || connection_state_it == connections_.end()) {
+        return;
+    }
+    AccessLogRecord record;
+    record.duration = std::chrono::steady_clock::now() - stats.started_at;
+    record.timestamp = std::chrono::system_clock::now()
+        - std::chrono::duration_cast<std::chrono::system_clock::duration>(record.duration);
+    record.peer = connection_state_it->second.peer_address;
+    record.method = stats.method;
+    record.SetPath(stats.path);
+    record.status = stats.status;
+    record.bytes = stats.bytes;
+    access_log_writer_->Write(record);
+}
+
+HttpHandlerBase* HttpServer::FindHandler(const HttpRequest& request) const {
     auto handler_it = std::ranges::find_if(handlers_,
         [&request](HttpHandlerBase* handler) { return handler->IsMyRequest(request); }, ToAddress{});
-    return handler_it != handlers_.end()
-        ? (**handler_it).HandleRequest(request)
-        : HttpResponse{.response_status = HttpResponseStatus::k404NotFound};
+    return handler_it != handlers_.end() ? handler_it->get() : nullptr;
+}
+
+void HttpServer::HandleRequest(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                               HttpRequest request) {
+    if (rate_limiter_) {
+        if (std::optional<std::chrono::seconds> retry_after{rate_limiter_->CheckRequest(
+                connection_state_it->second.peer_address, request.path, std::chrono::steady_clock::now())}) {
+            StartAccessLogRecord(connection_state_it->second, &request);
+            SendResponse(connection_state_it, MakeTooManyRequestsResponse(*retry_after));
+            return;
+        }
+    }
+
+    if (std::optional<std::string> settings{GetHttp2UpgradeSettings(request)}) {
+        UpgradeToHttp2(connection_state_it, *settings, std::move(request));
+        return;
+    }
+
+    const int socket_fd{connection_state_it->first};
+    ConnectionState& connection_state{connection_state_it->second};
+    HTTP_SERVER_PROBE2(request__parsed, socket_fd, request.path.c_str());
+    HttpHandlerBase* handler{FindHandler(request)};
+    StartAccessLogRecord(connection_state, &request);
+    if (handler == nullptr) {
+        SendResponse(connection_state_it, HttpResponse{.response_status = HttpResponseStatus::k404NotFound});
+        return;
+    }
+
+    std::optional<ResponseCacheKey> cache_key{response_cache_ ? response_cache_->MakeKey(request) : std::nullopt};
+    if (cache_key) {
+        if (std::optional<HttpResponse> response{
+                response_cache_->Find(*cache_key, std::chrono::steady_clock::now())}) {
+            SendResponse(connection_state_it, *response);
+            return;
+        }
+    }
+
+    connection_state.timings.Mark(RequestPhase::kHandlerStarted);
+    HTTP_SERVER_PROBE2(handler__started, socket_fd, request.path.c_str());
+    AsyncHttpHandlerBase* async_handler{handler->AsAsync()};
+    if (async_handler == nullptr) {
+        HttpResponse response{handler->HandleRequest(std::move(request))};
+        connection_state.timings.Mark(RequestPhase::kHandlerFinished);
+        HTTP_SERVER_PROBE2(handler__finished, socket_fd, static_cast<unsigned>(response.response_status));
+        if (cache_key) {
+            response_cache_->Store(*cache_key, response, std::chrono::steady_clock::now());
+        }
+        SendResponse(connection_state_it, response);
+        return;
+    }
+
+    connection_state.response_started = true;
+    connection_state.response_stream = std::make_shared<ConnectionResponseStream>(*this, socket_fd);
+    std::shared_ptr<HttpResponseStream> response_stream{connection_state.response_stream};
+    if (cache_key) {
+        if (response_cache_->Wait(*cache_key, request, response_stream)) {
+            return;
+        }
+        response_stream = response_cache_->StartFlight(*cache_key, *async_handler, std::move(response_stream));
+    }
+    async_handler->HandleRequestAsync(std::move(request), std::move(response_stream));
+}
+
+void HttpServer::HandleHttp2Request(int socket_fd, HttpRequest request,
+                                    std::shared_ptr<HttpResponseStream> response_stream) {
+    if (rate_limiter_) {
+        auto connection_state_it{connections_.find(socket_fd)};
+        std::optional<std::chrono::seconds> retry_after;
+        if (connection_state_it != connections_.end()) {
+            retry_after = rate_limiter_->CheckRequest(connection_state_it->second.peer_address, request.path,
+                                                      std::chrono::steady_clock::now());
+        }
+        if (retry_after) {
+            response_stream->WriteResponse(MakeTooManyRequestsResponse(*retry_after));
+            return;
+        }
+    }
+
+    HttpHandlerBase* handler{FindHandler(request)};
+    if (handler == nullptr) {
+        response_stream->WriteResponse(HttpResponse{.response_status = HttpResponseStatus::k404NotFound});
+        return;
+    }
+
+    std::optional<ResponseCacheKey> cache_key{response_cache_ ? response_cache_->MakeKey(request) : std::nullopt};
+    if (cache_key) {
+        if (std::optional<HttpResponse> response{
+                response_cache_->Find(*cache_key, std::chrono::steady_clock::now())}) {
+            response_stream->WriteResponse(*response);
+            return;
+        }
+    }
+
+    if (AsyncHttpHandlerBase* async_handler{handler->AsAsync()}) {
+        if (cache_key) {
+            if (response_cache_->Wait(*cache_key, request, response_stream)) {
+                return;
+            }
+            response_stream = response_cache_->StartFlight(*cache_key, *async_handler, std::move(response_stream));
+        }
+        async_handler->HandleRequestAsync(std::move(request), std::move(response_stream));
+    } else {
+        HttpResponse response{handler->HandleRequest(std::move(request))};
+        if (cache_key) {
+            response_cache_->Store(*cache_key, response, std::chrono::steady_clock::now());
+        }
+        response_stream->WriteResponse(response);
+    }
+}
+
+void HttpServer::SendResponse(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                              const HttpResponse& response) {
+    ConnectionState& connection_state{connection_state_it->second};
+    StartAccessLogRecord(connection_state, nullptr);
+    connection_state.response_started = true;
+    connection_state.response_finished = true;
+    connection_state.response_status = static_cast<unsigned>(response.response_status);
+    const std::string head{ToHeadString(response)};
+    bool written;
+    if (const std::optional<std::string_view> body{GetBodyBytes(response.body)}) {
+        // The body is written from wherever the handler left it, only what the socket does not take is copied
+        written = WriteToConnection(connection_state, head, *body);
+    } else {
+        const HttpFileRegion& region{std::get<HttpFileRegion>(response.body)};
+        written = WriteToConnection(connection_state, head);
+        if (written && region.size != 0) {
+            connection_state.output_file = region;
+            connection_state.bytes_sent += region.size;
+            written = FlushConnection(connection_state);
+        }
+    }
+    // Whatever the socket did not take is flushed on the following writable events
+    if (!written || (connection_state.output.empty() && !connection_state.output_file)) {
+        CloseConnection(connection_state_it);
+    }
+}
+
+void HttpServer::Register(int fd, std::uint32_t events, EventLoopListener& listener) {
+    epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_.Get(), EPOLL_CTL_ADD, fd, &event) == -1) {
+        throw HttpServerException(StrError("EPOLL_CTL_ADD on File Descriptor " + std::to_string(fd) + " failed"));
+    }
+    listeners_.insert_or_assign(fd, &listener);
+}
+
+void HttpServer::Modify(int fd, std::uint32_t events) {
+    epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_.Get(), EPOLL_CTL_MOD, fd, &event) == -1) {
+        throw HttpServerException(StrError("EPOLL_CTL_MOD on File Descriptor " + std::to_string(fd) + " failed"));
+    }
+}
+
+void HttpServer::Unregister(int fd) {
+    listeners_.erase(fd);
+    if (epoll_ctl(epoll_fd_.Get(), EPOLL_CTL_DEL, fd, static_cast<epoll_event*>(nullptr)) == -1) {
+        throw HttpServerException(StrError("EPOLL_CTL_DEL on File Descriptor " + std::to_string(fd) + " failed"));
+    }
 }
@@ -1,54 +1,273 @@
 #ifndef HTTP_SERVER_SERVER_H
 #define HTTP_SERVER_SERVER_H
 
+#include "access_log.h"
+#include "event_loop.h"
 #include "file_descriptor.h"
+#include "file_upload.h"
 #include "http.h"
+#include "http2_connection.h"
 #include "http_handler_base.h"
 #include "http_parser.h"
+#include "rate_limiter.h"
+#include "request_timings.h"
+#include "response_cache.h"
+#include "socket_handoff.h"
 
+#include <chrono>
+#include <deque>
+#include <filesystem>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <variant>
 #include <vector>
 
+#include <cstddef>
 #include <cstdint>
 
+#include <sys/socket.h>
+#include <sys/types.h>
+
 struct HttpServerException : std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
-class HttpServer {
+struct Ipv4ListenAddress {
+    std::variant<std::string, std::uint32_t> address;
+    std::uint16_t port;
+};
+
+struct Ipv6ListenAddress {
+    std::string address{"::"};
+    std::uint16_t port;
+    // Dual-stack sockets also accept IPv4 clients as IPv4-mapped addresses
+    bool v6_only{false};
+};
+
+struct UnixListenAddress {
+    // A stale socket file left at the path is replaced
+    std::filesystem::path path;
+};
+
+using ListenAddress = std::variant<Ipv4ListenAddress, Ipv6ListenAddress, UnixListenAddress>;
+
+struct SlowRequestLogConfig {
+    AccessLogConfig log;
+    // Requests taking at least this long from accept to the last byte written are logged
+    std::chrono::milliseconds threshold{500};
+};
+
+struct HttpServerConfig {
+    // Number of bytes a single connection may read per wakeup before yielding to the others
+    std::size_t max_read_bytes_per_wakeup{64 * 1024};
+    // Accepting is paused while this many connections are open
+    std::size_t max_connections{10'000};
+    // Bytes read from all connections and not yet answered; new work is shed above it
+    std::size_t max_buffered_bytes{256 * 1024 * 1024};
+    // New connections are shed while this many connections wait in the ready queue
+    std::size_t max_ready_queue_depth{1024};
+    // Value of the Retry-After header sent with 503 Service Unavailable
+    unsigned retry_after_seconds{1};
+    // How long in-flight connections may take to finish once draining started
+    std::chrono::milliseconds drain_timeout{30'000};
+    // How long a rejected connection stays half-closed so that the client gets to read the response
+    std::chrono::milliseconds linger_timeout{1'000};
+    // How long a hot-upgraded instance may take to acknowledge the listening sockets
+    std::chrono::milliseconds upgrade_timeout{10'000};
+    // Requests are logged only when set
+    std::optional<AccessLogConfig> access_log;
+    // Slow requests are logged with the time spent in each phase only when set
+    std::optional<SlowRequestLogConfig> slow_request_log;
+    // GET responses of the configured routes are cached only when set
+    std::optional<ResponseCacheConfig> response_cache;
+    // Clients are throttled only when set
+    std::optional<RateLimiterConfig> rate_limit;
+    // Cores the event loop is pinned to; the first one is preferred for incoming connections via SO_INCOMING_CPU
+    std::vector<unsigned> cpu_affinity;
+    // The event loop keeps polling without sleeping for this long after its last event; zero disables spinning
+    std::chrono::microseconds busy_poll_duration{0};
+    // SO_BUSY_POLL of the listening sockets, inherited by accepted connections; zero keeps the system default
+    std::chrono::microseconds socket_busy_poll{0};
+};
+
+class HttpServer : private EventLoop {
+    class ConnectionResponseStream;
+    class Http2Session;
+
+    struct FileUploadState {
+        FileUpload upload;
+        HttpHandlerBase* handler;
+        // The body is not kept, it is stored in the file
+        HttpRequest request;
+    };
+
     struct ConnectionState {
         FileDescriptor socket;
         HttpParser http_parser;
         std::string buffer;
+        // Response bytes the client did not take yet
+        std::string output;
+        // File part of the response, sent once the output before it is flushed
+        std::optional<HttpFileRegion> output_file;
+        std::size_t buffered_bytes{0};
+        sockaddr_storage peer_address{};
+        std::chrono::steady_clock::time_point accepted_at;
+        RequestTimings timings;
+        unsigned response_status{0};
+        std::uint64_t bytes_sent{0};
+        // Filled in while the request is handled when the access log is enabled
+        std::optional<AccessLogRecord> access_log_record;
+        // Set while an asynchronous handler produces the response
+        std::shared_ptr<ConnectionResponseStream> response_stream;
+        // Set while the request body is moved from the socket straight into a file
+        std::optional<FileUploadState> file_upload;
+        bool file_upload_considered{false};
+        // Set once the connection speaks HTTP/2, its requests are then served as streams
+        std::unique_ptr<Http2Session> http2;
+        bool http2_output_scheduled{false};
+        bool in_ready_queue{false};
+        bool response_started{false};
+        bool response_finished{false};
+        // The connection was rejected while request bytes may still be unread
+        bool linger_on_close{false};
+    };
+
+    // Socket file of a Unix listener, removed on shutdown unless another socket was bound at the path since
+    struct UnixSocketFile {
+        std::filesystem::path path;
+        dev_t device;
+        ino_t inode;
+    };
+
+    struct LingeringSocket {
+        FileDescriptor socket;
+        std::chrono::steady_clock::time_point deadline;
     };
 
+    HttpServerConfig config_;
+    const std::string service_unavailable_response_;
     FileDescriptor epoll_fd_;
-    FileDescriptor listening_socket_;
+    std::vector<ListenAddress> listen_addresses_;
+    // All of them are served by the same event loop
+    std::vector<FileDescriptor> listening_sockets_;
+    // Handed over along with the listening sockets on a hot upgrade
+    std::vector<UnixSocketFile> unix_socket_files_;
+    // Kept open so that a connection can still be accepted and shed when out of file descriptors
+    FileDescriptor reserve_fd_;
+    FileDescriptor signal_fd_;
+    bool accepting_paused_{false};
+    bool draining_{false};
+    std::chrono::steady_clock::time_point drain_deadline_;
+    // Set while a hot-upgraded instance has yet to acknowledge the listening sockets
+    std::optional<UpgradedProcess> upgrade_;
+    std::chrono::steady_clock::time_point upgrade_deadline_;
+    std::size_t buffered_bytes_{0};
     std::unordered_map<int, ConnectionState> connections_;
+    // Rejected connections whose remaining input is read and dropped, closed in deadline order
+    std::unordered_map<int, LingeringSocket> lingering_sockets_;
+    std::deque<std::pair<int, std::chrono::steady_clock::time_point>> lingering_deadlines_;
+    // Connections which ran out of read budget while still having data, served round-robin
+    std::deque<int> ready_queue_;
+    // Connections whose asynchronous response finished, closed once the current events are processed
+    std::vector<int> finished_connections_;
+    // HTTP/2 connections with frames queued by response streams, sent once the current events are processed
+    std::vector<int> http2_output_connections_;
+    // File Descriptors registered by handlers through the EventLoop interface
+    std::unordered_map<int, EventLoopListener*> listeners_;
+    // Outlives the handlers, which may still hold responses it records
+    std::optional<ResponseCache> response_cache_;
     std::vector<std::unique_ptr<HttpHandlerBase>> handlers_;
+    std::unique_ptr<AccessLog> access_log_;
+    std::optional<AccessLog::Writer> access_log_writer_;
+    std::unique_ptr<AccessLog> slow_request_log_;
+    std::optional<AccessLog::Writer> slow_request_log_writer_;
+    std::optional<RateLimiter> rate_limiter_;
 
 public:
+    explicit HttpServer(HttpServerConfig config = {});
+    ~HttpServer();
+
     void AddHandler(std::unique_ptr<HttpHandlerBase> handler);
 
+    void AddListener(ListenAddress address);
+
+    void Run();
     void Run(const std::variant<std::string, uint32_t>& ipv4_address, std::uint16_t port);
 
 private:
     void CreateEPoll();
-    void AddFileDescriptorToEPoll(FileDescriptor& fd);
+    void OpenAccessLog();
+    void AddFileDescriptorToEPoll(FileDescriptor& fd, std::uint32_t events);
     void RemoveFileDescriptorFromEPoll(FileDescriptor& fd);
 
-    void OpenListeningSocket(const std::variant<std::string, uint32_t>& ipv4_address, std::uint16_t port);
-    void Listen();
+    FileDescriptor OpenListeningSocket(const ListenAddress& address);
+    void Listen(FileDescriptor& listening_socket);
+    void TakeOverListeningSockets(FileDescriptor& handoff_channel);
+    void ConfigureListeningSocket(FileDescriptor& listening_socket);
+    FileDescriptor* FindListeningSocket(int fd) noexcept;
+    void PinToCpus();
+
+    void SetUpSignalHandling();
+    void HandleSignals();
+    void HotUpgrade();
+    void ProcessHotUpgradeAck();
+    void AbandonHotUpgrade(std::string_view reason);
+    void StartDraining();
 
     void RunEventLoop();
-    void AcceptNewConnections();
-    void ProcessConnection(int socket_fd);
+    // Earliest point in time at which something waits for the event loop regardless of events
+    std::optional<std::chrono::steady_clock::time_point> GetNextDeadline() const noexcept;
+    void AcceptNewConnections(FileDescriptor& listening_socket);
+    void ProcessConnection(int socket_fd, std::uint32_t events);
+    // Both read at most read_budget bytes, what is left of the budget of the current wakeup
+    bool TryStartFileUpload(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                            size_t read_budget);
+    void ContinueFileUpload(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                            size_t read_budget);
+    void ProcessReadyQueue();
+    void StartHttp2(std::unordered_map<int, ConnectionState>::iterator connection_state_it);
+    void UpgradeToHttp2(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                        std::string_view settings, HttpRequest request);
+    void ProcessHttp2Connection(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                                std::uint32_t events);
+    void SendHttp2Output(std::unordered_map<int, ConnectionState>::iterator connection_state_it);
+    void ScheduleHttp2Output(int socket_fd);
+    void ProcessHttp2OutputConnections();
+    void ProcessFinishedConnections();
+    void CloseConnection(std::unordered_map<int, ConnectionState>::iterator connection_state_it);
+
+    // Writes what the socket takes right away and keeps the rest; false once the client is gone.
+    // more_data follows data in the same system call.
+    bool WriteToConnection(ConnectionState& connection_state, std::string_view data,
+                           std::string_view more_data = {});
+    bool FlushConnection(ConnectionState& connection_state);
+    bool SendOutputFile(ConnectionState& connection_state);
+    void FinishResponse(int socket_fd, bool abort);
+    void StartAccessLogRecord(ConnectionState& connection_state, const HttpRequest* request);
+    void WriteAccessLogRecord(ConnectionState& connection_state);
+    void WriteHttp2AccessLogRecord(int socket_fd, const Http2StreamStats& stats);
+
+    bool IsOverloaded() const noexcept;
+    void ShedConnection(FileDescriptor& client_socket);
+    void ThrottleConnection(FileDescriptor& client_socket, std::chrono::seconds retry_after);
+    bool ShedConnectionUsingReserveFileDescriptor(FileDescriptor& listening_socket);
+    void Linger(FileDescriptor client_socket);
+    void ProcessLingeringSocket(int socket_fd);
+    void CloseExpiredLingeringSockets();
+
+    HttpHandlerBase* FindHandler(const HttpRequest& request) const;
+    void HandleRequest(std::unordered_map<int, ConnectionState>::iterator connection_state_it, HttpRequest request);
+    void HandleHttp2Request(int socket_fd, HttpRequest request, std::shared_ptr<HttpResponseStream> response_stream);
+    void SendResponse(std::unordered_map<int, ConnectionState>::iterator connection_state_it,
+                      const HttpResponse& response);
 
-    HttpResponse HandleRequest(const HttpRequest& request);
+    void Register(int fd, std::uint32_t events, EventLoopListener& listener) override;
+    void Modify(int fd, std::uint32_t events) override;
+    void Unregister(int fd) override;
 };
 
 #endif //HTTP_SERVER_SERVER_H
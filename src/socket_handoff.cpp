@@ -0,0 +1,222 @@
+#include "socket_handoff.h"
+
+#include "str_utils.h"
+
+#include <array>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <utility>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+namespace {
+constexpr size_t kMaxHandedOffFileDescriptors{64};
+constexpr char kHandoffAck{'R'};
+
+std::vector<std::string> ReadOwnCommandLine() {
+    std::ifstream fs{"/proc/self/cmdline", std::ios_base::binary};
+    const std::string cmdline{std::istreambuf_iterator<char>{fs}, std::istreambuf_iterator<char>{}};
+
+    std::vector<std::string> args;
+    std::string_view rest{cmdline};
+    while (!rest.empty()) {
+        const size_t arg_size{std::min(rest.find('\0'), rest.size())};
+        args.emplace_back(rest.substr(0, arg_size));
+        rest.remove_prefix(std::min(arg_size + 1, rest.size()));
+    }
+    return args;
+}
+
+// Environment of the upgraded process: the current one with the number of the channel's child end
+std::vector<std::string> MakeUpgradedEnvironment(int channel_fd) {
+    const std::string channel_variable{std::string{kSocketHandoffChannelEnv} + '='};
+    std::vector<std::string> environment;
+    for (char** variable{environ}; *variable != nullptr; ++variable) {
+        if (!std::string_view{*variable}.starts_with(channel_variable)) {
+            environment.emplace_back(*variable);
+        }
+    }
+    environment.push_back(channel_variable + std::to_string(channel_fd));
+    return environment;
+}
+
+std::vector<char*> ToNullTerminatedArray(std::vector<std::string>& strings) {
+    std::vector<char*> array;
+    for (std::string& str : strings) {
+        array.push_back(str.data());
+    }
+    array.push_back(nullptr);
+    return array;
+}
+
+// Runs in the forked child of a process with other threads, which may have held the malloc lock at the fork.
+// Only async-signal-safe calls are allowed, so nothing here allocates.
+[[noreturn]] void ExecUpgradedProcess(int channel_fd, const char* binary, char* const* argv, char* const* envp) noexcept {
+    // Only the child end of the channel crosses exec, everything else is close-on-exec
+    if (fcntl(channel_fd, F_SETFD, 0) == -1) {
+        _exit(EXIT_FAILURE);
+    }
+
+    sigset_t empty_mask;
+    sigemptyset(&empty_mask);
+    sigprocmask(SIG_SETMASK, &empty_mask, nullptr);
+
+    execve(binary, argv, envp);
+    _exit(EXIT_FAILURE);
+}
+}
+
+UpgradedProcess SpawnUpgradedProcess() {
+    std::array<int, 2> channel_fds;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel_fds.data()) == -1) {
+        throw SocketHandoffException{StrError("socketpair failed")};
+    }
+    FileDescriptor parent_channel{channel_fds[0]};
+    FileDescriptor child_channel{channel_fds[1]};
+
+    // Prepared before fork, only async-signal-safe calls are allowed in the child
+    std::vector<std::string> args{ReadOwnCommandLine()};
+    const std::vector<char*> argv{ToNullTerminatedArray(args)};
+    std::vector<std::string> environment{MakeUpgradedEnvironment(child_channel.Get())};
+    const std::vector<char*> envp{ToNullTerminatedArray(environment)};
+    if (args.empty()) {
+        throw SocketHandoffException{"Failed to read own command line"};
+    }
+    // Resolved path rather than /proc/self/exe so that a binary replaced on disk is picked up
+    // and the process keeps its name
+    std::error_code ec;
+    std::string binary{std::filesystem::read_symlink("/proc/self/exe", ec)};
+    if (ec) {
+        throw SocketHandoffException{"Failed to resolve own binary: " + ec.message()};
+    }
+    // Once the binary was replaced by a rename, the link names the old file with this suffix
+    static constexpr std::string_view kDeletedSuffix{" (deleted)"};
+    if (binary.ends_with(kDeletedSuffix)) {
+        binary.resize(binary.size() - kDeletedSuffix.size());
+    }
+
+    const pid_t pid{fork()};
+    if (pid == -1) {
+        throw SocketHandoffException{StrError("fork failed")};
+    }
+    if (pid == 0) {
+        ExecUpgradedProcess(child_channel.Get(), binary.c_str(), argv.data(), envp.data());
+    }
+    return UpgradedProcess{.pid = pid, .channel = std::move(parent_channel)};
+}
+
+void AbandonUpgradedProcess(UpgradedProcess& process) noexcept {
+    if (process.pid != -1) {
+        kill(process.pid, SIGKILL);
+        waitpid(process.pid, nullptr, 0);
+        process.pid = -1;
+    }
+    process.channel.Close();
+}
+
+std::optional<FileDescriptor> TakeInheritedHandoffChannel() {
+    const std::string env_name{kSocketHandoffChannelEnv};
+    const char* channel_fd_str{getenv(env_name.c_str())};
+    if (channel_fd_str == nullptr) {
+        return std::nullopt;
+    }
+    const std::optional<size_t> channel_fd{TryParseSizeT(channel_fd_str)};
+    unsetenv(env_name.c_str());
+    if (!channel_fd) {
+        throw SocketHandoffException{"Invalid " + env_name + " value"};
+    }
+
+    FileDescriptor channel{static_cast<int>(*channel_fd)};
+    if (fcntl(channel.Get(), F_SETFD, FD_CLOEXEC) == -1) {
+        throw SocketHandoffException{StrError("Inherited handoff channel is not a valid File Descriptor")};
+    }
+    return channel;
+}
+
+void SendFileDescriptors(FileDescriptor& channel, std::span<const int> fds) {
+    if (fds.empty() || fds.size() > kMaxHandedOffFileDescriptors) {
+        throw SocketHandoffException{"Unsupported number of File Descriptors to hand off"};
+    }
+
+    // At least one byte of regular data has to accompany the ancillary data
+    char count{static_cast<char>(fds.size())};
+    iovec iov{.iov_base = &count, .iov_len = sizeof(count)};
+
+    alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int) * kMaxHandedOffFileDescriptors)> control{};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+    cmsghdr* header{CMSG_FIRSTHDR(&message)};
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(header), fds.data(), sizeof(int) * fds.size());
+
+    if (sendmsg(channel.Get(), &message, MSG_NOSIGNAL) == -1) {
+        throw SocketHandoffException{StrError("Failed to send File Descriptors")};
+    }
+}
+
+std::vector<FileDescriptor> ReceiveFileDescriptors(FileDescriptor& channel) {
+    char count{0};
+    iovec iov{.iov_base = &count, .iov_len = sizeof(count)};
+
+    alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(int) * kMaxHandedOffFileDescriptors)> control{};
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+
+    if (recvmsg(channel.Get(), &message, MSG_CMSG_CLOEXEC) <= 0) {
+        throw SocketHandoffException{StrError("Failed to receive File Descriptors")};
+    }
+
+    std::vector<FileDescriptor> fds;
+    for (cmsghdr* header{CMSG_FIRSTHDR(&message)}; header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const size_t fds_count{(header->cmsg_len - CMSG_LEN(0)) / sizeof(int)};
+        for (size_t i{0}; i < fds_count; ++i) {
+            int fd;
+            std::memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            fds.emplace_back(fd);
+        }
+    }
+
+    if ((message.msg_flags & MSG_CTRUNC) != 0 || fds.size() != static_cast<size_t>(count)) {
+        throw SocketHandoffException{"Received incomplete set of File Descriptors"};
+    }
+    return fds;
+}
+
+void SendHandoffAck(FileDescriptor& channel) {
+    if (send(channel.Get(), &kHandoffAck, sizeof(kHandoffAck), MSG_NOSIGNAL) != sizeof(kHandoffAck)) {
+        throw SocketHandoffException{StrError("Failed to acknowledge handoff")};
+    }
+}
+
+HandoffAck ReceiveHandoffAck(FileDescriptor& channel) {
+    char ack{0};
+    const ssize_t bytes_read{recv(channel.Get(), &ack, sizeof(ack), MSG_DONTWAIT)};
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return HandoffAck::kPending;
+    }
+    return bytes_read == sizeof(ack) && ack == kHandoffAck ? HandoffAck::kReceived : HandoffAck::kFailed;
+}
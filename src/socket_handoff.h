@@ -0,0 +1,51 @@
+#ifndef HTTP_SERVER_SOCKET_HANDOFF_H
+#define HTTP_SERVER_SOCKET_HANDOFF_H
+
+#include "file_descriptor.h"
+
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+// Hands listening sockets over to a freshly exec'd instance of the server during a hot upgrade.
+// The new process finds its end of the Unix socket channel in kSocketHandoffChannelEnv, receives
+// the sockets over SCM_RIGHTS and acknowledges once it is ready to serve them.
+
+struct SocketHandoffException : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+inline constexpr std::string_view kSocketHandoffChannelEnv{"HTTP_SERVER_HANDOFF_FD"};
+
+struct UpgradedProcess {
+    pid_t pid{-1};
+    FileDescriptor channel;
+};
+
+// Re-executes the running binary with the same arguments, the channel is the parent's end
+UpgradedProcess SpawnUpgradedProcess();
+
+// Kills and reaps an upgraded process which failed to take over
+void AbandonUpgradedProcess(UpgradedProcess& process) noexcept;
+
+// Channel inherited from the previous instance, if this process was started by a hot upgrade
+std::optional<FileDescriptor> TakeInheritedHandoffChannel();
+
+void SendFileDescriptors(FileDescriptor& channel, std::span<const int> fds);
+std::vector<FileDescriptor> ReceiveFileDescriptors(FileDescriptor& channel);
+
+enum class HandoffAck {
+    kPending,
+    kReceived,
+    kFailed,
+};
+
+void SendHandoffAck(FileDescriptor& channel);
+// Reads the acknowledgement off a non-blocking channel, e.g. once the event loop reports it readable
+HandoffAck ReceiveHandoffAck(FileDescriptor& channel);
+
+#endif //HTTP_SERVER_SOCKET_HANDOFF_H
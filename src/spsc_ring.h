@@ -0,0 +1,50 @@
+#ifndef HTTP_SERVER_SPSC_RING_H
+#define HTTP_SERVER_SPSC_RING_H
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <new>
+
+#include <cstddef>
+
+// Bounded lock-free queue for exactly one producer and one consumer thread
+template <typename T, std::size_t Capacity>
+class SpscRing {
+    static_assert(std::has_single_bit(Capacity), "Capacity must be a power of two");
+
+    static constexpr std::size_t kCacheLineSize{64};
+
+    // Written by the consumer only
+    alignas(kCacheLineSize) std::atomic<std::size_t> head_{0};
+    // Written by the producer only; cached_head_ saves reading the consumer's cache line on every push
+    alignas(kCacheLineSize) std::atomic<std::size_t> tail_{0};
+    std::size_t cached_head_{0};
+    alignas(kCacheLineSize) std::array<T, Capacity> slots_;
+
+public:
+    bool TryPush(const T& value) noexcept {
+        const std::size_t tail{tail_.load(std::memory_order_relaxed)};
+        if (tail - cached_head_ == Capacity) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ == Capacity) {
+                return false;
+            }
+        }
+        slots_[tail & (Capacity - 1)] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool TryPop(T& value) noexcept {
+        const std::size_t head{head_.load(std::memory_order_relaxed)};
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = slots_[head & (Capacity - 1)];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif //HTTP_SERVER_SPSC_RING_H
@@ -29,6 +29,12 @@ std::string_view ReadWord(std::string_view& str) noexcept {
     return word;
 }
 
+bool EqualsIgnoreCase(std::string_view lhs, std::string_view rhs) noexcept {
+    return std::ranges::equal(lhs, rhs, [](char lhs_ch, char rhs_ch) {
+        return tolower(static_cast<unsigned char>(lhs_ch)) == tolower(static_cast<unsigned char>(rhs_ch));
+    });
+}
+
 std::optional<size_t> TryParseSizeT(std::string_view str) noexcept {
     size_t result{0};
     const auto [ptr, ec]{std::from_chars(str.data(), str.data() + str.size(), result)};
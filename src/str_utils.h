@@ -17,6 +17,8 @@ std::string_view Strip(std::string_view str) noexcept;
 
 std::string_view ReadWord(std::string_view& str) noexcept;
 
+bool EqualsIgnoreCase(std::string_view lhs, std::string_view rhs) noexcept;
+
 std::optional<size_t> TryParseSizeT(std::string_view str) noexcept;
 
 std::string StrError(std::string_view str);
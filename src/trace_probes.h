@@ -0,0 +1,26 @@
+#ifndef HTTP_SERVER_TRACE_PROBES_H
+#define HTTP_SERVER_TRACE_PROBES_H
+
+// USDT probe points of the "http_server" provider, e.g. for bpftrace:
+//   bpftrace -e 'usdt:./server:http_server:request__finished { @[arg1] = hist(arg2); }'
+// They compile to a nop unless a tracer attaches. Without <sys/sdt.h> (systemtap-sdt-dev) they are left out.
+//
+//   connection__accepted (int fd)
+//   request__parsed      (int fd, const char* path)
+//   handler__started     (int fd, const char* path)
+//   handler__finished    (int fd, unsigned status)
+//   request__finished    (int fd, unsigned status, std::int64_t duration_ns)
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+
+#define HTTP_SERVER_PROBE1(name, arg1) DTRACE_PROBE1(http_server, name, arg1)
+#define HTTP_SERVER_PROBE2(name, arg1, arg2) DTRACE_PROBE2(http_server, name, arg1, arg2)
+#define HTTP_SERVER_PROBE3(name, arg1, arg2, arg3) DTRACE_PROBE3(http_server, name, arg1, arg2, arg3)
+#else
+#define HTTP_SERVER_PROBE1(name, arg1) static_cast<void>(0)
+#define HTTP_SERVER_PROBE2(name, arg1, arg2) static_cast<void>(0)
+#define HTTP_SERVER_PROBE3(name, arg1, arg2, arg3) static_cast<void>(0)
+#endif
+
+#endif //HTTP_SERVER_TRACE_PROBES_H
@@ -0,0 +1,277 @@
+#include "upstream_response_parser.h"
+
+#include "http_utils.h"
+#include "str_utils.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+
+#include <cassert>
+
+namespace {
+constexpr std::string_view kTransferEncodingHeader{"Transfer-Encoding"};
+constexpr std::string_view kConnectionHeader{"Connection"};
+
+// Hop-by-hop headers are meaningful for the upstream connection only
+constexpr std::array<std::string_view, 6> kHopByHopHeaders{
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade",
+};
+
+constexpr auto FindHttpLineTerminator(std::string_view str) noexcept {
+    return std::search(str.begin(), str.end(), kHttpLineTerminator.begin(), kHttpLineTerminator.end());
+}
+
+std::optional<std::string_view> ReadLine(std::string_view& buffer) noexcept {
+    const auto line_last_it{FindHttpLineTerminator(buffer)};
+    if (line_last_it == buffer.end()) {
+        return std::nullopt;
+    }
+    const std::string_view line{buffer.begin(), line_last_it};
+    buffer.remove_prefix(line.size() + kHttpLineTerminator.size());
+    return line;
+}
+}
+
+UpstreamResponseParserState UpstreamResponseParser::Parse(std::string& buffer, const BodyCallback& on_body) {
+    std::string_view current_buffer{buffer};
+    bool keep_parsing{true};
+    while (keep_parsing) {
+        switch (state_) {
+        case UpstreamResponseParserState::kStatusLine:
+            keep_parsing = ParseStatusLine(current_buffer);
+            break;
+        case UpstreamResponseParserState::kHeaders:
+            keep_parsing = ParseHeaders(current_buffer);
+            break;
+        case UpstreamResponseParserState::kBody:
+            keep_parsing = ParseBody(current_buffer, on_body);
+            break;
+        case UpstreamResponseParserState::kChunkSize:
+            keep_parsing = ParseChunkSize(current_buffer);
+            break;
+        case UpstreamResponseParserState::kChunkData:
+            keep_parsing = ParseChunkData(current_buffer, on_body);
+            break;
+        case UpstreamResponseParserState::kChunkDataEnd:
+            keep_parsing = ParseChunkDataEnd(current_buffer);
+            break;
+        case UpstreamResponseParserState::kTrailers:
+            keep_parsing = ParseTrailers(current_buffer);
+            break;
+        case UpstreamResponseParserState::kFinished:
+        case UpstreamResponseParserState::kError:
+            keep_parsing = false;
+            break;
+        }
+    }
+    buffer.erase(buffer.begin(), buffer.end() - current_buffer.size());
+    return state_;
+}
+
+UpstreamResponseParserState UpstreamResponseParser::ParseEof() {
+    if (state_ == UpstreamResponseParserState::kBody && delimited_by_close_) {
+        state_ = UpstreamResponseParserState::kFinished;
+    } else if (state_ != UpstreamResponseParserState::kFinished) {
+        state_ = UpstreamResponseParserState::kError;
+    }
+    return state_;
+}
+
+bool UpstreamResponseParser::HasHead() const noexcept {
+    return state_ != UpstreamResponseParserState::kStatusLine
+        && state_ != UpstreamResponseParserState::kHeaders
+        && state_ != UpstreamResponseParserState::kError;
+}
+
+bool UpstreamResponseParser::IsReusable() const noexcept {
+    return state_ == UpstreamResponseParserState::kFinished && keep_alive_ && !delimited_by_close_;
+}
+
+bool UpstreamResponseParser::ParseStatusLine(std::string_view& buffer) {
+    assert(state_ == UpstreamResponseParserState::kStatusLine);
+
+    const std::optional<std::string_view> status_line{ReadLine(buffer)};
+    if (!status_line) {
+        return false;
+    }
+
+    std::string_view rest{*status_line};
+    const std::string_view http_version{ReadWord(rest)};
+    const std::string_view status{Strip(rest)};
+    if (!http_version.starts_with("HTTP/1.") || status.size() < 3 || !TryParseSizeT(status.substr(0, 3))) {
+        state_ = UpstreamResponseParserState::kError;
+        return false;
+    }
+
+    status_ = status;
+    keep_alive_ = http_version == kHttpVersion;
+    state_ = UpstreamResponseParserState::kHeaders;
+    return true;
+}
+
+bool UpstreamResponseParser::ParseHeaders(std::string_view& buffer) {
+    assert(state_ == UpstreamResponseParserState::kHeaders);
+
+    while (const std::optional<std::string_view> header{ReadLine(buffer)}) {
+        // End of headers
+        if (std::ranges::all_of(*header, &IsWs)) {
+            StartBody();
+            return state_ != UpstreamResponseParserState::kError;
+        }
+
+        const auto header_key_last{std::find(header->begin(), header->end(), ':')};
+        const std::string_view key{Strip(std::string_view{header->begin(), header_key_last})};
+        const std::string_view value{Strip(std::string_view{
+            header_key_last != header->end() ? std::next(header_key_last) : header->end(), header->end()})};
+        if (key.empty() || header_key_last == header->end()) {
+            state_ = UpstreamResponseParserState::kError;
+            return false;
+        }
+
+        if (EqualsIgnoreCase(key, kHttpContentLengthHeader)) {
+            content_length_ = TryParseSizeT(value);
+            if (!content_length_) {
+                state_ = UpstreamResponseParserState::kError;
+                return false;
+            }
+        } else if (EqualsIgnoreCase(key, kTransferEncodingHeader)) {
+            // Only chunked is understood, anything else runs until the connection is closed
+            chunked_ = EqualsIgnoreCase(value, "chunked");
+            delimited_by_close_ = !chunked_;
+        } else if (EqualsIgnoreCase(key, kConnectionHeader)) {
+            if (EqualsIgnoreCase(value, "close")) {
+                keep_alive_ = false;
+            } else if (EqualsIgnoreCase(value, "keep-alive")) {
+                keep_alive_ = true;
+            }
+        } else if (std::ranges::none_of(kHopByHopHeaders, [key](std::string_view hop_by_hop) {
+                       return EqualsIgnoreCase(key, hop_by_hop);
+                   })) {
+            headers_.emplace_back(key, value);
+        }
+    }
+
+    // Complete header yet to be received
+    return false;
+}
+
+void UpstreamResponseParser::StartBody() {
+    const std::string_view status_code{std::string_view{status_}.substr(0, 3)};
+    if (status_code.starts_with('1')) {
+        // Nothing was asked to switch protocols, whatever follows is not HTTP/1.1
+        if (status_code == "101") {
+            state_ = UpstreamResponseParserState::kError;
+            return;
+        }
+        // 100 Continue, 103 Early Hints and the like: the final response follows
+        status_.clear();
+        headers_.clear();
+        content_length_ = std::nullopt;
+        chunked_ = false;
+        delimited_by_close_ = false;
+        interim_response_received_ = true;
+        state_ = UpstreamResponseParserState::kStatusLine;
+        return;
+    }
+    const bool has_no_body{status_code == "204" || status_code == "304"};
+
+    if (chunked_) {
+        // Chunked encoding takes precedence over Content-Length
+        content_length_ = std::nullopt;
+        state_ = has_no_body ? UpstreamResponseParserState::kFinished : UpstreamResponseParserState::kChunkSize;
+    } else if (has_no_body) {
+        state_ = UpstreamResponseParserState::kFinished;
+    } else if (content_length_ && !delimited_by_close_) {
+        remaining_ = *content_length_;
+        state_ = remaining_ == 0 ? UpstreamResponseParserState::kFinished : UpstreamResponseParserState::kBody;
+    } else {
+        content_length_ = std::nullopt;
+        delimited_by_close_ = true;
+        state_ = UpstreamResponseParserState::kBody;
+    }
+}
+
+bool UpstreamResponseParser::ParseBody(std::string_view& buffer, const BodyCallback& on_body) {
+    assert(state_ == UpstreamResponseParserState::kBody);
+
+    if (buffer.empty()) {
+        return false;
+    }
+    const size_t to_read_size{delimited_by_close_ ? buffer.size() : std::min(remaining_, buffer.size())};
+    const std::string_view data{buffer.substr(0, to_read_size)};
+    buffer.remove_prefix(to_read_size);
+    if (!delimited_by_close_) {
+        remaining_ -= to_read_size;
+        if (remaining_ == 0) {
+            state_ = UpstreamResponseParserState::kFinished;
+        }
+    }
+    return on_body(data) && state_ == UpstreamResponseParserState::kBody && !buffer.empty();
+}
+
+bool UpstreamResponseParser::ParseChunkSize(std::string_view& buffer) {
+    assert(state_ == UpstreamResponseParserState::kChunkSize);
+
+    const std::optional<std::string_view> line{ReadLine(buffer)};
+    if (!line) {
+        return false;
+    }
+    // Chunk extensions are ignored
+    const std::string_view chunk_size_str{Strip(line->substr(0, line->find(';')))};
+    size_t chunk_size{0};
+    const auto [ptr, ec]{std::from_chars(
+        chunk_size_str.data(), chunk_size_str.data() + chunk_size_str.size(), chunk_size, 16)};
+    if (chunk_size_str.empty() || ec != std::errc{} || ptr != chunk_size_str.data() + chunk_size_str.size()) {
+        state_ = UpstreamResponseParserState::kError;
+        return false;
+    }
+
+    remaining_ = chunk_size;
+    state_ = chunk_size == 0 ? UpstreamResponseParserState::kTrailers : UpstreamResponseParserState::kChunkData;
+    return true;
+}
+
+bool UpstreamResponseParser::ParseChunkData(std::string_view& buffer, const BodyCallback& on_body) {
+    assert(state_ == UpstreamResponseParserState::kChunkData);
+
+    if (buffer.empty()) {
+        return false;
+    }
+    const size_t to_read_size{std::min(remaining_, buffer.size())};
+    const std::string_view data{buffer.substr(0, to_read_size)};
+    buffer.remove_prefix(to_read_size);
+    remaining_ -= to_read_size;
+    if (remaining_ == 0) {
+        state_ = UpstreamResponseParserState::kChunkDataEnd;
+    }
+    return on_body(data);
+}
+
+bool UpstreamResponseParser::ParseChunkDataEnd(std::string_view& buffer) {
+    assert(state_ == UpstreamResponseParserState::kChunkDataEnd);
+
+    if (buffer.size() < kHttpLineTerminator.size()) {
+        return false;
+    }
+    if (!buffer.starts_with(kHttpLineTerminator)) {
+        state_ = UpstreamResponseParserState::kError;
+        return false;
+    }
+    buffer.remove_prefix(kHttpLineTerminator.size());
+    state_ = UpstreamResponseParserState::kChunkSize;
+    return true;
+}
+
+bool UpstreamResponseParser::ParseTrailers(std::string_view& buffer) {
+    assert(state_ == UpstreamResponseParserState::kTrailers);
+
+    // Trailers are dropped, they cannot be forwarded once the head is sent
+    while (const std::optional<std::string_view> trailer{ReadLine(buffer)}) {
+        if (trailer->empty()) {
+            state_ = UpstreamResponseParserState::kFinished;
+            return false;
+        }
+    }
+    return false;
+}
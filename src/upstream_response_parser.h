@@ -0,0 +1,73 @@
+#ifndef HTTP_SERVER_UPSTREAM_RESPONSE_PARSER_H
+#define HTTP_SERVER_UPSTREAM_RESPONSE_PARSER_H
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <cstddef>
+
+enum class UpstreamResponseParserState {
+    kStatusLine,
+    kHeaders,
+    kBody,
+    kChunkSize,
+    kChunkData,
+    kChunkDataEnd,
+    kTrailers,
+    kFinished,
+    kError,
+};
+
+// Incremental parser for HTTP/1.1 responses received from upstream servers. Body bytes are not
+// accumulated, they are handed to the body callback as soon as they are parsed. Interim 1xx responses
+// are skipped, the head is the one of the final response.
+class UpstreamResponseParser {
+public:
+    // Returns false to pause parsing, e.g. when the client does not keep up
+    using BodyCallback = std::function<bool(std::string_view)>;
+
+private:
+    UpstreamResponseParserState state_{UpstreamResponseParserState::kStatusLine};
+    std::string status_;
+    std::vector<std::pair<std::string, std::string>> headers_;
+    std::optional<size_t> content_length_;
+    size_t remaining_{0};
+    bool chunked_{false};
+    bool delimited_by_close_{false};
+    bool keep_alive_{true};
+    bool interim_response_received_{false};
+
+public:
+    UpstreamResponseParserState GetState() const noexcept { return state_; }
+    UpstreamResponseParserState Parse(std::string& buffer, const BodyCallback& on_body);
+    // Upstream closed the connection, which completes a body delimited by close
+    UpstreamResponseParserState ParseEof();
+
+    bool HasHead() const noexcept;
+    // Status code followed by reason phrase, e.g. "200 OK"
+    const std::string& GetStatus() const noexcept { return status_; }
+    // Headers without the hop-by-hop and framing ones
+    const std::vector<std::pair<std::string, std::string>>& GetHeaders() const noexcept { return headers_; }
+    std::optional<size_t> GetContentLength() const noexcept { return content_length_; }
+    // The upstream connection can carry another request once the response is finished
+    bool IsReusable() const noexcept;
+    // A 1xx response was skipped, so the upstream already started on the request
+    bool HasInterimResponse() const noexcept { return interim_response_received_; }
+
+private:
+    bool ParseStatusLine(std::string_view& buffer);
+    bool ParseHeaders(std::string_view& buffer);
+    bool ParseBody(std::string_view& buffer, const BodyCallback& on_body);
+    bool ParseChunkSize(std::string_view& buffer);
+    bool ParseChunkData(std::string_view& buffer, const BodyCallback& on_body);
+    bool ParseChunkDataEnd(std::string_view& buffer);
+    bool ParseTrailers(std::string_view& buffer);
+
+    void StartBody();
+};
+
+#endif //HTTP_SERVER_UPSTREAM_RESPONSE_PARSER_H
@@ -0,0 +1,176 @@
+#include "hpack.h"
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <cstddef>
+
+// Decodes the examples of RFC 7541 Appendix C, each header block in order with the decoder of its section
+
+namespace {
+struct Example {
+    std::string_view name;
+    // Hex digits, spaces are ignored
+    std::string_view block;
+    HpackHeaderList expected;
+};
+
+struct Section {
+    std::string_view name;
+    std::size_t max_table_size;
+    std::vector<Example> examples;
+};
+
+int failures{0};
+
+void Check(bool condition, std::string_view what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        ++failures;
+    }
+}
+
+std::string FromHex(std::string_view hex) {
+    std::string bytes;
+    int high{-1};
+    for (const char c : hex) {
+        if (c == ' ') {
+            continue;
+        }
+        const int digit{c <= '9' ? c - '0' : c - 'a' + 10};
+        if (high == -1) {
+            high = digit;
+        } else {
+            bytes += static_cast<char>(high << 4 | digit);
+            high = -1;
+        }
+    }
+    return bytes;
+}
+
+const HpackHeaderList kRequest1{
+    {":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}};
+const HpackHeaderList kRequest2{
+    {":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"},
+    {"cache-control", "no-cache"}};
+const HpackHeaderList kRequest3{
+    {":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"}, {":authority", "www.example.com"},
+    {"custom-key", "custom-value"}};
+const HpackHeaderList kResponse1{
+    {":status", "302"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+    {"location", "https://www.example.com"}};
+const HpackHeaderList kResponse2{
+    {":status", "307"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+    {"location", "https://www.example.com"}};
+const HpackHeaderList kResponse3{
+    {":status", "200"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+    {"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+    {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}};
+
+const std::vector<Section> kSections{
+    {"C.2.1", kHpackDefaultTableSize, {
+        {"literal with indexing",
+         "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+         {{"custom-key", "custom-header"}}}}},
+    {"C.2.2", kHpackDefaultTableSize, {
+        {"literal without indexing", "040c 2f73 616d 706c 652f 7061 7468", {{":path", "/sample/path"}}}}},
+    {"C.2.3", kHpackDefaultTableSize, {
+        {"literal never indexed", "1008 7061 7373 776f 7264 0673 6563 7265 74", {{"password", "secret"}}}}},
+    {"C.2.4", kHpackDefaultTableSize, {
+        {"indexed", "82", {{":method", "GET"}}}}},
+    {"C.3", kHpackDefaultTableSize, {
+        {"first request", "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", kRequest1},
+        {"second request", "8286 84be 5808 6e6f 2d63 6163 6865", kRequest2},
+        {"third request",
+         "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+         kRequest3}}},
+    {"C.4", kHpackDefaultTableSize, {
+        {"first request", "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", kRequest1},
+        {"second request", "8286 84be 5886 a8eb 1064 9cbf", kRequest2},
+        {"third request", "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf", kRequest3}}},
+    {"C.5", 256, {
+        {"first response",
+         "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a"
+         "3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+         kResponse1},
+        {"second response", "4803 3330 37c1 c0bf", kResponse2},
+        {"third response",
+         "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04"
+         "677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49"
+         "553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e 3d31",
+         kResponse3}}},
+    {"C.6", 256, {
+        {"first response",
+         "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e"
+         "919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+         kResponse1},
+        {"second response", "4883 640e ffc1 c0bf", kResponse2},
+        {"third response",
+         "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7"
+         "821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed"
+         "4ee5 b106 3d50 07",
+         kResponse3}}},
+};
+
+void TestAppendixC() {
+    for (const Section& section : kSections) {
+        HpackDecoder decoder{section.max_table_size};
+        for (const Example& example : section.examples) {
+            const std::string what{std::string{section.name} + " " + std::string{example.name}};
+            HpackHeaderList headers;
+            Check(decoder.Decode(FromHex(example.block), headers), what + " decodes");
+            Check(headers == example.expected, what + " gives the expected fields");
+        }
+    }
+}
+
+void TestEncoderRoundTrip() {
+    HpackEncoder encoder;
+    HpackDecoder decoder;
+    for (const HpackHeaderList* headers : {&kResponse1, &kResponse2, &kResponse3, &kResponse1}) {
+        std::string block;
+        encoder.Encode(*headers, block);
+        HpackHeaderList decoded;
+        Check(decoder.Decode(block, decoded) && decoded == *headers, "encoded response decodes to itself");
+    }
+}
+
+void TestTableSizeUpdateAfterField() {
+    HpackDecoder decoder;
+    HpackHeaderList headers;
+    // Size update to 0 ahead of the first field, then again behind it
+    Check(decoder.Decode(FromHex("2082"), headers), "table size update at the start of a block");
+    Check(!decoder.Decode(FromHex("8220"), headers), "table size update after a field fails");
+}
+
+void TestHeaderListSize() {
+    // custom-key: custom-header is 55 bytes with the overhead, as entry 62 it is referenced with one byte
+    const std::string add{FromHex("400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572")};
+    {
+        HpackDecoder decoder{kHpackDefaultTableSize, 110};
+        HpackHeaderList headers;
+        Check(decoder.Decode(add + FromHex("be"), headers), "header list of exactly the limit");
+    }
+    {
+        HpackDecoder decoder{kHpackDefaultTableSize, 110};
+        HpackHeaderList headers;
+        Check(!decoder.Decode(add + FromHex("bebe"), headers), "header list beyond the limit fails");
+        Check(headers.size() == 2, "fields beyond the limit are not copied");
+    }
+}
+}
+
+int main() {
+    TestAppendixC();
+    TestEncoderRoundTrip();
+    TestTableSizeUpdateAfterField();
+    TestHeaderListSize();
+    if (failures != 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "All checks passed\n";
+    return 0;
+}
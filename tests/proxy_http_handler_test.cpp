@@ -0,0 +1,171 @@
+#include "proxy_http_handler.h"
+
+#include <array>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdlib>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Runs the proxy against a listening socket standing in for the upstream, the test plays the event loop
+
+namespace {
+int failures{0};
+
+void Check(bool condition, std::string_view what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        ++failures;
+    }
+}
+
+class TestEventLoop final : public EventLoop {
+    std::unordered_map<int, EventLoopListener*> listeners_;
+
+public:
+    void Register(int fd, std::uint32_t, EventLoopListener& listener) override { listeners_[fd] = &listener; }
+    void Modify(int, std::uint32_t) override {}
+    void Unregister(int fd) override { listeners_.erase(fd); }
+
+    // Reports every registered File Descriptor as writable, which sends the requests of connected sockets
+    void MakeWritable() {
+        std::vector<int> fds;
+        for (const auto& [fd, listener] : listeners_) {
+            fds.push_back(fd);
+        }
+        for (const int fd : fds) {
+            if (auto listener_it{listeners_.find(fd)}; listener_it != listeners_.end()) {
+                listener_it->second->OnEvents(fd, EPOLLOUT);
+            }
+        }
+    }
+};
+
+class TestResponseStream final : public HttpResponseStream {
+public:
+    std::string status;
+
+    void WriteHead(std::string_view head_status, const Headers&, std::optional<size_t>) override {
+        status = head_status;
+    }
+    bool WriteBody(std::string_view) override { return true; }
+    void Finish() override {}
+    void Abort() override {}
+    bool IsClosed() const noexcept override { return false; }
+    void SetWritableCallback(std::function<void()>) override {}
+};
+
+struct Upstream {
+    FileDescriptor socket;
+    std::string name;
+};
+
+Upstream ListenOnLoopback() {
+    Upstream upstream{.socket = FileDescriptor{socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)}};
+    sockaddr_in addr{.sin_family = AF_INET, .sin_port = 0, .sin_addr = {.s_addr = htonl(INADDR_LOOPBACK)}};
+    socklen_t addr_len{sizeof(addr)};
+    if (bind(upstream.socket.Get(), reinterpret_cast<sockaddr*>(&addr), addr_len) != 0
+            || listen(upstream.socket.Get(), 16) != 0
+            || getsockname(upstream.socket.Get(), reinterpret_cast<sockaddr*>(&addr), &addr_len) != 0) {
+        std::cerr << "Failed to listen on the loopback interface\n";
+        std::exit(1);
+    }
+    upstream.name = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+    return upstream;
+}
+
+// What the upstream received on the next connection, nothing when the proxy did not connect
+std::optional<std::string> Receive(Upstream& upstream) {
+    pollfd poll_fd{.fd = upstream.socket.Get(), .events = POLLIN};
+    if (poll(&poll_fd, 1, 200) != 1) {
+        return std::nullopt;
+    }
+    FileDescriptor connection{accept4(upstream.socket.Get(), nullptr, nullptr, SOCK_CLOEXEC)};
+    if (connection.IsEmpty()) {
+        return std::nullopt;
+    }
+    std::string received;
+    std::array<char, 4096> buf;
+    poll_fd = pollfd{.fd = connection.Get(), .events = POLLIN};
+    while (received.find("\r\n\r\n") == std::string::npos && poll(&poll_fd, 1, 1000) == 1) {
+        const ssize_t bytes_read{read(connection.Get(), buf.data(), buf.size())};
+        if (bytes_read <= 0) {
+            break;
+        }
+        received.append(buf.data(), static_cast<std::size_t>(bytes_read));
+    }
+    return received;
+}
+
+bool HasHeader(std::string_view request, std::string_view header) {
+    return request.find("\r\n" + std::string{header} + ":") != std::string_view::npos;
+}
+
+void TestTransferEncodingIsRejected() {
+    Upstream upstream{ListenOnLoopback()};
+    ProxyHttpHandler handler{"/", {upstream.name}};
+    TestEventLoop event_loop;
+    handler.Attach(event_loop);
+
+    // Smuggles a second request behind the end of a chunked body
+    constexpr std::string_view kSmuggled{"0\r\n\r\nGET /admin HTTP/1.1\r\nX: "};
+    auto with_length{std::make_shared<TestResponseStream>()};
+    handler.HandleRequestAsync(HttpRequest{
+        .method = HttpMethod::kPost, .path = "/upload",
+        .headers = {{"transfer-encoding", "chunked"}, {"Content-Length", std::to_string(kSmuggled.size())}},
+        .body = std::string{kSmuggled}}, with_length);
+    Check(with_length->status.starts_with("400"), "Transfer-Encoding with Content-Length is a bad request");
+
+    auto without_length{std::make_shared<TestResponseStream>()};
+    handler.HandleRequestAsync(HttpRequest{
+        .method = HttpMethod::kPost, .path = "/upload", .headers = {{"Transfer-Encoding", "gzip, chunked"}}},
+        without_length);
+    Check(without_length->status.starts_with("501"), "Transfer-Encoding alone is not implemented");
+
+    event_loop.MakeWritable();
+    Check(!Receive(upstream), "requests with Transfer-Encoding never reach the upstream");
+}
+
+void TestHopByHopHeadersAreDropped() {
+    Upstream upstream{ListenOnLoopback()};
+    ProxyHttpHandler handler{"/", {upstream.name}};
+    TestEventLoop event_loop;
+    handler.Attach(event_loop);
+
+    auto response_stream{std::make_shared<TestResponseStream>()};
+    handler.HandleRequestAsync(HttpRequest{
+        .method = HttpMethod::kGet, .path = "/",
+        .headers = {{"Connection", "keep-alive, X-Hop"}, {"X-Hop", "1"}, {"Keep-Alive", "timeout=5"},
+                    {"X-Kept", "1"}}}, response_stream);
+    event_loop.MakeWritable();
+    const std::optional<std::string> request{Receive(upstream)};
+    Check(request.has_value(), "request reaches the upstream");
+    if (request) {
+        Check(HasHeader(*request, "X-Kept"), "end-to-end headers are forwarded");
+        Check(!HasHeader(*request, "Connection") && !HasHeader(*request, "Keep-Alive"),
+              "hop-by-hop headers are dropped");
+        Check(!HasHeader(*request, "X-Hop"), "headers named in Connection are dropped");
+    }
+}
+}
+
+int main() {
+    TestTransferEncodingIsRejected();
+    TestHopByHopHeadersAreDropped();
+    if (failures != 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "All checks passed\n";
+    return 0;
+}
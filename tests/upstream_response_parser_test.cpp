@@ -0,0 +1,72 @@
+#include "upstream_response_parser.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+namespace {
+int failures{0};
+
+void Check(bool condition, std::string_view what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << '\n';
+        ++failures;
+    }
+}
+
+// Feeds the response in pieces of the given size and collects the body
+UpstreamResponseParserState ParseInPieces(UpstreamResponseParser& parser, std::string_view response,
+                                          std::size_t piece_size, std::string& body) {
+    std::string buffer;
+    UpstreamResponseParserState state{parser.GetState()};
+    while (!response.empty()) {
+        buffer += response.substr(0, piece_size);
+        response.remove_prefix(std::min(piece_size, response.size()));
+        state = parser.Parse(buffer, [&body](std::string_view data) {
+            body += data;
+            return true;
+        });
+    }
+    Check(buffer.empty(), "nothing is left in the buffer");
+    return state;
+}
+
+void TestInterimResponses() {
+    constexpr std::string_view kResponse{
+        "HTTP/1.1 100 Continue\r\n\r\n"
+        "HTTP/1.1 103 Early Hints\r\nLink: </style.css>; rel=preload\r\n\r\n"
+        "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nX-Final: yes\r\n\r\nhello"};
+    for (const std::size_t piece_size : {kResponse.size(), std::size_t{7}, std::size_t{1}}) {
+        UpstreamResponseParser parser;
+        std::string body;
+        const UpstreamResponseParserState state{ParseInPieces(parser, kResponse, piece_size, body)};
+        const std::string what{" in pieces of " + std::to_string(piece_size)};
+        Check(state == UpstreamResponseParserState::kFinished, "final response is finished" + what);
+        Check(parser.GetStatus() == "200 OK", "status is the final one" + what);
+        Check(parser.GetHeaders().size() == 1 && parser.GetHeaders().front().first == "X-Final",
+              "headers are the final ones" + what);
+        Check(body == "hello", "body is the final one" + what);
+        Check(parser.IsReusable() && parser.HasInterimResponse(), "connection is reusable" + what);
+    }
+}
+
+void TestSwitchingProtocols() {
+    UpstreamResponseParser parser;
+    std::string body;
+    const UpstreamResponseParserState state{ParseInPieces(
+        parser, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n\r\n", 64, body)};
+    Check(state == UpstreamResponseParserState::kError, "unrequested switch of protocols fails");
+}
+}
+
+int main() {
+    TestInterimResponses();
+    TestSwitchingProtocols();
+    if (failures != 0) {
+        std::cerr << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "All checks passed\n";
+    return 0;
+}